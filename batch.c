@@ -0,0 +1,348 @@
+/*
+ *	Headless scripted runs
+ *
+ *	A batch script drives the MUX ports without a terminal. Each line is
+ *	one step, run in order:
+ *
+ *	expect <unit> "text"	wait for text to be transmitted on a port
+ *	send <unit> "text"	type text into a port
+ *	timeout <ms>		emulated time limit for the following expects
+ *	wait <ms>		let emulated time pass
+ *	halt			wait for the CPU to halt, within the timeout
+ *	parity <addr>		plant a parity error at a physical address (hex)
+ *
+ *	Strings take C style \r \n \t \\ \" and \xNN escapes, \x taking one
+ *	or two hex digits. Blank lines and
+ *	lines starting with # are ignored. When the last step completes the
+ *	emulator stops and exits with BATCH_PASS. An expect timing out, or
+ *	the machine stopping first, gives BATCH_FAIL. A halt step is the one
+ *	way to let the machine stop, so it only makes sense last.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+#include "centurion.h"
+#include "mux.h"
+#include "scheduler.h"
+
+#define BATCH_EXPECT	0
+#define BATCH_SEND	1
+#define BATCH_TIMEOUT	2
+#define BATCH_WAIT	3
+#define BATCH_HALT	4
+#define BATCH_PARITY	5
+
+/* Transmitted text kept for matching. Larger than any sensible pattern */
+#define BATCH_HISTORY	4096
+
+struct batch_step {
+	unsigned type;
+	unsigned unit;
+	unsigned line;
+	char *text;
+	unsigned len;
+	int64_t ms;
+	uint32_t addr;
+};
+
+static const char *batch_name;
+static struct batch_step *steps;
+static unsigned num_steps;
+static unsigned step;
+static unsigned batch_active;
+static int batch_status = BATCH_FAIL;
+
+static int64_t expect_timeout_ns = 10 * ONE_SECOND_NS;
+static unsigned send_ptr;
+
+static char history[NUM_MUX_UNITS][BATCH_HISTORY];
+static unsigned history_len[NUM_MUX_UNITS];
+
+static void batch_timeout_cb(struct event_t *event, int64_t late_ns);
+static struct event_t batch_timeout_evt = {
+	.name = "batch_timeout",
+	.callback = batch_timeout_cb
+};
+
+static void batch_step_cb(struct event_t *event, int64_t late_ns);
+static struct event_t batch_step_evt = {
+	.name = "batch_step",
+	.callback = batch_step_cb
+};
+
+static void batch_run(void);
+
+static void batch_finish(int status)
+{
+	batch_status = status;
+	batch_active = 0;
+	cancel_event(&batch_timeout_evt);
+	cancel_event(&batch_step_evt);
+	emulator_done = 1;
+}
+
+static void batch_next(void)
+{
+	step++;
+	send_ptr = 0;
+	batch_run();
+}
+
+/* Look for the pattern in everything sent since the last match, and
+   drop the history up to the end of it if found */
+static int batch_match(struct batch_step *s)
+{
+	char *h = history[s->unit];
+	unsigned len = history_len[s->unit];
+	unsigned i;
+
+	for (i = 0; i + s->len <= len; i++) {
+		if (memcmp(h + i, s->text, s->len) == 0) {
+			i += s->len;
+			memmove(h, h + i, len - i);
+			history_len[s->unit] = len - i;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void batch_run(void)
+{
+	while (batch_active) {
+		struct batch_step *s;
+
+		if (step == num_steps) {
+			batch_finish(BATCH_PASS);
+			return;
+		}
+		s = &steps[step];
+		switch (s->type) {
+		case BATCH_EXPECT:
+			if (batch_match(s))
+				break;
+			/* Fall through */
+		case BATCH_HALT:
+			batch_timeout_evt.delta_ns = expect_timeout_ns;
+			schedule_event(&batch_timeout_evt);
+			return;
+		case BATCH_SEND:
+			/* Characters go in one at a time as the port drains */
+			batch_step_evt.delta_ns = 0;
+			schedule_event(&batch_step_evt);
+			return;
+		case BATCH_TIMEOUT:
+			expect_timeout_ns = s->ms * ONE_MILISECOND_NS;
+			break;
+		case BATCH_WAIT:
+			batch_step_evt.delta_ns = s->ms * ONE_MILISECOND_NS;
+			schedule_event(&batch_step_evt);
+			return;
+		case BATCH_PARITY:
+			mem_parity_inject(s->addr);
+			break;
+		}
+		step++;
+	}
+}
+
+static void batch_step_cb(struct event_t *event, int64_t late_ns)
+{
+	struct batch_step *s = &steps[step];
+
+	if (s->type == BATCH_WAIT) {
+		batch_next();
+		return;
+	}
+	/* BATCH_SEND */
+	if (!mux_rx_busy(s->unit))
+		mux_inject(s->unit, (uint8_t)s->text[send_ptr++], 0);
+	if (send_ptr == s->len) {
+		batch_next();
+		return;
+	}
+	batch_step_evt.delta_ns = 100 * ONE_MICROSECOND_NS;
+	schedule_event(&batch_step_evt);
+}
+
+static void batch_timeout_cb(struct event_t *event, int64_t late_ns)
+{
+	struct batch_step *s = &steps[step];
+
+	if (s->type == BATCH_HALT)
+		fprintf(stderr, "%s:%u: timed out waiting for halt\n",
+			batch_name, s->line);
+	else
+		fprintf(stderr, "%s:%u: timed out waiting for \"%.*s\" on MUX%u\n",
+			batch_name, s->line, s->len, s->text, s->unit);
+	batch_finish(BATCH_FAIL);
+}
+
+void batch_output(unsigned unit, uint8_t c)
+{
+	struct batch_step *s;
+
+	if (!batch_active)
+		return;
+
+	if (history_len[unit] == BATCH_HISTORY) {
+		memmove(history[unit], history[unit] + 1, BATCH_HISTORY - 1);
+		history_len[unit]--;
+	}
+	history[unit][history_len[unit]++] = c & 0x7F;
+
+	s = &steps[step];
+	if (step < num_steps && s->type == BATCH_EXPECT && s->unit == unit
+	    && batch_match(s)) {
+		cancel_event(&batch_timeout_evt);
+		batch_next();
+	}
+}
+
+void batch_halted(void)
+{
+	if (batch_active && step < num_steps && steps[step].type == BATCH_HALT) {
+		cancel_event(&batch_timeout_evt);
+		batch_next();
+	}
+}
+
+int batch_exit_code(void)
+{
+	return batch_status;
+}
+
+static void batch_syntax(unsigned line, const char *why)
+{
+	fprintf(stderr, "%s:%u: %s\n", batch_name, line, why);
+	exit(BATCH_ERROR);
+}
+
+/* The one or two hex digits of a \x escape */
+static uint8_t batch_hex(char *p, char **end, unsigned line)
+{
+	char digits[3] = { 0 };
+
+	if (!isxdigit((unsigned char)p[0]))
+		batch_syntax(line, "\\x without hex digits");
+	digits[0] = *p++;
+	if (isxdigit((unsigned char)*p))
+		digits[1] = *p++;
+	*end = p;
+	return strtoul(digits, NULL, 16);
+}
+
+/* Parse a quoted string with escapes in place, returning its length */
+static unsigned batch_string(char *p, char **out, unsigned line)
+{
+	char *o;
+
+	if (*p != '"')
+		batch_syntax(line, "expected quoted string");
+	*out = o = ++p;
+	while (*p != '"') {
+		if (*p == '\0' || *p == '\n')
+			batch_syntax(line, "unterminated string");
+		if (*p != '\\') {
+			*o++ = *p++;
+			continue;
+		}
+		p++;
+		switch (*p) {
+		case 'r':
+			*o++ = '\r';
+			break;
+		case 'n':
+			*o++ = '\n';
+			break;
+		case 't':
+			*o++ = '\t';
+			break;
+		case 'x':
+			*o++ = batch_hex(p + 1, &p, line);
+			continue;
+		case '\0':
+			batch_syntax(line, "unterminated string");
+			break;
+		default:
+			*o++ = *p;
+			break;
+		}
+		p++;
+	}
+	return o - *out;
+}
+
+void batch_open(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	char buf[512];
+	unsigned line = 0;
+
+	if (fp == NULL) {
+		perror(path);
+		exit(BATCH_ERROR);
+	}
+	batch_name = path;
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		struct batch_step s;
+		char cmd[16];
+		int n;
+
+		line++;
+		if (sscanf(buf, " %15s%n", cmd, &n) != 1 || *cmd == '#')
+			continue;
+
+		memset(&s, 0, sizeof(s));
+		s.line = line;
+		if (strcmp(cmd, "expect") == 0 || strcmp(cmd, "send") == 0) {
+			int m;
+			char *text;
+
+			s.type = *cmd == 'e' ? BATCH_EXPECT : BATCH_SEND;
+			if (sscanf(buf + n, " %u %n", &s.unit, &m) != 1
+			    || s.unit >= NUM_MUX_UNITS)
+				batch_syntax(line, "bad MUX unit");
+			s.len = batch_string(buf + n + m, &text, line);
+			if (s.len == 0)
+				batch_syntax(line, "empty string");
+			s.text = malloc(s.len);
+			if (s.text == NULL) {
+				fprintf(stderr, "Out of memory.\n");
+				exit(BATCH_ERROR);
+			}
+			memcpy(s.text, text, s.len);
+		} else if (strcmp(cmd, "timeout") == 0 || strcmp(cmd, "wait") == 0) {
+			long long ms;
+
+			s.type = *cmd == 't' ? BATCH_TIMEOUT : BATCH_WAIT;
+			if (sscanf(buf + n, " %lld", &ms) != 1 || ms < 0)
+				batch_syntax(line, "bad time");
+			s.ms = ms;
+		} else if (strcmp(cmd, "halt") == 0)
+			s.type = BATCH_HALT;
+		else if (strcmp(cmd, "parity") == 0) {
+			s.type = BATCH_PARITY;
+			if (sscanf(buf + n, " %x", &s.addr) != 1
+			    || !mem_parity_valid(s.addr))
+				batch_syntax(line, "bad address");
+		} else
+			batch_syntax(line, "unknown command");
+
+		steps = realloc(steps, (num_steps + 1) * sizeof(*steps));
+		if (steps == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(BATCH_ERROR);
+		}
+		steps[num_steps++] = s;
+	}
+	fclose(fp);
+
+	batch_active = 1;
+	batch_run();
+}
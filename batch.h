@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Process exit codes for a scripted run */
+#define BATCH_PASS	0
+#define BATCH_FAIL	1
+#define BATCH_ERROR	2
+
+void batch_open(const char *path);
+void batch_output(unsigned unit, uint8_t c);
+void batch_halted(void);
+int batch_exit_code(void);
@@ -0,0 +1,159 @@
+#!/bin/sh
+#
+#	Emulator benchmark harness
+#
+#	Runs a fixed set of workloads headless and unthrottled, printing one
+#	JSON line per workload with the emulated instruction count, emulated
+#	and host time, MIPS, host ns per emulated instruction, the ratio of
+#	emulated to host time and the number of host system calls made.
+#
+#	usage: bench/run.sh [workload...]
+#
+#	CENTURION	emulator binary (default ./centurion)
+#	CENTURION_ROMS	directory holding the ROM images (default .)
+#	BENCH_OUT	also append the results to this file
+#
+#	The diag workload needs the diag ROMs and is skipped without them.
+#	The others are small raw binaries that never touch the bootstrap, so
+#	a blank bootstrap image stands in when the real one is missing.
+
+CENTURION=$(cd "$(dirname "${CENTURION:-./centurion}")" && pwd)/$(basename "${CENTURION:-./centurion}")
+ROMS=$(cd "${CENTURION_ROMS:-.}" && pwd)
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/centurion-bench.XXXXXX") || exit 1
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+# Assemble a raw binary from hex, ignoring everything after ';' on a line
+hexbin()
+{
+	sed 's/;.*//' | xxd -r -p > "$WORK/$1.bin"
+}
+
+# MUX0 "Hellorld!" 256 times, polling the transmitter ready bit
+hexbin hellorld <<EOF
+60 01 00	; 0100	LDX #256
+d0 01 1a	; 0103	LDB #msg
+81 f2 00	; 0106	LDAB (F200)
+2c 2c		; 0109	SRR AL; SRR AL	L = TX ready
+11 f9		; 010B	BNL 0106
+85 21		; 010D	LDAB (B+)
+14 05		; 010F	BZ 0116
+a1 f2 01	; 0111	STAB (F201)
+73 f0		; 0114	JMP 0106
+3f		; 0116	DCX
+15 ea		; 0117	BNZ 0103
+00		; 0119	HLT
+48656c6c6f726c64210d0a00 ; 011A	"Hellorld!\r\n"
+EOF
+
+# Block ops: 256 byte copy, fill and compare plus a 4K copy, 4096 times
+hexbin blockop <<EOF
+60 10 00		; 0100	LDX #4096
+47 40 ff 10 00 20 00	; 0103	memcpy 1000 -> 2000, 256
+47 90 ff 10 00 30 00	; 010A	memset 3000 from (1000), 256
+47 80 ff 20 00 10 00	; 0111	memcmp 2000, 1000, 256
+90 40 00 5c		; 0118	LDA #4000; XAY
+90 0f ff		; 011C	LDA #0FFF
+d0 10 00		; 011F	LDB #1000
+f7			; 0122	memcpy16 (B) -> (Y), A + 1
+3f			; 0123	DCX
+15 dd			; 0124	BNZ 0103
+00			; 0126	HLT
+EOF
+
+# Bignum: 64bit binary to decimal and back, 16384 times
+hexbin bignum <<EOF
+90 12 34 b1 10 00	; 0100	big = 123456781ABCDEF0
+90 56 78 b1 10 02
+90 1a bc b1 10 04
+90 de f0 b1 10 06
+60 40 00		; 0118	LDX #16384
+80 14			; 011B	LDAB #20
+46 87 90 30 00 10 00	; 011D	ascii(3000, 20) = big(1000, 8)
+80 14			; 0124	LDAB #20
+46 87 80 10 00 30 00	; 0126	big(1000, 8) = ascii(3000, 20)
+3f			; 012D	DCX
+15 eb			; 012E	BNZ 011B
+00			; 0130	HLT
+EOF
+
+# Hawk: seek and DMA a whole track into memory, for 256 tracks of drive 0
+hexbin hawk <<EOF
+80 00 a1 f1 40		; 0100	select unit 0
+60 01 00		; 0105	LDX #256
+91 03 00		; 0108	LDA (0300)	track << 4
+b1 f1 41		; 010B	STA (F141)
+30 0f			; 010E	INR A, 16
+b1 03 00		; 0110	STA (0300)
+80 02 a1 f1 48		; 0113	seek
+81 f1 48 2c 10 fa	; 0118	wait while busy
+90 20 00 2f 00		; 011E	DMA address 2000
+90 e6 ff 2f 02		; 0123	DMA count 6400
+2f 06			; 0128	DMA enable
+80 00 a1 f1 48		; 012A	read
+81 f1 48 2c 10 fa	; 012F	wait while busy
+3f			; 0135	DCX
+15 d0			; 0136	BNZ 0108
+00			; 0138	HLT
+EOF
+
+printf 'timeout 600000\nhalt\n' > "$WORK/halt.scr"
+
+cat > "$WORK/diag.scr" <<EOF
+timeout 20000
+expect 0 "ENTER TEST NUMBER:"
+send 0 "01\r"
+wait 10000
+EOF
+
+if [ -f "$ROMS/bootstrap_unscrambled.bin" ]; then
+	cp "$ROMS/bootstrap_unscrambled.bin" "$WORK/"
+else
+	dd if=/dev/zero of="$WORK/bootstrap_unscrambled.bin" bs=512 count=1 2>/dev/null
+fi
+for rom in Diag_F1_Rev_1.0.BIN Diag_F2_Rev_1.0.BIN Diag_F3_Rev_1.0.BIN \
+	   Diag_F4_1133CMD.BIN; do
+	[ -f "$ROMS/$rom" ] && cp "$ROMS/$rom" "$WORK/"
+done
+
+# An empty removable platter for the hawk workload
+dd if=/dev/zero of="$WORK/hawk0.disk" bs=400 count=12992 2>/dev/null
+
+# run <name> <script> <emulator args...>
+run()
+{
+	name=$1
+	script=$2
+	shift 2
+	if ! (cd "$WORK" && "$CENTURION" -x "$script" -P "$name.perf" "$@" \
+			> "$name.out" 2>&1); then
+		echo "$name: failed, output follows" >&2
+		cat "$WORK/$name.out" >&2
+		status=1
+		return
+	fi
+	result="{\"workload\": \"$name\", $(sed 's/^{//' "$WORK/$name.perf")"
+	echo "$result"
+	[ -n "$BENCH_OUT" ] && echo "$result" >> "$BENCH_OUT"
+}
+
+status=0
+for w in ${*:-diag hellorld blockop bignum hawk}; do
+	case $w in
+	diag)
+		if [ ! -f "$WORK/Diag_F4_1133CMD.BIN" ]; then
+			echo "diag: skipped, no diag ROMs in $ROMS" >&2
+			continue
+		fi
+		run diag diag.scr -d -s 1 -S 13
+		;;
+	hellorld|blockop|bignum|hawk)
+		run $w halt.scr -b -A 0x100 $w.bin
+		;;
+	*)
+		echo "$w: unknown workload" >&2
+		status=1
+		;;
+	esac
+done
+exit $status
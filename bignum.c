@@ -0,0 +1,197 @@
+/*
+ *	Multi-limb integer arithmetic for the 46 bignum instructions
+ *
+ *	The guest keeps big numbers as big endian two's complement byte
+ *	strings of 1 to 16 bytes. They are widened into 64bit limbs, worked
+ *	on a limb at a time with 128bit intermediates, and narrowed again.
+ *	Everything is modulo 2^(64 * BIGNUM_LIMBS); signs and widths are the
+ *	caller's business.
+ */
+
+#include <string.h>
+
+#include "bignum.h"
+
+__extension__ typedef unsigned __int128 uint128_t;
+
+/* Load a big endian byte string, zero extended */
+void bignum_load(uint64_t *r, const uint8_t *p, unsigned len)
+{
+	unsigned i;
+
+	memset(r, 0, BIGNUM_LIMBS * sizeof(*r));
+	for (i = 0; i < len; i++)
+		r[i / 8] |= (uint64_t)p[len - 1 - i] << ((i % 8) * 8);
+}
+
+/* Store the low len bytes big endian */
+void bignum_store(const uint64_t *r, uint8_t *p, unsigned len)
+{
+	unsigned i;
+
+	for (i = 0; i < len; i++)
+		p[len - 1 - i] = r[i / 8] >> ((i % 8) * 8);
+}
+
+/* r = a + b, returns the carry out of the top limb */
+unsigned bignum_add(uint64_t *r, const uint64_t *a, const uint64_t *b)
+{
+	uint128_t t = 0;
+	unsigned i;
+
+	for (i = 0; i < BIGNUM_LIMBS; i++) {
+		t += (uint128_t)a[i] + b[i];
+		r[i] = t;
+		t >>= 64;
+	}
+	return t;
+}
+
+/* r = a - b, returns the borrow out of the top limb */
+unsigned bignum_sub(uint64_t *r, const uint64_t *a, const uint64_t *b)
+{
+	unsigned borrow = 0;
+	unsigned i;
+
+	for (i = 0; i < BIGNUM_LIMBS; i++) {
+		uint128_t t = (uint128_t)a[i] - b[i] - borrow;
+		r[i] = t;
+		borrow = (t >> 64) != 0;
+	}
+	return borrow;
+}
+
+/* r = a * b, schoolbook, truncated to BIGNUM_LIMBS. r may alias a or b */
+void bignum_mul(uint64_t *r, const uint64_t *a, const uint64_t *b)
+{
+	uint64_t t[BIGNUM_LIMBS] = { 0 };
+	unsigned i, j;
+
+	for (i = 0; i < BIGNUM_LIMBS; i++) {
+		uint128_t carry = 0;
+
+		if (a[i] == 0)
+			continue;
+		for (j = 0; i + j < BIGNUM_LIMBS; j++) {
+			carry += (uint128_t)a[i] * b[j] + t[i + j];
+			t[i + j] = carry;
+			carry >>= 64;
+		}
+	}
+	memcpy(r, t, sizeof(t));
+}
+
+/*
+ *	q = n / d, rem = n % d, unsigned. The 46 operands are no wider than
+ *	128 bits so only the low two limbs take part. d must not be zero.
+ */
+void bignum_div(uint64_t *q, uint64_t *rem, const uint64_t *n,
+	const uint64_t *d)
+{
+	uint128_t nv = ((uint128_t)n[1] << 64) | n[0];
+	uint128_t dv = ((uint128_t)d[1] << 64) | d[0];
+	uint128_t qv = nv / dv;
+	uint128_t rv = nv % dv;
+
+	memset(q, 0, BIGNUM_LIMBS * sizeof(*q));
+	memset(rem, 0, BIGNUM_LIMBS * sizeof(*rem));
+	q[0] = qv;
+	q[1] = qv >> 64;
+	rem[0] = rv;
+	rem[1] = rv >> 64;
+}
+
+/* r /= d for a small divisor, returns the remainder. Done in 32bit
+   halves so it stays in native 64bit division */
+unsigned bignum_div_small(uint64_t *r, unsigned d)
+{
+	uint64_t rem = 0;
+	int i;
+
+	for (i = BIGNUM_LIMBS - 1; i >= 0; i--) {
+		uint64_t hi, lo;
+
+		if (r[i] == 0 && rem == 0)
+			continue;
+		hi = (rem << 32) | (r[i] >> 32);
+		rem = hi % d;
+		lo = (rem << 32) | (r[i] & 0xFFFFFFFF);
+		rem = lo % d;
+		r[i] = ((hi / d) << 32) | (lo / d);
+	}
+	return rem;
+}
+
+/* r = r * m + add for small m and add */
+void bignum_mul_small(uint64_t *r, unsigned m, unsigned add)
+{
+	uint128_t t = add;
+	unsigned i;
+
+	for (i = 0; i < BIGNUM_LIMBS; i++) {
+		t += (uint128_t)r[i] * m;
+		r[i] = t;
+		t >>= 64;
+	}
+}
+
+void bignum_neg(uint64_t *r)
+{
+	static const uint64_t zero[BIGNUM_LIMBS];
+
+	bignum_sub(r, zero, r);
+}
+
+/* Copy bit len * 8 - 1 into all the bits above it */
+void bignum_sign_extend(uint64_t *r, unsigned len)
+{
+	unsigned bit = len * 8;
+	uint64_t fill = bignum_bit(r, bit - 1) ? ~(uint64_t)0 : 0;
+	unsigned i = bit / 64;
+
+	if (bit % 64) {
+		uint64_t mask = ~(uint64_t)0 << (bit % 64);
+		r[i] = (r[i] & ~mask) | (fill & mask);
+		i++;
+	}
+	for (; i < BIGNUM_LIMBS; i++)
+		r[i] = fill;
+}
+
+/* Clear all the bits above the low len bytes */
+void bignum_truncate(uint64_t *r, unsigned len)
+{
+	uint64_t t[BIGNUM_LIMBS];
+	uint8_t p[BIGNUM_LIMBS * 8];
+
+	memcpy(t, r, sizeof(t));
+	bignum_store(t, p, len);
+	bignum_load(r, p, len);
+}
+
+unsigned bignum_bit(const uint64_t *r, unsigned bit)
+{
+	return (r[bit / 64] >> (bit % 64)) & 1;
+}
+
+int bignum_is_zero(const uint64_t *r)
+{
+	unsigned i;
+
+	for (i = 0; i < BIGNUM_LIMBS; i++)
+		if (r[i])
+			return 0;
+	return 1;
+}
+
+/* True if r, taken as signed, survives being cut down to len bytes */
+int bignum_fits(const uint64_t *r, unsigned len)
+{
+	unsigned sign = bignum_bit(r, len * 8 - 1);
+	unsigned bit;
+
+	for (bit = len * 8; bit < BIGNUM_LIMBS * 64; bit++)
+		if (bignum_bit(r, bit) != sign)
+			return 0;
+	return 1;
+}
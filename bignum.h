@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ *	Numbers are held as 64bit limbs, least significant first. Guest
+ *	operands are at most 16 bytes, so there is room for a full product.
+ */
+#define BIGNUM_MAX_BYTES	16
+#define BIGNUM_LIMBS		4
+
+void bignum_load(uint64_t *r, const uint8_t *p, unsigned len);
+void bignum_store(const uint64_t *r, uint8_t *p, unsigned len);
+unsigned bignum_add(uint64_t *r, const uint64_t *a, const uint64_t *b);
+unsigned bignum_sub(uint64_t *r, const uint64_t *a, const uint64_t *b);
+void bignum_mul(uint64_t *r, const uint64_t *a, const uint64_t *b);
+void bignum_div(uint64_t *q, uint64_t *rem, const uint64_t *n,
+	const uint64_t *d);
+unsigned bignum_div_small(uint64_t *r, unsigned d);
+void bignum_mul_small(uint64_t *r, unsigned m, unsigned add);
+void bignum_neg(uint64_t *r);
+void bignum_sign_extend(uint64_t *r, unsigned len);
+void bignum_truncate(uint64_t *r, unsigned len);
+unsigned bignum_bit(const uint64_t *r, unsigned bit);
+int bignum_is_zero(const uint64_t *r);
+int bignum_fits(const uint64_t *r, unsigned len);
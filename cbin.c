@@ -1,20 +1,32 @@
 #include <assert.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 #include "cbin.h"
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// The file is mapped and each record checked where it lies, with no
+// copying. Its data is handed out as a pointer into the map.
 typedef struct cbin_state {
     const char* name;
-    FILE *fp;
+    const uint8_t *map;
+    size_t size;
     int errored;
     int finished;
     int idx;
     int sector;
-    uint8_t checksum_sum;
-    uint8_t buffer[SECTOR_SIZE];
+    const uint8_t *buffer; // The current sector
     struct cbin_record record;
 } cbin_state;
 
@@ -28,7 +40,7 @@ unsigned cbin_errored(cbin_state* cbin) {
 
 // Print common error message and mark cbin as errored
 void cbin_error(cbin_state* cbin) {
-    size_t file_offset = cbin->sector * SECTOR_SIZE + cbin->sector;
+    size_t file_offset = cbin->sector * SECTOR_SIZE + cbin->idx;
     fprintf(stderr, " at sector %i + %x (file offset: 0x%04zx)\n",
         cbin->sector, cbin->idx, file_offset);
     fprintf(stderr, "\n%s: centurion binary format load failed\n",
@@ -37,55 +49,80 @@ void cbin_error(cbin_state* cbin) {
     cbin->errored = 1;
 }
 
-static uint8_t cbin_read8(cbin_state* cbin) {
-    if (cbin->idx+1 > SECTOR_SIZE) {
-        fprintf(stderr, "sector overrun");
-        cbin_error(cbin);
-        return 0;
-    }
-    uint8_t byte = cbin->buffer[cbin->idx++];
-    cbin->checksum_sum += byte;
-
-    return byte;
-}
+uint8_t cbin_sum(const uint8_t *p, size_t len) {
+    uint8_t sum = 0;
 
-static uint16_t cbin_read16(cbin_state* cbin) {
-    return (cbin_read8(cbin) << 8) | cbin_read8(cbin);
+    while (len--)
+        sum += *p++;
+    return sum;
 }
 
 void cbin_next_sector(cbin_state* cbin) {
-    if (cbin->fp == NULL)
+    if (cbin->map == NULL)
         return;
 
     cbin->sector++;
     cbin->idx = 0;
-    size_t read_len = fread(cbin->buffer, 1, SECTOR_SIZE, cbin->fp);
-    if (read_len != SECTOR_SIZE) {
-        if (read_len == 0) {
-            perror("fread");
-            fprintf(stderr, "read error");
+    size_t offset = (size_t)cbin->sector * SECTOR_SIZE;
+    if (offset + SECTOR_SIZE > cbin->size) {
+        if (offset >= cbin->size) {
+            fprintf(stderr, "read past the end of the file");
         } else {
-            fprintf(stderr, "sector too small, only got %zu bytes", read_len);
+            fprintf(stderr, "sector too small, only got %zu bytes",
+                cbin->size - offset);
         }
         cbin_error(cbin);
+        return;
     }
+    cbin->buffer = cbin->map + offset;
+}
+
+static const uint8_t *map_file(int fd, size_t size)
+{
+#ifdef _WIN32
+    uint8_t *p = malloc(size);
+
+    if (p == NULL || read(fd, p, size) != size) {
+        free(p);
+        return NULL;
+    }
+    return p;
+#else
+    void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    return p == MAP_FAILED ? NULL : p;
+#endif
 }
 
 struct cbin_state* cbin_open(const char *name) {
+    struct stat st;
+    int fd;
+
     // create state object
     cbin_state* state = malloc(sizeof(cbin_state));
     assert(state != NULL);
     memset(state, 0, sizeof(cbin_state));
+    state->name = name;
 
-    // Open file
-    state->fp = fopen(name, "rb");
-	if (state->fp == NULL) {
-		perror("fopen");
-		cbin_error(state);
-	}
+    // Map the file
+    fd = open(name, O_RDONLY | O_BINARY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(name);
+        cbin_error(state);
+    } else if (st.st_size == 0) {
+        fprintf(stderr, "empty file");
+        cbin_error(state);
+    } else {
+        state->size = st.st_size;
+        state->map = map_file(fd, state->size);
+        if (state->map == NULL) {
+            perror(name);
+            cbin_error(state);
+        }
+    }
+    if (fd != -1)
+        close(fd);
 
-    // Setup initial state
-    state->name = name;
     state->sector = -1; // nextsector will increment
     cbin_next_sector(state);
 
@@ -94,20 +131,27 @@ struct cbin_state* cbin_open(const char *name) {
 
 void cbin_free(cbin_state* cbin) {
     assert(cbin != NULL);
-    if (cbin->fp) {
-        fclose(cbin->fp);
+    if (cbin->map) {
+#ifdef _WIN32
+        free((void *)cbin->map);
+#else
+        munmap((void *)cbin->map, cbin->size);
+#endif
     }
     free(cbin);
 }
 
 struct cbin_record* cbin_next_record(cbin_state* cbin) {
-    if (cbin->errored)
-        return NULL;
+    while(!cbin->errored) {
+        const uint8_t *p = cbin->buffer + cbin->idx;
 
-    while(1) {
-        cbin->checksum_sum = 0;
+        if (cbin->idx + 1 > SECTOR_SIZE) {
+            fprintf(stderr, "sector overrun");
+            cbin_error(cbin);
+            return NULL;
+        }
 
-        cbin->record.type = cbin_read8(cbin);
+        cbin->record.type = p[0];
 
         if (cbin->record.type == CBIN_END_FILE) {
             cbin->finished = 1;
@@ -119,9 +163,17 @@ struct cbin_record* cbin_next_record(cbin_state* cbin) {
             continue;
         }
 
-        uint8_t len = cbin_read8(cbin);
+        if (cbin->idx + 4 > SECTOR_SIZE) {
+            cbin->idx = SECTOR_SIZE;
+            fprintf(stderr, "sector overrun");
+            cbin_error(cbin);
+            return NULL;
+        }
+
+        uint8_t len = p[1];
         cbin->record.len = len;
-        cbin->record.addr = cbin_read16(cbin);
+        cbin->record.addr = (p[2] << 8) | p[3];
+        cbin->idx += 4;
 
         if((cbin->idx + len + 1) > SECTOR_SIZE) {
             fprintf(stderr, "record too big, %i bytes", len);
@@ -129,24 +181,21 @@ struct cbin_record* cbin_next_record(cbin_state* cbin) {
             return NULL;
         }
 
-        // copy data;
-        for (int i = 0; i < len; i++) {
-            // reading calculates checksum
-            cbin->record.data[i] = cbin_read8(cbin);
-        }
+        // The header, data and checksum in one go
+        cbin->record.data = p + 4;
+        cbin->idx += len + 1;
 
-        uint8_t checksum = -cbin->checksum_sum; // Negated
-        uint8_t expected = cbin_read8(cbin);
+        uint8_t checksum = -cbin_sum(p, len + 4); // Negated
+        uint8_t expected = p[len + 4];
 
         if (expected != checksum) {
             fprintf(stderr, "checksum error. Got %02x, Expected %02x",
                 checksum, expected);
             cbin_error(cbin);
-        }
-
-        if (cbin->errored)
             return NULL;
+        }
 
         return &cbin->record;
     }
+    return NULL;
 }
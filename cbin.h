@@ -1,3 +1,5 @@
+#include <stddef.h>
+#include <stdint.h>
 
 #define SECTOR_SIZE 400
 
@@ -21,11 +23,15 @@ struct cbin_record {
     uint8_t type;
     uint8_t len; // Might be limited to 0x78
     uint16_t addr;
-    uint8_t data[SECTOR_SIZE];
+    const uint8_t *data; // In the mapped file, good until cbin_free
 };
 
 typedef struct cbin_state cbin_state;
 
+// Adds up bytes for a record checksum, the byte after a good record
+// brings the sum of it to zero
+uint8_t cbin_sum(const uint8_t *p, size_t len);
+
 // Returns next record
 // Returns a NULL pointer if no more records exist
 struct cbin_record* cbin_next_record(cbin_state* cbin);
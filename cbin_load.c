@@ -4,6 +4,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 static uint16_t read_word(struct cbin_record* record, size_t offset) {
     uint16_t word = record->data[offset] << 8;
@@ -26,9 +27,23 @@ static void load_data(uint16_t *load_offset, struct cbin_record* record) {
         return;
     }
 
-    // Load len bytes of data to addr
-    for (int i = 0; i < record->len; i++) {
-        mem_write8_debug(record->addr + i + *load_offset, record->data[i]);
+    // Load len bytes of data to addr, a page at a time straight from the
+    // file when the page is RAM
+    for (unsigned i = 0; i < record->len; ) {
+        uint32_t addr = record->addr + i + *load_offset;
+        unsigned n = 0x800 - (addr & 0x7FF);
+        uint8_t *p;
+
+        if (n > record->len - i)
+            n = record->len - i;
+        p = mem_map_ram(addr, n, 1);
+        if (p) {
+            memcpy(p, record->data + i, n);
+        } else {
+            for (unsigned j = 0; j < n; j++)
+                mem_write8_debug(addr + j, record->data[i + j]);
+        }
+        i += n;
     }
 }
 
@@ -41,9 +56,21 @@ static void apply_fixups(uint16_t load_offset, struct cbin_record* record) {
     for (size_t i = 0; i < record->len; i += 2) {
         fixup_addr = read_word(record, i);
 
-        fixup_val = mem_read16_debug(fixup_addr + load_offset);
-        fixup_val += offset;
-        mem_write16_debug(fixup_addr + load_offset, fixup_val);
+        uint32_t addr = fixup_addr + load_offset;
+        uint8_t *p = NULL;
+
+        // A word within one page of RAM is patched in place
+        if ((addr & 0x7FF) != 0x7FF)
+            p = mem_map_ram(addr, 2, 1);
+        if (p) {
+            fixup_val = ((p[0] << 8) | p[1]) + offset;
+            p[0] = fixup_val >> 8;
+            p[1] = fixup_val;
+        } else {
+            fixup_val = mem_read16_debug(addr);
+            fixup_val += offset;
+            mem_write16_debug(addr, fixup_val);
+        }
     }
 }
 
@@ -3,26 +3,47 @@
  */
 
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
+#include "batch.h"
 #include "centurion.h"
+#include "checkpoint.h"
 #include "console.h"
 #include "cpu6.h"
+#include "debug.h"
 #include "dma.h"
 #include "dsk.h"
+#include "fdc.h"
+#include "machine.h"
 #include "mux.h"
 #include "cbin_load.h"
+#include "profile.h"
+#include "replay.h"
 #include "scheduler.h"
+#include "stats.h"
 
 static unsigned finch;		/* Finch or original FDC */
 
 volatile unsigned int emulator_done;
 static int64_t cpu_timestamp_ns = 0;
+long long instruction_count;
+
+/* What the main loop has to do besides running instructions */
+static unsigned throttle = 1;
+static uint64_t throttle_next;
+static long long terminate_at;
+
+unsigned long host_syscalls;
 
 #define TRACE_MEM_RD	1
 #define TRACE_MEM_WR	2
@@ -34,6 +55,7 @@ static int64_t cpu_timestamp_ns = 0;
 #define TRACE_MUX	128
 #define TRACE_DSK       256
 #define TRACE_SCHEDULER 512
+#define TRACE_IRQ	1024
 
 unsigned int trace = 0;
 
@@ -41,10 +63,177 @@ unsigned int switches;
 
 static unsigned diag = 0;
 
-/* 18 bit address space it seems if the top mmu bit is not used. Allocate
-   for the case it is for now */
-static uint8_t mem[0x80000];
-static uint8_t memclean[0x80000];
+/*
+ *	Physical memory
+ *
+ *	The MMU produces 19 bit addresses but the top bit doesn't seem to be
+ *	used, so unless there is more than 256K of RAM addresses wrap at 256K.
+ *	What is where is kept per 1K: RAM from 0 up to the size given with
+ *	--ram, the I/O window at 3F000-3FBFF, the bootstrap ROM from 3FC00,
+ *	the diag board's ROMs and RAM at 8000-BFFF with -d, and any further
+ *	ROMs given with --rom. Anything else reads as FF and ignores writes.
+ *
+ *	The backing store comes in 2K pages, allocated the first time the
+ *	page is written, so RAM that is never used costs nothing. ROM pages
+ *	are mapped read only from the image file where they can be, so all
+ *	the emulators on a host share the one copy. The bus map keeps the
+ *	guest from writing them, and a debugger write gets the page a copy
+ *	of its own first.
+ */
+#define MEM_SIZE		0x80000
+#define MEM_PAGE_SHIFT		11
+#define MEM_PAGE_SIZE		(1 << MEM_PAGE_SHIFT)
+#define MEM_BLOCK_SHIFT		10
+#define MAX_ROMS		8	/* --rom options */
+
+#define MEM_NONE		0
+#define MEM_RAM			1
+#define MEM_ROM			2
+#define MEM_IO			3
+#define MEM_WATCH		4	/* Flag, the debugger has a watchpoint here */
+
+static uint8_t *mem_page[MEM_SIZE >> MEM_PAGE_SHIFT];
+static uint8_t mem_type[MEM_SIZE >> MEM_BLOCK_SHIFT];
+static uint8_t mem_shared[MEM_SIZE >> MEM_PAGE_SHIFT];	/* Mapped ROM */
+static uint8_t mem_dirty[MEM_SIZE >> MEM_PAGE_SHIFT];	/* Since a checkpoint */
+static uint32_t mem_mask = 0x3FFFF;
+static uint32_t ram_size = 0x40000;
+/* Stands in for pages not yet written */
+static uint8_t zero_page[MEM_PAGE_SIZE];
+
+/* The page, ready to be written */
+static uint8_t *mem_alloc_page(uint32_t addr)
+{
+	unsigned pg = addr >> MEM_PAGE_SHIFT;
+	uint8_t **p = &mem_page[pg];
+	uint8_t *n;
+
+	if (*p && !mem_shared[pg])
+		return *p;
+	n = calloc(1, MEM_PAGE_SIZE);
+	if (n == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	if (*p)
+		memcpy(n, *p, MEM_PAGE_SIZE);
+	*p = n;
+	mem_shared[pg] = 0;
+	return n;
+}
+
+static void mem_set_type(uint32_t addr, uint32_t len, unsigned type)
+{
+	uint32_t b;
+
+	for (b = addr >> MEM_BLOCK_SHIFT;
+	     b <= (addr + len - 1) >> MEM_BLOCK_SHIFT; b++)
+		mem_type[b] = type;
+}
+
+/* Watched blocks take the slow path, see debug.c */
+void mem_watch(uint32_t addr, unsigned on)
+{
+	addr &= mem_mask;
+	if (on)
+		mem_type[addr >> MEM_BLOCK_SHIFT] |= MEM_WATCH;
+	else
+		mem_type[addr >> MEM_BLOCK_SHIFT] &= ~MEM_WATCH;
+}
+
+static void mem_init(void)
+{
+	mem_set_type(0, ram_size, MEM_RAM);
+	if (diag) {
+		/* The whole of the diag board's ROM space, not just the ROMs */
+		mem_set_type(0x08000, 0x3800, MEM_ROM);
+		/* Its own 1K of RAM, which appears twice */
+		mem_set_type(0x0B800, 0x0800, MEM_RAM);
+	}
+	mem_set_type(0x3F000, 0x0C00, MEM_IO);
+	/* And all of the top 1K, the bootstrap is only half of it */
+	mem_set_type(0x3FC00, 0x0400, MEM_ROM);
+}
+
+/*
+ *	Parity
+ *
+ *	Memory comes up with random contents and parity, so reading a byte
+ *	that was never written is likely to be a parity error. A bitmap marks
+ *	each byte written and a count of them is kept for each 2K page. Once
+ *	a page has been written all over, which is most of memory soon after
+ *	boot, only the count need be looked at. Errors can also be planted with
+ *	--parity or a batch script and last until the byte is next written.
+ *
+ *	How the memory board tells the CPU about an error is not known, so
+ *	for now they are counted for --stats and reported with -t 64.
+ */
+#define MAX_PARITY		16	/* --parity options */
+#define PARITY_PAGE_SHIFT	11
+#define PARITY_PAGE_SIZE	(1 << PARITY_PAGE_SHIFT)
+
+static uint8_t parity_good[MEM_SIZE / 8];
+static uint16_t parity_count[MEM_SIZE >> PARITY_PAGE_SHIFT];
+
+static unsigned parity_bit(uint32_t addr)
+{
+	return parity_good[addr >> 3] & (1 << (addr & 7));
+}
+
+static void parity_mark(uint32_t addr)
+{
+	if (!parity_bit(addr)) {
+		parity_good[addr >> 3] |= 1 << (addr & 7);
+		parity_count[addr >> PARITY_PAGE_SHIFT]++;
+	}
+}
+
+/* Count the errors in reading a run within one page */
+static void parity_check_run(uint32_t addr, unsigned len)
+{
+	if (parity_count[addr >> PARITY_PAGE_SHIFT] == PARITY_PAGE_SIZE)
+		return;
+	for (; len && (addr & 7); len--)
+		if (!parity_bit(addr++))
+			stats.parity_errors++;
+	/* Then eight at a time */
+	for (; len >= 8; len -= 8, addr += 8)
+		stats.parity_errors += 8 - __builtin_popcount(parity_good[addr >> 3]);
+	for (; len; len--)
+		if (!parity_bit(addr++))
+			stats.parity_errors++;
+}
+
+static void parity_mark_run(uint32_t addr, unsigned len)
+{
+	if (parity_count[addr >> PARITY_PAGE_SHIFT] == PARITY_PAGE_SIZE)
+		return;
+	while (len--)
+		parity_mark(addr++);
+}
+
+static void parity_error(uint32_t addr)
+{
+	stats.parity_errors++;
+	if (trace & TRACE_PARITY)
+		fprintf(stderr, "%04X: PARITY %05X\n", cpu6_pc(), addr);
+}
+
+/* Whether there is memory at a physical address to plant parity errors in */
+int mem_parity_valid(uint32_t addr)
+{
+	return addr <= mem_mask;
+}
+
+void mem_parity_inject(uint32_t addr)
+{
+	addr &= mem_mask;
+	mem_dirty[addr >> MEM_PAGE_SHIFT] = 1;
+	if (parity_bit(addr)) {
+		parity_good[addr >> 3] &= ~(1 << (addr & 7));
+		parity_count[addr >> PARITY_PAGE_SHIFT]--;
+	}
+}
 
 static uint8_t hexdigits;
 static unsigned hexblank;
@@ -63,6 +252,11 @@ static void hexdisplay(uint16_t addr, uint8_t val)
 	} else {
 		hexblank = onoff;
 	}
+	/* Shown already the first time through */
+	if (checkpoint_rerun)
+		return;
+	/* Keep the display in order with console output */
+	hostio_flush();
 	if (hexblank) {
 		printf("[OFF]\n");
 		return;
@@ -90,259 +284,6 @@ static void hexdisplay(uint16_t addr, uint8_t val)
 	fflush(stdout);
 }
 
-/* A crappy glue, remained from the old monolythic code, still sufficient to work.
- * A proper DMA API needs to be implemented i believe */
-static unsigned hawk_dma;
-
-void hawk_set_dma(unsigned mode)
-{
-	hawk_dma = mode;
-}
-
-/*
- *	Floppy controller (or what we know of it)
- *
- *	"The CMD controller and Floppy Controller are AMD2901 based
- *	 controllers that move a command string into the controller under
- *	 DMA control  then the AMD2901 runs the command string then moves
- *	 the Read / Write data in or out of the controller under DMA control."
- *			-- Ken Romain
- *
- *	"The first floopy was 8 inch. All Centurion disk R/W are based on
- *	 400 ( 0x190 ) byte sectors to keep the old software from the Sykes
- *	 tape days still usable on the disk drive systems."
- *			-- Ken Romain
- *
- *	Write 43 to F800 to load a command
- *	Write 45 to enable data receive (needed even if no data)
- *	F801 is the in/out/busy bits, F800 the status where top bit = error
- *
- *	Commands
- *	81 01 82		Restore
- *	81 01 83 track		Seek
- *
- *	81 00 or 81 01		always starts
- *	82 XX			restore
- *	83 track		seek to track
- *	88 sec track len.w	read
- *
- *	Boot uses (seek to track 0 load a super long sector 0 ?)
- *	81 00 83 00 88 00 00 0F00
- *
- *	The hard disk controller seems close but not quite the same. The
- *	bootstrap uses something like
- *
- *	81 00 84 0F+unit 83 00 00 85 00 0190 01 0190 02 0190 ...
- */
-
-#define ST_Fout		1
-#define ST_Fin		2
-#define ST_Busy		8
-
-static uint8_t fd_buf[0x1000];
-static unsigned fd_ptr;
-static unsigned fd_dma;
-static uint8_t fd_status;
-static uint8_t fd_bits;
-
-/* Assume ptr is a shared counter - but we don't actually know from
-   what we have so far */
-
-static void fdc_dma_in(uint8_t data)
-{
-	if (fd_ptr >= 0x1000) {
-		fprintf(stderr, "%04X: overlong fdc data %02X\n", data,
-			cpu6_pc());
-		return;
-	}
-	fd_buf[fd_ptr++] = data;
-}
-
-static uint8_t fdc_dma_out(void)
-{
-	if (fd_ptr >= 0x1000) {
-		fprintf(stderr, "%04X: overlong fdc command read\n",
-			cpu6_pc());
-		return 0xFF;
-	}
-	return fd_buf[fd_ptr++];
-}
-
-static void fdc_command_execute(uint8_t * p, int len)
-{
-	while (len-- > 0) {
-		switch (*p++) {
-		case 0x81:
-			p++;	/* We don't know what this does */
-			len--;
-			break;
-		case 0x82:
-			fprintf(stderr, "restore.\n");
-			break;
-		case 0x83:
-			fprintf(stderr, "seek %d\n", *p++);
-			len--;
-			break;
-		case 0x84:
-			fprintf(stderr, "set unit %d\n", *p++);
-			len--;
-			break;
-		case 0x85:
-			fprintf(stderr, "set head %d\n", *p++);
-			len--;
-		case 0x88:
-			fprintf(stderr, "read %d,%d for %d bytes.\n",
-				*p, p[1], p[2] << 8 | p[3]);
-			p += 4;
-			len -= 4;
-			break;
-		default:
-			fprintf(stderr, "unknown command %02x\n", p[-1]);
-			break;
-		}
-	}
-}
-
-/*
- *	The finch is a lot smarter
- *
- *	"A later rev. of the floppy controller (AMD2901 based) controlled
- *	 5-1/4 floppy (720KB) and CDC 5-1/4 Finch 24MB or 32MB hard drive,
- *	 letting us build a desktop Centurion Micro Plus system with CPU6,
- *	 128KB DRAM & 4 port MUX"
- *
- *	81 02 is now used (is this maybe a version check ?)
- *	82 is still restore
- *	83 takes two bytes and it's not clear what it seeks
- *	84 seems to be set unit
- *	85 possibly set head (as hard disk)
- *	8A is a table driven read, given tuples of sector, length
- *	   terminated FF
- *	FF is a terminator - in fact several test commands appear to DMA
- *			     over length blocks and rely on this.
- *
- */
-static void finch_command_execute(uint8_t * p, int len)
-{
-	while (len-- > 0) {
-		switch (*p++) {
-		case 0x81:
-			p++;	/* We don't know what this does */
-			len--;
-			break;
-		case 0x82:
-			fprintf(stderr, "restore.\n");
-			break;
-		case 0x83:
-			fprintf(stderr, "seek %d\n", *p << 8 | p[1]);
-			p += 2;
-			len -= 2;
-			break;
-		case 0x84:
-			fprintf(stderr, "set unit %d\n", *p++);
-			len--;
-			break;
-		case 0x85:
-			fprintf(stderr, "set head %d\n", *p++);
-			len--;
-		case 0x8A:
-			/* Table driven read */
-			while (*p != 0xFF) {
-				fprintf(stderr, "read %d for %d bytes.\n",
-					*p, (p[1] << 8) | p[2]);
-				p += 3;
-				len -= 3;
-			}
-			break;
-		case 0xFF:	/* Seems to act as an end marker */
-			break;
-		default:
-			fprintf(stderr, "unknown command %02x\n", p[-1]);
-			break;
-		}
-	}
-}
-
-static void fdc_dma_in_done(void)
-{
-	unsigned i;
-	if (fd_ptr > 0x0F00 && (trace & TRACE_FDC)) {
-		fprintf(stderr, "fdcmd: %d\n\t", fd_ptr);
-		for (i = 0x0F00; i < fd_ptr; i++) {
-			fprintf(stderr, "%02X ", fd_buf[i]);
-			if (((i & 15) == 15) && i != fd_ptr - 1)
-				fprintf(stderr, "\n\t");
-		}
-		if (!finch)
-			fdc_command_execute(fd_buf + 0x0F00,
-					    fd_ptr - 0x0F01);
-		else
-			finch_command_execute(fd_buf + 0x0F00,
-					      fd_ptr - 0x0F01);
-		fprintf(stderr, "\n");
-	}
-	fd_bits = ST_Fout;
-	fd_dma = 0;
-	fd_status = 0;
-}
-
-static void fdc_dma_out_done(void)
-{
-	fd_bits = ST_Fout;
-	fd_dma = 0;
-}
-
-static void fdc_write8(uint8_t data)
-{
-	if (trace & TRACE_FDC)
-		fprintf(stderr, "fdc write %02X\n", data);
-	switch (data) {
-	case 0x00:		/* Mystery - reset state perhaps ? */
-	case 0x01:		/* Used in the aux memory test */
-	case 0x0F:		/* Used in the aux memory test */
-		/* Status bits ?? */
-		break;
-	case 0x41:		/* used for reads */
-	case 0x43:		/* used for seek etc */
-		fd_bits = ST_Fin;	/* Fin not busy */
-		fd_ptr = 0x0F00;
-		fd_dma = 1;	/* Command in */
-		fd_status = 0x80;	/*?? */
-		break;
-	case 0x44:		/* seems to be reading the command buffer back */
-		fd_bits = ST_Busy | ST_Fout;	/* busy */
-		fd_ptr = 0x0F00;
-		fd_dma = 2;
-		fd_status = 0x00;
-		break;
-	case 0x45:		/* data follow up */
-		/* Should probably have ST_Busy set at this point ? */
-		/* 1 or 2 ?? */
-		fd_bits = ST_Fin | ST_Busy;	/* Should this be Fout or command based ? */
-		fd_ptr = 0;
-		fd_dma = 2;	/* Data out ? */
-		fd_status = 0x00;	/* Seems to want top bit for error */
-		/* Fake an error on track 5 */
-		if (fd_buf[0x0F02] == 0x83 && fd_buf[0x0F03] == 0x05)
-			fd_status = 0x80;
-		break;
-	case 0x46:		/* load data into aux memory */
-		fd_bits = ST_Fin;
-		fd_ptr = 0;
-		fd_dma = 1;
-		break;
-	case 0x47:		/* retrieve data from aux memory */
-		fd_bits = ST_Fout | ST_Busy;
-		fd_ptr = 0;
-		fd_dma = 2;
-		break;
-	default:
-		fprintf(stderr, "%04X: unknown fdc cmd %02X.\n", cpu6_pc(),
-			data);
-		break;
-	}
-}
-
 /*
  *	The CMD disk interface is remarkably similar but at F808
  *
@@ -385,30 +326,9 @@ static void fdc_write8(uint8_t data)
 
 static uint8_t cmdcmd[256];
 static unsigned cmd_ptr;
-static unsigned cmd_dma;
 static uint8_t cmd_status;
 static uint8_t cmd_bits;
 
-static void cmd_dma_cmd_in(uint8_t data)
-{
-	if (cmd_ptr == 256) {
-		fprintf(stderr, "%04X: overlong cmdc command %02X\n", data,
-			cpu6_pc());
-		return;
-	}
-	cmdcmd[cmd_ptr++] = data;
-}
-
-static uint8_t cmd_dma_cmd_out(void)
-{
-	if (cmd_ptr == 256) {
-		fprintf(stderr, "%04X: overlong cmdc command read\n",
-			cpu6_pc());
-		return 0xFF;
-	}
-	return cmdcmd[cmd_ptr++];
-}
-
 static void cmd_dma_cmd_done(void)
 {
 	unsigned i;
@@ -422,7 +342,6 @@ static void cmd_dma_cmd_done(void)
 		fprintf(stderr, "\n");
 	}
 	cmd_bits = ST_Fout;	/* fin */
-	cmd_dma = 0;
 	cmd_status = 0;
 	cmd_ptr = 0;
 }
@@ -430,7 +349,43 @@ static void cmd_dma_cmd_done(void)
 static void cmd_dma_cmd_out_done(void)
 {
 	cmd_bits = ST_Fout;	/* fin on */
-	cmd_dma = 0;
+}
+
+/* Same controller as the FDC, so the same guess at its speed */
+static struct dma_channel cmd_dma_in = {
+	.name = "cmd dma",
+	.byte_ns = 1000,
+	.burst = sizeof(cmdcmd),
+	.buf = cmdcmd,
+	.size = sizeof(cmdcmd),
+	.ptr = &cmd_ptr,
+	.done = cmd_dma_cmd_done
+};
+
+static struct dma_channel cmd_dma_out = {
+	.name = "cmd dma",
+	.byte_ns = 1000,
+	.burst = sizeof(cmdcmd),
+	.buf = cmdcmd,
+	.size = sizeof(cmdcmd),
+	.ptr = &cmd_ptr,
+	.done = cmd_dma_cmd_out_done
+};
+
+/* What the board itself holds, for checkpoints */
+static void board_init(void)
+{
+	CHECKPOINT(cpu_timestamp_ns);
+	CHECKPOINT(instruction_count);
+	CHECKPOINT(hexdigits);
+	CHECKPOINT(hexblank);
+	CHECKPOINT(hexdots);
+	CHECKPOINT(cmdcmd);
+	CHECKPOINT(cmd_ptr);
+	CHECKPOINT(cmd_status);
+	CHECKPOINT(cmd_bits);
+	dma_checkpoint(&cmd_dma_in);
+	dma_checkpoint(&cmd_dma_out);
 }
 
 /* Subtly different to the FDC or maybe the 41/43 divide is really the same
@@ -452,30 +407,24 @@ static void cmd_write8(uint8_t data)
 	case 0x43:		/* Run command ?? */
 		cmd_bits = ST_Fin;	/* Fout not busy */
 		cmd_ptr = 0;
-		cmd_dma = 1;	/* Command in */
 		cmd_status = 0x80;	/*?? */
+		dma_request(&cmd_dma_in, DMA_TO_DEVICE);
 		break;
 	case 0x44:		/* seems to be reading the command buffer back */
 		cmd_bits = ST_Busy | ST_Fout;	/* busy */
 		cmd_ptr = 0;
-		cmd_dma = 3;
 		cmd_status = 0x00;
+		dma_request(&cmd_dma_out, DMA_FROM_DEVICE);
 		break;
 	case 0x45:		/* data follow up */
 		cmd_bits = ST_Fout;	/* ?? suspect this depends on the command */
 		cmd_ptr = 0;
-		cmd_dma = 2;	/* Data out ? */
+		/* Data out ? Nothing is known to be moved yet */
 		cmd_status = 0x00;	/* Seems to want top bit for error */
 		break;
 	case 0x46:		/* load data into aux memory */
-		fd_bits = ST_Fin;
-		fd_ptr = 0;
-		fd_dma = 1;
-		break;
 	case 0x47:		/* retrieve data from aux memory */
-		fd_bits = ST_Fout | ST_Busy;
-		fd_ptr = 0;
-		fd_dma = 2;
+		fdc_write(data, trace & TRACE_FDC);
 		break;
 	default:
 		fprintf(stderr, "%04X: unknown cmd cmd %02X.\n", cpu6_pc(),
@@ -486,16 +435,10 @@ static void cmd_write8(uint8_t data)
 
 static uint8_t io_read8(uint16_t addr)
 {
-	if (addr == 0xF800) {
-		if (trace & TRACE_FDC)
-			fprintf(stderr, "fd status %02X\n", fd_status);
-		return fd_status;
-	}
-	if (addr == 0xF801) {
-		if (trace & TRACE_FDC)
-			fprintf(stderr, "fd bits %02X\n", fd_bits);
-		return fd_bits;
-	}
+	if (addr == 0xF800)
+		return fdc_read_status(trace & TRACE_FDC);
+	if (addr == 0xF801)
+		return fdc_read_bits(trace & TRACE_FDC);
 	if (addr == 0xF808) {
 		if (trace & TRACE_CMD)
 			fprintf(stderr, "cmd status %02X\n", cmd_status);
@@ -516,10 +459,30 @@ static uint8_t io_read8(uint16_t addr)
 	return 0;
 }
 
+/* Registers that read without changing anything, when not tracing */
+static int io_read_pure(uint16_t addr)
+{
+	switch (addr) {
+	case 0xF800:
+	case 0xF801:
+	case 0xF808:
+	case 0xF809:
+	case 0xF110:
+	case 0xF141:
+	case 0xF144:
+	case 0xF145:
+	case 0xF148:
+		return 1;
+	}
+	if (addr >= 0xF200 && addr <= 0xF21F)
+		return mux_read_pure(addr);
+	return 0;
+}
+
 static void io_write8(uint16_t addr, uint8_t val)
 {
 	if (addr == 0xF800) {
-		fdc_write8(val);
+		fdc_write(val, trace & TRACE_FDC);
 		return;
 	} else if (addr == 0xF808) {
 		cmd_write8(val);
@@ -540,43 +503,98 @@ static void io_write8(uint16_t addr, uint8_t val)
 
 static uint32_t remap(uint32_t addr)
 {
-	addr &= 0x3FFFF;
 	/* We need to fix up the fact the 1K diag RAM appear twice */
 	if (diag && addr >= 0x0BC00 && addr <= 0x0BFFF)
 		addr -= 0x400;
 	return addr;
 }
 
-static uint8_t do_mem_read8(uint32_t addr, int debug)
+static uint8_t mem_read_type(uint32_t addr, unsigned type, int debug)
 {
 	unsigned parity_off = 0;
+	uint8_t *p;
 
-	if (addr >= 0x3F000 && addr < 0x3FC00) {
+	switch (type) {
+	case MEM_RAM:
+	case MEM_ROM:
+		break;
+	case MEM_NONE:
+		return 0xFF;
+	case MEM_IO:
 		if (debug)
 			return 0xFF;
 		else
 			return io_read8(addr & 0xFFFF);
-	} else {
-		if (diag && addr >= 0x8000)
-			parity_off = 1;
-		addr = remap(addr);
-		if (addr >= 0x3F000)
-			parity_off = 1;
-		if (memclean[addr] || parity_off)
-			return mem[addr];
-		if (trace & TRACE_PARITY)
-			fprintf(stderr, "PARITY\n");
-		return mem[addr];
+	default:
+		/* Something in the block is being watched */
+		if (!debug)
+			debug_watch(addr, 0);
+		return mem_read_type(addr, type & ~MEM_WATCH, debug);
 	}
+	if (diag && addr >= 0x8000)
+		parity_off = 1;
+	addr = remap(addr);
+	if (addr >= 0x3F000)
+		parity_off = 1;
+	p = mem_page[addr >> MEM_PAGE_SHIFT];
+	if (p == NULL)
+		p = zero_page;
+	if (parity_off || debug
+	    || parity_count[addr >> PARITY_PAGE_SHIFT] == PARITY_PAGE_SIZE
+	    || parity_bit(addr))
+		return p[addr & (MEM_PAGE_SIZE - 1)];
+	parity_error(addr);
+	return p[addr & (MEM_PAGE_SIZE - 1)];
 }
 
-uint8_t mem_read8(uint32_t addr)
+static uint8_t do_mem_read8(uint32_t addr, int debug)
+{
+	addr &= mem_mask;
+	return mem_read_type(addr, mem_type[addr >> MEM_BLOCK_SHIFT], debug);
+}
+
+/*
+ *	For the CPU running a poll loop in one go, see poll_loop in cpu6.c.
+ *	A byte it can fetch once for good has to read with no parity error
+ *	and nothing else. The byte polled is read each time round, but must
+ *	give the same until something else in the machine runs.
+ */
+int mem_fetch_quiet(uint32_t addr)
+{
+	unsigned type;
+
+	addr &= mem_mask;
+	type = mem_type[addr >> MEM_BLOCK_SHIFT];
+	if (trace || (type != MEM_RAM && type != MEM_ROM))
+		return 0;
+	if (diag && addr >= 0x8000)
+		return 1;
+	addr = remap(addr);
+	return addr >= 0x3F000
+		|| parity_count[addr >> PARITY_PAGE_SHIFT] == PARITY_PAGE_SIZE
+		|| parity_bit(addr);
+}
+
+int mem_poll_quiet(uint32_t addr)
 {
-	// Extremely simple timing model where we assume each CPU memory
-	// access takes exactly 3 cycles (600ns), and the microcode is
-	// never doing things between memory accesses.
-	cpu_timestamp_ns += 600;
+	addr &= mem_mask;
+	if (trace)
+		return 0;
+	switch (mem_type[addr >> MEM_BLOCK_SHIFT]) {
+	case MEM_NONE:
+	case MEM_RAM:
+	case MEM_ROM:
+		return 1;
+	case MEM_IO:
+		return io_read_pure(addr & 0xFFFF);
+	}
+	/* Being watched */
+	return 0;
+}
 
+/* Access time is charged by the CPU once per instruction, see cpu6.c */
+uint8_t mem_read8(uint32_t addr)
+{
 	uint8_t r = do_mem_read8(addr, 0);
 	if (trace & TRACE_MEM_RD)
 		if (addr > 0xFF || (trace & TRACE_MEM_REG))
@@ -585,6 +603,48 @@ uint8_t mem_read8(uint32_t addr)
 	return r;
 }
 
+/*
+ *	Direct access to a run of plain RAM for the block operations. The run
+ *	must not cross a 2K page. Returns NULL for anything mem_read8 or
+ *	mem_write8 would treat specially (I/O, ROM, the diag board, tracing)
+ *	so the caller can fall back to going a byte at a time. Mapping for a
+ *	write marks the parity good. Mapping for a read checks nothing, the
+ *	caller counts the errors with mem_parity_read once it knows which
+ *	bytes it reads, so none are counted twice by a fallback.
+ */
+uint8_t *mem_map_ram(uint32_t addr, unsigned len, unsigned write)
+{
+	uint8_t *p;
+
+	if (trace & (TRACE_MEM_RD | TRACE_MEM_WR | TRACE_PARITY))
+		return NULL;
+	addr &= mem_mask;
+	if (mem_type[addr >> MEM_BLOCK_SHIFT] != MEM_RAM
+	    || mem_type[(addr + len - 1) >> MEM_BLOCK_SHIFT] != MEM_RAM)
+		return NULL;
+	if (diag && addr >= 0x08000 && addr < 0x0C000)
+		return NULL;
+	if (write) {
+		parity_mark_run(addr, len);
+		p = mem_alloc_page(addr);
+		mem_dirty[addr >> MEM_PAGE_SHIFT] = 1;
+	} else {
+		p = mem_page[addr >> MEM_PAGE_SHIFT];
+		if (p == NULL)
+			p = zero_page;
+	}
+	return p + (addr & (MEM_PAGE_SIZE - 1));
+}
+
+/* Count the parity errors in a run read through mem_map_ram */
+void mem_parity_read(uint32_t addr, unsigned len)
+{
+	addr &= mem_mask;
+	/* As mem_read8, the top 4K has no parity */
+	if (addr < 0x3F000)
+		parity_check_run(addr, len);
+}
+
 uint8_t mem_read8_debug(uint32_t addr)
 {
 	return do_mem_read8(addr, 1);
@@ -597,38 +657,59 @@ uint16_t mem_read16_debug(uint32_t addr)
 
 static void mem_do_write8(uint32_t addr, uint8_t val)
 {
+	uint8_t *p;
+
 	addr = remap(addr);
-	memclean[addr] = 1;
-	mem[addr] = val;
+	if (parity_count[addr >> PARITY_PAGE_SHIFT] != PARITY_PAGE_SIZE)
+		parity_mark(addr);
+	p = mem_page[addr >> MEM_PAGE_SHIFT];
+	if (p == NULL)
+		p = mem_alloc_page(addr);
+	p[addr & (MEM_PAGE_SIZE - 1)] = val;
+	mem_dirty[addr >> MEM_PAGE_SHIFT] = 1;
 }
 
 void mem_write8(uint32_t addr, uint8_t val)
 {
-	if (diag && addr >= 0x08000 && addr < 0x0B800) {
-		fprintf(stderr, "%04X: Write to ROM [%05X]\n", cpu6_pc(), addr);
-		return;
-	}
-	if (addr >= 0x3FC00) {
-		fprintf(stderr, "%04X: Write to ROM [%05X]\n", cpu6_pc(), addr);
-		return;
+	unsigned type;
+
+	addr &= mem_mask;
+	type = mem_type[addr >> MEM_BLOCK_SHIFT];
+	if (type != MEM_RAM) {
+		if (type & MEM_WATCH) {
+			debug_watch(addr, 1);
+			type &= ~MEM_WATCH;
+		}
+		if (type == MEM_ROM) {
+			fprintf(stderr, "%04X: Write to ROM [%05X]\n",
+				cpu6_pc(), addr);
+			return;
+		}
 	}
 	if (trace & TRACE_MEM_WR)
 		if (addr > 0xFF || (trace & TRACE_MEM_REG))
 			fprintf(stderr, "%04X: %05X W %02X\n", cpu6_pc(),
 				addr, val);
-	if (addr >= 0x3F000 && addr < 0x3FC00) {
+	if (type == MEM_IO) {
 		io_write8(addr & 0xFFFF, val);
 		return;
 	}
-	mem_do_write8(addr, val);
+	if (type == MEM_RAM)
+		mem_do_write8(addr, val);
 }
 
 void mem_write8_debug(uint32_t addr, uint8_t val)
 {
+	unsigned type;
+
 	// a debugger is allowed to modify rom, but not IO
-	if (addr >= 0x3F000 && addr < 0x3FC00) {
+	addr &= mem_mask;
+	type = mem_type[addr >> MEM_BLOCK_SHIFT] & ~MEM_WATCH;
+	if (type == MEM_IO || type == MEM_NONE) {
 		return;
 	}
+	if (type == MEM_ROM)
+		mem_alloc_page(addr);
 	mem_do_write8(addr, val);
 }
 
@@ -638,6 +719,53 @@ void mem_write16_debug(uint32_t addr, uint16_t val)
 	mem_write8_debug(addr+1, val & 0xff);
 }
 
+/*
+ *	Checkpoints keep copies of the pages written since the one before and
+ *	put them back later, see checkpoint.c. A page goes with its parity.
+ */
+unsigned mem_page_dirty(unsigned pg)
+{
+	unsigned r = mem_dirty[pg];
+
+	mem_dirty[pg] = 0;
+	return r;
+}
+
+/* Returns 0 for a page that has never been written */
+int mem_page_save(unsigned pg, uint8_t *buf)
+{
+	if (mem_page[pg] == NULL || mem_shared[pg])
+		return 0;
+	memcpy(buf, mem_page[pg], MEM_PAGE_SIZE);
+	buf += MEM_PAGE_SIZE;
+	memcpy(buf, parity_good + pg * (MEM_PAGE_SIZE / 8), MEM_PAGE_SIZE / 8);
+	buf += MEM_PAGE_SIZE / 8;
+	memcpy(buf, &parity_count[pg], sizeof(parity_count[pg]));
+	return 1;
+}
+
+/* NULL for a page that had not been written yet. ROM is left alone */
+void mem_page_restore(unsigned pg, const uint8_t *buf)
+{
+	uint8_t *pb = parity_good + pg * (MEM_PAGE_SIZE / 8);
+	unsigned type = mem_type[pg << (MEM_PAGE_SHIFT - MEM_BLOCK_SHIFT)];
+
+	if (buf == NULL) {
+		if (mem_shared[pg] || (type & ~MEM_WATCH) == MEM_ROM)
+			return;
+		free(mem_page[pg]);
+		mem_page[pg] = NULL;
+		memset(pb, 0, MEM_PAGE_SIZE / 8);
+		parity_count[pg] = 0;
+		return;
+	}
+	memcpy(mem_alloc_page(pg << MEM_PAGE_SHIFT), buf, MEM_PAGE_SIZE);
+	buf += MEM_PAGE_SIZE;
+	memcpy(pb, buf, MEM_PAGE_SIZE / 8);
+	buf += MEM_PAGE_SIZE / 8;
+	memcpy(&parity_count[pg], buf, sizeof(parity_count[pg]));
+}
+
 int64_t get_current_time() {
 	return cpu_timestamp_ns;
 }
@@ -646,15 +774,51 @@ void advance_time(uint64_t nanoseconds) {
 	cpu_timestamp_ns += nanoseconds;
 }
 
+/*
+ *	Until the time this gives the main loop would find nothing to do
+ *	between instructions, bar the MUX poll machine_skip_poll stands in
+ *	for, so the CPU can run on without it. 0 if it has work now.
+ */
+int64_t machine_quiet_until(void)
+{
+	int64_t until = checkpoint_due;
+	int64_t next;
+
+	if (trace || terminate_at || emulator_done || stats_requested
+	    || dma_bus_held())
+		return 0;
+	if (throttle && !checkpoint_rerun && (int64_t)throttle_next < until)
+		until = throttle_next;
+	next = scheduler_next();
+	if (next != -1 && next < until)
+		until = next;
+	next = mux_quiet_until();
+	if (next < until)
+		until = next;
+	return until > cpu_timestamp_ns ? until : 0;
+}
+
+/* Returns 1 if it looked for host input, which may bring the time in */
+int machine_skip_poll(void)
+{
+	return mux_poll_skip(trace & TRACE_MUX);
+}
+
 void halt_system(void)
 {
+	hostio_flush();
 	printf("System halted at %04X\n", cpu6_pc());
 	emulator_done = 1;
+	batch_halted();
 }
 
-static void load_rom(const char *name, uint32_t addr, uint16_t len)
+/* Read a file into memory, returns its length */
+static uint32_t load_image(const char *name, uint32_t addr, uint32_t len)
 {
 	FILE *fp = fopen(name, "rb");
+	uint8_t buf[MEM_PAGE_SIZE];
+	uint32_t i, n;
+
 	if (fp == NULL) {
 		perror(name);
 		exit(1);
@@ -664,10 +828,109 @@ static void load_rom(const char *name, uint32_t addr, uint16_t len)
 		len = ftell(fp);
 		rewind(fp);
 	}
-	if (fread(mem + addr, len, 1, fp) != 1) {
-		fprintf(stderr, "%s: read error.\n", name);
+	if (len == 0 || addr + len > MEM_SIZE) {
+		fprintf(stderr, "%s: does not fit at %05X.\n", name, addr);
 		exit(1);
 	}
+	for (i = 0; i < len; i += n) {
+		/* A page at a time */
+		n = MEM_PAGE_SIZE - ((addr + i) & (MEM_PAGE_SIZE - 1));
+		if (n > len - i)
+			n = len - i;
+		if (fread(buf, n, 1, fp) != 1) {
+			fprintf(stderr, "%s: read error.\n", name);
+			exit(1);
+		}
+		memcpy(mem_alloc_page(addr + i)
+			+ ((addr + i) & (MEM_PAGE_SIZE - 1)), buf, n);
+		parity_mark_run(addr + i, n);
+		mem_dirty[(addr + i) >> MEM_PAGE_SHIFT] = 1;
+	}
+	fclose(fp);
+	return len;
+}
+
+/*
+ *	Map a ROM that fills whole pages straight from the file. Returns the
+ *	length mapped, or 0 to have it read in instead, which also covers
+ *	reporting anything wrong with the file.
+ */
+static uint32_t map_rom(const char *name, uint32_t addr, uint32_t len)
+{
+#ifdef _WIN32
+	return 0;
+#else
+	struct stat st;
+	uint8_t *p;
+	uint32_t i;
+	int fd;
+
+	if (addr & (MEM_PAGE_SIZE - 1))
+		return 0;
+	fd = open(name, O_RDONLY);
+	if (fd == -1)
+		return 0;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return 0;
+	}
+	if (len == 0)
+		len = st.st_size;
+	if (len == 0 || len > st.st_size || (len & (MEM_PAGE_SIZE - 1))
+	    || addr + len > MEM_SIZE) {
+		close(fd);
+		return 0;
+	}
+	/* Something already there, like another ROM */
+	for (i = 0; i < len; i += MEM_PAGE_SIZE) {
+		if (mem_page[(addr + i) >> MEM_PAGE_SHIFT]) {
+			close(fd);
+			return 0;
+		}
+	}
+	p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return 0;
+	for (i = 0; i < len; i += MEM_PAGE_SIZE) {
+		mem_page[(addr + i) >> MEM_PAGE_SHIFT] = p + i;
+		mem_shared[(addr + i) >> MEM_PAGE_SHIFT] = 1;
+		parity_mark_run(addr + i, MEM_PAGE_SIZE);
+	}
+	return len;
+#endif
+}
+
+static void load_rom(const char *name, uint32_t addr, uint32_t len)
+{
+	uint32_t n = map_rom(name, addr, len);
+
+	if (n == 0)
+		n = load_image(name, addr, len);
+	mem_set_type(addr, n, MEM_ROM);
+}
+
+/*
+ *	One JSON line summarising the run, for the benchmark harness
+ */
+static void perf_report(const char *name, long long instructions,
+	uint64_t wall_ns)
+{
+	FILE *fp = fopen(name, "w");
+	if (fp == NULL) {
+		perror(name);
+		return;
+	}
+	if (wall_ns == 0)
+		wall_ns = 1;
+	fprintf(fp, "{\"instructions\": %lld, \"emulated_ns\": %lld, "
+		"\"wall_ns\": %llu, \"mips\": %.3f, \"ns_per_instruction\": %.2f, "
+		"\"realtime_ratio\": %.3f, \"syscalls\": %lu}\n",
+		instructions, (long long)cpu_timestamp_ns,
+		(unsigned long long)wall_ns,
+		instructions * 1000.0 / wall_ns,
+		instructions ? (double)wall_ns / instructions : 0.0,
+		(double)cpu_timestamp_ns / wall_ns, host_syscalls);
 	fclose(fp);
 }
 
@@ -684,11 +947,45 @@ void usage(void)
 		" -E <addr>    entry point for binary"
 		" -d           emulate DIAG card\n"
 		" -F           emulate a finch drive\n"
+		" -I           Do console and network I/O on a separate host thread\n"
 		" -l <port>    Listen for telnet on the given <port> number\n"
+		" -n <file>    Write the most frequent opcode pairs and triples to <file> on exit\n"
+		" -P <file>    Write a performance summary to <file> on exit\n"
+		" -r <file>    Record console input with its emulated timestamps to <file>\n"
+		" -R <file>    Replay console input recorded with -r, unthrottled\n"
 		" -s <value>   set CPU switches as a decimal value. Switch 1-4 are Sense\n"
 		" -S <value>   set diag switches as decimal value (only effective with `-d`)\n"
 		" -t <value>   enable enable system trace to stderr. See readme for values\n"
 		" -T <value>   Exit after executing <value> instructions\n"
+		" -x <script>  Run headless, driving the MUX ports from an expect/send script\n"
+		" --speed <n>  Run at <n> times real time, or as fast as possible with `max'\n"
+		" --catchup <policy>\n"
+		"              After falling behind: burst (default) runs flat out until caught\n"
+		"              up, forgive drops the lost time, cap:<x> catches up at <x> times\n"
+		"              the speed at most\n"
+		" --stats <file>\n"
+		"              Write counters in Prometheus text format to <file> on\n"
+		"              SIGUSR1 and at exit\n"
+		" --machine <profile>\n"
+		"              Set the machine up from a profile, built in (diag, hawk,\n"
+		"              finch) or a file\n"
+		" --ram <n>    Fit <n>K of RAM, 64 to 512 (default 256)\n"
+		" --rom <file>@<addr>\n"
+		"              Load a ROM image at physical address <addr> (hex), can be\n"
+		"              given more than once\n"
+		" --gdb <port> Wait for a debugger using the GDB remote protocol on\n"
+		"              local <port> before starting\n"
+		" --checkpoint <ms>\n"
+		"              Take a checkpoint every <ms> of emulated time so the\n"
+		"              debugger can step and continue backwards\n"
+		" --profile <file>\n"
+		"              Write the most run code to <file> on exit\n"
+		" --blocks <file>\n"
+		"              Group the profile into the basic blocks in <file>, as\n"
+		"              written by cpu6dis -B\n"
+		" --parity <addr>\n"
+		"              Plant a parity error at physical address <addr> (hex), can be\n"
+		"              given more than once\n"
 	);
 	exit(1);
 }
@@ -704,20 +1001,191 @@ uint16_t parse_address(char *arg, char* arg_name) {
 	return load_addr;
 }
 
+/* --ram, in K with an optional K after */
+static void parse_ram(const char *arg)
+{
+	char *end;
+	unsigned long kb = strtoul(arg, &end, 10);
+
+	if (*end == 'K' || *end == 'k')
+		end++;
+	if (*end || end == arg || kb < 64 || kb > MEM_SIZE / 1024
+	    || (kb & 1)) {
+		fprintf(stderr, "RAM size must be 64K to %uK in 2K steps\n",
+			MEM_SIZE / 1024);
+		exit(1);
+	}
+	ram_size = kb * 1024;
+	/* Set both ways, a later --ram can shrink what a profile gave */
+	mem_mask = ram_size > 0x40000 ? MEM_SIZE - 1 : 0x3FFFF;
+}
+
+/* --rom, file@address */
+static char *parse_rom(char *arg, uint32_t *addr)
+{
+	char *at = strrchr(arg, '@');
+	char *end;
+
+	if (at == NULL || at == arg) {
+		fprintf(stderr, "--rom wants <file>@<address>\n");
+		exit(1);
+	}
+	*at = 0;
+	*addr = strtoul(at + 1, &end, 16);
+	if (*end || end == at + 1 || *addr >= MEM_SIZE) {
+		fprintf(stderr, "ROM address not valid\n");
+		exit(1);
+	}
+	return arg;
+}
+
+/* ROMs from --rom or a machine profile, loaded after the standard ones */
+static char *rom_name[MAX_ROMS];
+static uint32_t rom_addr[MAX_ROMS];
+static unsigned num_roms;
+
+static void add_rom(char *arg)
+{
+	if (num_roms == MAX_ROMS) {
+		fprintf(stderr, "Too many ROMs\n");
+		exit(1);
+	}
+	rom_name[num_roms] = parse_rom(arg, &rom_addr[num_roms]);
+	num_roms++;
+}
+
+/* --machine, applied where it appears so later options override it */
+static void set_machine(const struct machine *m)
+{
+	unsigned i;
+
+	if (m->diag)
+		diag = 1;
+	if (m->finch)
+		finch = 1;
+	if (m->ram)
+		parse_ram(m->ram);
+	for (i = 0; i < m->num_roms; i++)
+		add_rom(m->rom[i]);
+	if (m->hawk_given)
+		for (i = 0; i < MACHINE_HAWK_UNITS; i++)
+			dsk_attach(i, m->hawk[i]);
+	if (m->switches != -1)
+		cpu6_set_switches(m->switches);
+	if (m->diag_switches != -1)
+		switches = m->diag_switches;
+}
+
+/* --parity, a physical address, checked once --ram is known */
+static uint32_t parse_parity(const char *arg)
+{
+	char *end;
+	unsigned long addr = strtoul(arg, &end, 16);
+
+	if (*end || end == arg || addr > 0xFFFFFFFFUL) {
+		fprintf(stderr, "Parity address not valid\n");
+		exit(1);
+	}
+	return addr;
+}
+
+/* --speed, 0 for max */
+static float parse_speed(const char *arg)
+{
+	char *end;
+	float speed;
+
+	if (strcmp(arg, "max") == 0)
+		return 0;
+	speed = strtof(arg, &end);
+	if (*end || speed <= 0) {
+		fprintf(stderr, "speed must be a positive number or max\n");
+		exit(1);
+	}
+	return speed;
+}
+
+static void parse_catchup(const char *arg)
+{
+	char *end;
+	float cap;
+
+	if (strcmp(arg, "burst") == 0)
+		throttle_set_policy(THROTTLE_BURST, 0);
+	else if (strcmp(arg, "forgive") == 0)
+		throttle_set_policy(THROTTLE_FORGIVE, 0);
+	else if (strncmp(arg, "cap:", 4) == 0) {
+		cap = strtof(arg + 4, &end);
+		if (*end || cap < 1) {
+			fprintf(stderr, "catch-up cap must be at least 1\n");
+			exit(1);
+		}
+		throttle_set_policy(THROTTLE_CAP, cap);
+	} else {
+		fprintf(stderr, "catch-up policy must be burst, forgive or cap:<x>\n");
+		exit(1);
+	}
+}
+
+enum {
+	OPT_SPEED = 0x100,
+	OPT_CATCHUP,
+	OPT_STATS,
+	OPT_PARITY,
+	OPT_RAM,
+	OPT_ROM,
+	OPT_MACHINE,
+	OPT_GDB,
+	OPT_CHECKPOINT,
+	OPT_PROFILE,
+	OPT_BLOCKS
+};
+
+static const struct option long_options[] = {
+	{ "speed", required_argument, NULL, OPT_SPEED },
+	{ "catchup", required_argument, NULL, OPT_CATCHUP },
+	{ "stats", required_argument, NULL, OPT_STATS },
+	{ "parity", required_argument, NULL, OPT_PARITY },
+	{ "ram", required_argument, NULL, OPT_RAM },
+	{ "rom", required_argument, NULL, OPT_ROM },
+	{ "machine", required_argument, NULL, OPT_MACHINE },
+	{ "gdb", required_argument, NULL, OPT_GDB },
+	{ "checkpoint", required_argument, NULL, OPT_CHECKPOINT },
+	{ "profile", required_argument, NULL, OPT_PROFILE },
+	{ "blocks", required_argument, NULL, OPT_BLOCKS },
+	{ NULL, 0, NULL, 0 }
+};
+
 int main(int argc, char *argv[])
 {
 	int opt;
 	unsigned binary = 0;
 	unsigned port = 0;
-	long long terminate_at = 0;
-	long long instruction_count = 0;
+	unsigned gdb_port = 0;
+	unsigned checkpoint_ms = 0;
+	unsigned n;
 	uint16_t load_addr = 0;
 	uint16_t entry_addr = 0;
 	char* boot_file = NULL;
+	char *record_file = NULL;
+	char *replay_file = NULL;
+	char *batch_file = NULL;
+	char *perf_file = NULL;
+	char *ngram_file = NULL;
+	char *profile_file = NULL;
+	char *block_file = NULL;
+	float speed = 1.0;
+	unsigned speed_given = 0;
+	unsigned threaded_io = 0;
+	uint64_t start_ns;
+	uint32_t parity_addr[MAX_PARITY];
+	unsigned num_parity = 0;
+	unsigned i;
 
 	mux_init();
 
-	while ((opt = getopt(argc, argv, "b::A:E:dFl:s:S:t:T:")) != -1) {
+	while ((opt = getopt_long(argc, argv, "b::A:E:dFIl:n:P:r:R:s:S:t:T:x:",
+				  long_options, NULL)) != -1) {
 		switch (opt) {
 		case 'b':
 			binary = 1;
@@ -734,9 +1202,25 @@ int main(int argc, char *argv[])
 		case 'F':
 			finch = 1;
 			break;
+		case 'I':
+			threaded_io = 1;
+			break;
 		case 'l':
 			port = atoi(optarg);
 			break;
+		case 'n':
+			ngram_file = optarg;
+			cpu6_ngram_enable();
+			break;
+		case 'P':
+			perf_file = optarg;
+			break;
+		case 'r':
+			record_file = optarg;
+			break;
+		case 'R':
+			replay_file = optarg;
+			break;
 		case 's':
 			/* CPU switches */
 			cpu6_set_switches(atoi(optarg));
@@ -751,6 +1235,51 @@ int main(int argc, char *argv[])
 		case 'T':
 			terminate_at = atol(optarg);
 			break;
+		case 'x':
+			batch_file = optarg;
+			break;
+		case OPT_SPEED:
+			speed = parse_speed(optarg);
+			speed_given = 1;
+			break;
+		case OPT_CATCHUP:
+			parse_catchup(optarg);
+			break;
+		case OPT_STATS:
+			stats_init(optarg);
+			break;
+		case OPT_PARITY:
+			if (num_parity == MAX_PARITY) {
+				fprintf(stderr, "Too many parity errors\n");
+				exit(1);
+			}
+			parity_addr[num_parity++] = parse_parity(optarg);
+			break;
+		case OPT_RAM:
+			parse_ram(optarg);
+			break;
+		case OPT_ROM:
+			add_rom(optarg);
+			break;
+		case OPT_MACHINE:
+			set_machine(machine_load(optarg));
+			break;
+		case OPT_GDB:
+			gdb_port = atoi(optarg);
+			break;
+		case OPT_CHECKPOINT:
+			checkpoint_ms = atoi(optarg);
+			if (checkpoint_ms == 0) {
+				fprintf(stderr, "Bad checkpoint interval\n");
+				exit(1);
+			}
+			break;
+		case OPT_PROFILE:
+			profile_file = optarg;
+			break;
+		case OPT_BLOCKS:
+			block_file = optarg;
+			break;
 		default:
 			usage();
 		}
@@ -761,20 +1290,60 @@ int main(int argc, char *argv[])
 	if (optind < argc)
 		usage();
 
-	if (port == 0)
+	if (record_file && replay_file) {
+		fprintf(stderr, "cannot record and replay at the same time\n");
+		exit(1);
+	}
+	if (batch_file && replay_file) {
+		fprintf(stderr, "cannot replay and run a script at the same time\n");
+		exit(1);
+	}
+	if (block_file && !profile_file) {
+		fprintf(stderr, "--blocks is only used with --profile\n");
+		exit(1);
+	}
+	if (batch_file && checkpoint_ms) {
+		/* The script's input isn't logged so can't be gone over again */
+		fprintf(stderr, "cannot take checkpoints while running a script\n");
+		exit(1);
+	}
+
+	if (replay_file || batch_file) {
+		/* All input comes from the log or script, so there is no
+		   terminal to wait for and no reason to run at real time */
+		mux_attach(0, -1, STDOUT_FILENO);
+		throttle = 0;
+	} else if (port == 0)
 		tty_init();
 	else
 		net_init(port);
-
+	/* An explicit speed applies even to replays and scripts */
+	if (speed_given)
+		throttle = speed > 0;
+
+	if (threaded_io)
+		hostio_start();
+	if (record_file)
+		replay_record_open(record_file);
+	if (profile_file)
+		profile_init(block_file);
+
+	mem_init();
 	load_rom("bootstrap_unscrambled.bin", 0x3FC00, 0x0200);
 	if (diag) {
+		/* The diag code runs in place so the board can't move */
 		load_rom("Diag_F1_Rev_1.0.BIN", 0x08000, 0x0800);
 		load_rom("Diag_F2_Rev_1.0.BIN", 0x08800, 0x0800);
 		load_rom("Diag_F3_Rev_1.0.BIN", 0x09000, 0x0800);
 		load_rom("Diag_F4_1133CMD.BIN", 0x09800, 0x0800);
 	}
+	for (i = 0; i < num_roms; i++)
+		load_rom(rom_name[i], rom_addr[i], 0);
 
+	board_init();
+	dma_init();
 	dsk_init();
+	fdc_init(finch);
 	cpu6_init();
 
 	if (boot_file != NULL) {
@@ -783,7 +1352,7 @@ int main(int argc, char *argv[])
 				fprintf(stderr, "raw binary needs a load address\n");
 				exit(1);
 			}
-			load_rom(boot_file, load_addr, 0);
+			load_image(boot_file, load_addr, 0);
 			if (entry_addr == 0) {
 				// by default, enter at first byte of binary
 				entry_addr = load_addr;
@@ -808,63 +1377,89 @@ int main(int argc, char *argv[])
 			regpair_write_debug(A, 0x00C5);   // AL= mux0 config?
 		}
 	}
+	/* After loading, which would have cleared them */
+	for (i = 0; i < num_parity; i++) {
+		if (!mem_parity_valid(parity_addr[i])) {
+			fprintf(stderr, "Parity address not valid\n");
+			exit(1);
+		}
+		mem_parity_inject(parity_addr[i]);
+	}
+
+	if (replay_file)
+		replay_open(replay_file);
+	if (batch_file)
+		batch_open(batch_file);
+	if (checkpoint_ms) {
+		checkpoint_init(checkpoint_ms);
+		if (!replay_file)
+			replay_keep();
+	}
+
+	if (gdb_port)
+		debug_init(gdb_port);
 
 	throttle_init();
-	throttle_set_speed(1.0);
+	throttle_set_speed(speed);
+	cpu6_trace_irq(trace & TRACE_IRQ);
+	start_ns = monotonic_time_ns();
 
 	while (!emulator_done) {
-		cpu6_execute_one(trace & TRACE_CPU);
+		if (cpu_timestamp_ns >= checkpoint_due)
+			checkpoint_take();
+		n = cpu6_execute_one(trace & TRACE_CPU);
+		/* The debugger put a checkpoint back, start again from there */
+		if (n == 0)
+			continue;
+		instruction_count += n;
 		if (cpu6_halted())
 			halt_system();
-		/* Service DMA */
-		if (hawk_dma) {
-			while(dma_write_active()) {
-				// Advance time to next scheduler event
-				int64_t next = scheduler_next();
-				if (next == -1) {
-					fprintf(stderr, "DMA stalled\n");
-					exit(-1);
-				}
-				if (next > cpu_timestamp_ns)
-					cpu_timestamp_ns = next;
-				run_scheduler(cpu_timestamp_ns, trace & TRACE_SCHEDULER);
+		/* A bus master holding the bus stops the CPU */
+		while (dma_bus_held()) {
+			// Advance time to next scheduler event
+			int64_t next = scheduler_next();
+			if (next == -1) {
+				fprintf(stderr, "DMA stalled\n");
+				exit(-1);
 			}
-			hawk_dma_done();
-		}
-		/* Floppy controller command host to controller */
-		if (fd_dma == 1) {
-			if (dma_write_active())
-				fdc_dma_in(dma_write_cycle());
-			else
-				fdc_dma_in_done();
-		}
-		if (fd_dma == 2) {
-			if (dma_read_cycle(fdc_dma_out()))
-				fdc_dma_out_done();
-		}
-		if (cmd_dma == 1) {
-			if (dma_write_active())
-				cmd_dma_cmd_in(dma_write_cycle());
-			else
-				cmd_dma_cmd_done();
-		}
-		if (cmd_dma == 3) {
-			if (dma_read_cycle(cmd_dma_cmd_out()))
-				cmd_dma_cmd_out_done();
+			if (next > cpu_timestamp_ns)
+				cpu_timestamp_ns = next;
+			run_scheduler(cpu_timestamp_ns, trace & TRACE_SCHEDULER);
 		}
 		/* Update peripherals state */
 		mux_poll(trace & TRACE_MUX);
 
 		run_scheduler(cpu_timestamp_ns, trace & TRACE_SCHEDULER);
-		throttle_emulation(cpu_timestamp_ns);
+		if (throttle && !checkpoint_rerun && cpu_timestamp_ns >= throttle_next)
+			throttle_next = throttle_emulation(cpu_timestamp_ns);
+		if (stats_requested) {
+			stats_requested = 0;
+			stats_write(instruction_count, cpu_timestamp_ns,
+				monotonic_time_ns() - start_ns);
+		}
 
-		instruction_count++;
 		if (terminate_at && instruction_count >= terminate_at) {
+			hostio_flush();
 			printf("\nTerminated after %lli instructions\n", instruction_count);
 			if (trace)
 				fprintf(stderr, "Terminated after %lli instructions\n", instruction_count);
 			break;
 		}
 	}
+	if (perf_file)
+		perf_report(perf_file, instruction_count,
+			monotonic_time_ns() - start_ns);
+	if (ngram_file)
+		cpu6_ngram_report(ngram_file);
+	if (profile_file)
+		profile_report(profile_file);
+	cpu6_irq_report();
+	stats_write(instruction_count, cpu_timestamp_ns,
+		monotonic_time_ns() - start_ns);
+	if (batch_file) {
+		debug_exit(batch_exit_code());
+		return batch_exit_code();
+	}
+	debug_exit(0);
 	return 0;
 }
@@ -1 +1,25 @@
+#include <stdint.h>
+
 extern volatile unsigned int emulator_done;
+
+/* Host system calls made while emulating, reported by -P */
+extern unsigned long host_syscalls;
+
+/* Give a byte of memory bad parity until it is next written */
+int mem_parity_valid(uint32_t addr);
+void mem_parity_inject(uint32_t addr);
+
+/* Send accesses to the 1K block holding addr through debug_watch */
+void mem_watch(uint32_t addr, unsigned on);
+
+/* Instructions run so far */
+extern long long instruction_count;
+
+/* Memory a 2K page at a time for checkpoints, with its parity bitmap and
+   count of good bytes */
+#define MEM_PAGES	256
+#define MEM_PAGE_STATE	(2048 + 256 + 2)
+
+unsigned mem_page_dirty(unsigned pg);
+int mem_page_save(unsigned pg, uint8_t *buf);
+void mem_page_restore(unsigned pg, const uint8_t *buf);
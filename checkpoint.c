@@ -0,0 +1,270 @@
+/*
+ *	Checkpoints, and going back to them
+ *
+ *	With --checkpoint <ms> a copy of the machine is taken each time that
+ *	much emulated time has gone by: the state each module registers (the
+ *	CPU, the MMU, the devices and their DMA), the scheduler queue, and
+ *	the pages of memory written since the checkpoint before. Only the
+ *	first one has all of memory. A dirty page costs a byte store on each
+ *	write, which is all there is to pay until a checkpoint falls due.
+ *
+ *	The run from a checkpoint is the same each time as long as the input
+ *	is, and the MUX input is kept as it is read (see replay.c). Going back
+ *	to an instruction means putting back the last checkpoint before it
+ *	and running on to it. Until the machine gets back to the furthest
+ *	point it had reached, input comes from the log, the host fds are left
+ *	alone, output is thrown away as it has been seen already, and there is
+ *	no throttling. Later checkpoints are dropped and taken again on the
+ *	way.
+ *
+ *	Only the latest CHECKPOINT_MAX are kept. Beyond that the oldest is
+ *	merged into the one after it, so how far back can be gone is the
+ *	interval times CHECKPOINT_MAX.
+ *
+ *	Statistics, tracing and batch scripts are not part of it, and nor is
+ *	the debugger. Memory or registers changed from the debugger stay
+ *	changed only until the next time a checkpoint is put back.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "centurion.h"
+#include "checkpoint.h"
+#include "console.h"
+#include "scheduler.h"
+
+#define CHECKPOINT_MAX		64	/* Kept at once */
+#define CHECKPOINT_REGIONS	256
+#define CHECKPOINT_HOOKS	16
+
+struct region {
+	void *addr;
+	size_t len;
+};
+
+struct hook {
+	void (*fn)(void *arg);
+	void *arg;
+};
+
+struct checkpoint {
+	int64_t time;
+	long long icount;
+	uint8_t *state;			/* The regions one after another */
+	struct saved_event *events;
+	unsigned num_events;
+	uint8_t **page;			/* Written since the one before */
+};
+
+int64_t checkpoint_due = INT64_MAX;
+unsigned checkpoint_rerun;
+
+static int64_t interval_ns;
+static struct region regions[CHECKPOINT_REGIONS];
+static unsigned num_regions;
+static size_t state_size;
+static struct hook hooks[CHECKPOINT_HOOKS];
+static unsigned num_hooks;
+
+static struct checkpoint ckpt[CHECKPOINT_MAX];
+static unsigned num_ckpt;
+static int64_t horizon;		/* Furthest the machine has run */
+
+static void rerun_done(struct event_t *event, int64_t late_ns);
+static struct event_t rerun_evt = {
+	.name = "rerun",
+	.callback = rerun_done
+};
+
+static void *checkpoint_alloc(size_t len)
+{
+	void *p = malloc(len);
+
+	if (p == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	return p;
+}
+
+void checkpoint_register(void *addr, size_t len)
+{
+	if (num_regions == CHECKPOINT_REGIONS) {
+		fprintf(stderr, "Too many checkpoint regions\n");
+		exit(1);
+	}
+	regions[num_regions].addr = addr;
+	regions[num_regions].len = len;
+	num_regions++;
+	state_size += len;
+}
+
+/* Called after a checkpoint has been put back */
+void checkpoint_hook(void (*fn)(void *arg), void *arg)
+{
+	if (num_hooks == CHECKPOINT_HOOKS) {
+		fprintf(stderr, "Too many checkpoint hooks\n");
+		exit(1);
+	}
+	hooks[num_hooks].fn = fn;
+	hooks[num_hooks].arg = arg;
+	num_hooks++;
+}
+
+void checkpoint_init(unsigned interval_ms)
+{
+	interval_ns = interval_ms * (int64_t)ONE_MILISECOND_NS;
+	checkpoint_due = 0;
+}
+
+int checkpoint_enabled(void)
+{
+	return interval_ns != 0;
+}
+
+static void checkpoint_free(struct checkpoint *c)
+{
+	unsigned pg;
+
+	for (pg = 0; pg < MEM_PAGES; pg++)
+		free(c->page[pg]);
+	free(c->page);
+	free(c->events);
+	free(c->state);
+}
+
+/* Make room by merging the oldest into the one after it */
+static void checkpoint_fold(void)
+{
+	struct checkpoint *old = &ckpt[0];
+	struct checkpoint *next = &ckpt[1];
+	unsigned pg;
+
+	for (pg = 0; pg < MEM_PAGES; pg++) {
+		if (next->page[pg] == NULL) {
+			next->page[pg] = old->page[pg];
+			old->page[pg] = NULL;
+		}
+	}
+	checkpoint_free(old);
+	memmove(ckpt, ckpt + 1, --num_ckpt * sizeof(*ckpt));
+}
+
+void checkpoint_take(void)
+{
+	struct checkpoint *c;
+	uint8_t *p;
+	unsigned i, pg, dirty;
+
+	if (num_ckpt == CHECKPOINT_MAX)
+		checkpoint_fold();
+	c = &ckpt[num_ckpt++];
+	c->time = get_current_time();
+	c->icount = instruction_count;
+
+	c->state = p = checkpoint_alloc(state_size ? state_size : 1);
+	for (i = 0; i < num_regions; i++) {
+		memcpy(p, regions[i].addr, regions[i].len);
+		p += regions[i].len;
+	}
+	c->num_events = scheduler_save(&c->events);
+
+	c->page = checkpoint_alloc(MEM_PAGES * sizeof(*c->page));
+	for (pg = 0; pg < MEM_PAGES; pg++) {
+		c->page[pg] = NULL;
+		dirty = mem_page_dirty(pg);
+		/* The first one has everything */
+		if (!dirty && num_ckpt > 1)
+			continue;
+		p = checkpoint_alloc(MEM_PAGE_STATE);
+		if (mem_page_save(pg, p))
+			c->page[pg] = p;
+		else
+			free(p);
+	}
+	checkpoint_due = c->time + interval_ns;
+}
+
+static void checkpoint_restore(unsigned k)
+{
+	struct checkpoint *c = &ckpt[k];
+	int64_t now = get_current_time();
+	unsigned i, pg, changed;
+	uint8_t *p;
+	int j;
+
+	/* A page changed since goes back to its last copy up to here */
+	for (pg = 0; pg < MEM_PAGES; pg++) {
+		changed = mem_page_dirty(pg);
+		for (i = k + 1; i < num_ckpt; i++)
+			if (ckpt[i].page[pg])
+				changed = 1;
+		if (!changed)
+			continue;
+		for (j = k; j >= 0 && ckpt[j].page[pg] == NULL; j--)
+			;
+		mem_page_restore(pg, j >= 0 ? ckpt[j].page[pg] : NULL);
+	}
+	while (num_ckpt > k + 1)
+		checkpoint_free(&ckpt[--num_ckpt]);
+
+	p = c->state;
+	for (i = 0; i < num_regions; i++) {
+		memcpy(regions[i].addr, p, regions[i].len);
+		p += regions[i].len;
+	}
+	scheduler_restore(c->events, c->num_events);
+	checkpoint_due = c->time + interval_ns;
+
+	if (now > horizon)
+		horizon = now;
+	checkpoint_rerun = 1;
+	rerun_evt.delta_ns = horizon - c->time;
+	schedule_event(&rerun_evt);
+
+	for (i = 0; i < num_hooks; i++)
+		hooks[i].fn(hooks[i].arg);
+}
+
+/* Back where the machine had been, it is live again */
+static void rerun_done(struct event_t *event, int64_t late_ns)
+{
+	checkpoint_rerun = 0;
+	throttle_resume(get_current_time());
+}
+
+/*
+ *	Put back the last checkpoint taken at or before the given instruction
+ *	count, returns the count it was taken at or -1 if there is none.
+ */
+long long checkpoint_goto(long long icount)
+{
+	int k;
+
+	for (k = num_ckpt - 1; k >= 0; k--) {
+		if (ckpt[k].icount <= icount) {
+			checkpoint_restore(k);
+			return ckpt[k].icount;
+		}
+	}
+	return -1;
+}
+
+void checkpoint_info(char *buf, size_t len)
+{
+	unsigned i, pg, pages = 0;
+
+	if (num_ckpt == 0) {
+		snprintf(buf, len, "no checkpoints\n");
+		return;
+	}
+	for (i = 0; i < num_ckpt; i++)
+		for (pg = 0; pg < MEM_PAGES; pg++)
+			if (ckpt[i].page[pg])
+				pages++;
+	snprintf(buf, len, "%u checkpoints, instructions %lld to %lld, %u pages%s\n",
+		num_ckpt, ckpt[0].icount, ckpt[num_ckpt - 1].icount, pages,
+		checkpoint_rerun ? ", rerunning" : "");
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Emulated time the next checkpoint is due, never if they are off */
+extern int64_t checkpoint_due;
+/* Set while going over time already run, see checkpoint.c */
+extern unsigned checkpoint_rerun;
+
+void checkpoint_init(unsigned interval_ms);
+int checkpoint_enabled(void);
+
+/* State a module wants put back, and what to do once it has been */
+void checkpoint_register(void *addr, size_t len);
+#define CHECKPOINT(var)	checkpoint_register(&(var), sizeof(var))
+void checkpoint_hook(void (*fn)(void *arg), void *arg);
+
+void checkpoint_take(void);
+long long checkpoint_goto(long long icount);
+void checkpoint_info(char *buf, size_t len);
@@ -1,6 +1,9 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <termios.h>
@@ -14,6 +17,7 @@
 #include "console.h"
 #include "mux.h"
 #include "scheduler.h"
+#include "stats.h"
 
 static struct termios saved_term, term;
 
@@ -49,7 +53,8 @@ void tty_init(void)
         mux_attach(0, STDIN_FILENO, STDOUT_FILENO);
 }
 
-void net_init(unsigned short port)
+/* Wait for a connection on a local port, returns the socket */
+int net_listen(unsigned short port, const char *what)
 {
 	struct sockaddr_in sin;
         int sock_fd, io_fd;
@@ -69,7 +74,7 @@ void net_init(unsigned short port)
 	/* TODO set reuseaddr */
 	listen(sock_fd, 1);
 
-	printf("[Waiting terminal connection...]\n");
+	printf("[Waiting %s connection...]\n", what);
 	fflush(stdout);
 
 	io_fd = accept(sock_fd, NULL, NULL);
@@ -78,6 +83,13 @@ void net_init(unsigned short port)
 		exit(1);
 	}
 	close(sock_fd);
+	return io_fd;
+}
+
+void net_init(unsigned short port)
+{
+	int io_fd = net_listen(port, "terminal");
+
 	fcntl(io_fd, F_SETFL, FNDELAY);
 
         mux_attach(0, io_fd, io_fd);
@@ -91,6 +103,7 @@ static int select_wrapper(int maxfd, fd_set* i, fd_set* o)
 	tv.tv_sec = 0;
 	tv.tv_usec = 0;
 
+	host_syscalls++;
 	rc = select(maxfd, i, o, NULL, &tv);
 	if (rc == -1 && errno != EINTR) {
 		perror("select() failed in MUX");
@@ -99,12 +112,211 @@ static int select_wrapper(int maxfd, fd_set* i, fd_set* o)
 	return rc;
 }
 
+/*
+ *	Host I/O thread (-I)
+ *
+ *	A second thread owns the MUX host descriptors so the CPU thread makes
+ *	no system calls for console or network traffic. Input is read ahead
+ *	into a ring per unit and picked up by mux_poll_fds, where it is given
+ *	its emulated arrival time exactly as a select() hit would be, so
+ *	recording and replay are unaffected. Output goes the other way through
+ *	a single ring of unit and byte. Each ring has one producer and one
+ *	consumer, so ordered loads and stores of the indices are all the
+ *	locking needed. A full output ring stalls the CPU until the thread
+ *	catches up, which bounds how far the terminal can lag the guest.
+ *	A byte leaves the ring before it is written, so a separate count of
+ *	bytes written tells hostio_flush when the host really has them all.
+ *
+ *	The thread works from its own copy of the descriptors, taken when it
+ *	starts. They are all attached by then and never change after.
+ */
+#define HOSTIO_RING	4096	/* Entries, a power of two */
+
+struct hostio_ring {
+	atomic_uint head;	/* Advanced by the producer */
+	atomic_uint tail;	/* Advanced by the consumer */
+	uint16_t data[HOSTIO_RING];
+};
+
+int hostio_enabled;
+static struct hostio_ring hostio_rx[NUM_MUX_UNITS];
+static struct hostio_ring hostio_tx;
+static unsigned hostio_queued;		/* Output bytes queued, CPU side */
+static atomic_uint hostio_written;	/* Of them written, by the thread */
+static int hostio_in_fd[NUM_MUX_UNITS];
+static int hostio_out_fd[NUM_MUX_UNITS];
+static atomic_int hostio_stopping;
+static pthread_t hostio_thread;
+
+static unsigned ring_used(struct hostio_ring *r)
+{
+	return atomic_load_explicit(&r->head, memory_order_acquire) -
+		atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+static int ring_put(struct hostio_ring *r, uint16_t v)
+{
+	unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+	if (head - atomic_load_explicit(&r->tail, memory_order_acquire)
+	    == HOSTIO_RING)
+		return 0;
+	r->data[head % HOSTIO_RING] = v;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	return 1;
+}
+
+static int ring_get(struct hostio_ring *r)
+{
+	unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	int v;
+
+	if (tail == atomic_load_explicit(&r->head, memory_order_acquire))
+		return -1;
+	v = r->data[tail % HOSTIO_RING];
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+	return v;
+}
+
+static void hostio_drain(void)
+{
+	int v;
+
+	while ((v = ring_get(&hostio_tx)) != -1) {
+		mux_host_write(hostio_out_fd[v >> 8], v & 0xFF);
+		atomic_fetch_add_explicit(&hostio_written, 1,
+					  memory_order_release);
+	}
+}
+
+static void *hostio_main(void *unused)
+{
+	struct pollfd pfd[NUM_MUX_UNITS];
+	unsigned pfd_unit[NUM_MUX_UNITS];
+	unsigned eof = 0;
+
+	while (!atomic_load(&hostio_stopping)) {
+		int n = 0;
+		int i, unit;
+
+		for (unit = 0; unit < NUM_MUX_UNITS; unit++) {
+			int fd = hostio_in_fd[unit];
+
+			if (fd == -1 || (eof & (1 << unit)) ||
+			    ring_used(&hostio_rx[unit]) == HOSTIO_RING)
+				continue;
+			pfd[n].fd = fd;
+			pfd[n].events = POLLIN;
+			pfd_unit[n++] = unit;
+		}
+		/* Wake at least every millisecond to pass on output */
+		if (poll(pfd, n, 1) == -1 && errno != EINTR) {
+			perror("poll() failed in host I/O");
+			exit(1);
+		}
+		for (i = 0; i < n; i++) {
+			struct hostio_ring *r = &hostio_rx[pfd_unit[i]];
+			uint8_t buf[256];
+			unsigned len = HOSTIO_RING - ring_used(r);
+			ssize_t got, j;
+
+			if (pfd[i].revents == 0)
+				continue;
+			if (len > sizeof(buf))
+				len = sizeof(buf);
+			got = read(pfd[i].fd, buf, len);
+			if (got < 0 && (errno == EAGAIN || errno == EINTR))
+				continue;
+			if (got <= 0) {
+				/* Passed on as end of file, the ring has room */
+				ring_put(r, HOSTIO_EOF);
+				eof |= 1 << pfd_unit[i];
+				continue;
+			}
+			for (j = 0; j < got; j++)
+				ring_put(r, buf[j]);
+		}
+		hostio_drain();
+	}
+	hostio_drain();
+	return NULL;
+}
+
+void hostio_stop(void)
+{
+	if (!hostio_enabled)
+		return;
+	atomic_store(&hostio_stopping, 1);
+	pthread_join(hostio_thread, NULL);
+	hostio_enabled = 0;
+}
+
+void hostio_start(void)
+{
+	unsigned unit;
+
+	for (unit = 0; unit < NUM_MUX_UNITS; unit++) {
+		hostio_in_fd[unit] = mux_get_in_fd(unit);
+		hostio_out_fd[unit] = mux_get_out_fd(unit);
+	}
+	if (pthread_create(&hostio_thread, NULL, hostio_main, NULL)) {
+		fprintf(stderr, "unable to start the host I/O thread\n");
+		exit(1);
+	}
+	hostio_enabled = 1;
+	atexit(hostio_stop);
+}
+
+int hostio_rx_pending(unsigned unit)
+{
+	return ring_used(&hostio_rx[unit]) != 0;
+}
+
+/* Next input byte, HOSTIO_EOF, or -1 if nothing has arrived */
+int hostio_read(unsigned unit)
+{
+	return ring_get(&hostio_rx[unit]);
+}
+
+static void hostio_wait(void)
+{
+	struct timespec ts = { 0, 100000 };
+
+	host_syscalls++;
+	nanosleep(&ts, NULL);
+}
+
+void hostio_write(unsigned unit, uint8_t val)
+{
+	while (!ring_put(&hostio_tx, (unit << 8) | val))
+		hostio_wait();
+	hostio_queued++;
+}
+
+/* Wait for queued output to reach the host, so it lands before anything
+   we print ourselves */
+void hostio_flush(void)
+{
+	while (hostio_enabled &&
+	       atomic_load_explicit(&hostio_written, memory_order_acquire)
+	       != hostio_queued)
+		hostio_wait();
+}
+
 void mux_poll_fds(unsigned trace)
 {
 	fd_set i;
 	int max_fd = 0;
 	int unit;
 
+	if (hostio_enabled) {
+		for (unit = 0; unit < NUM_MUX_UNITS; unit++)
+			if (mux_get_in_poll_fd(unit) != -1 &&
+			    hostio_rx_pending(unit))
+				mux_set_read_ready(unit, trace);
+		return;
+	}
+
 	FD_ZERO(&i);
 
 	for (unit = 0; unit < NUM_MUX_UNITS; unit++) {
@@ -132,40 +344,117 @@ void mux_poll_fds(unsigned trace)
 
 
 // Gets the current time from the OS (in nanoseconds)
-uint64_t monotonic_time_ns() {
+uint64_t monotonic_time_ns(void) {
 	struct timespec ts;
 	clock_gettime(CLOCK_MONOTONIC, &ts);
 	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
 
-static uint64_t throttle_start_time;
-static float throttle_speed;
+/*
+ *	Throttling
+ *
+ *	The emulated clock is only compared with the host clock every so
+ *	often. The interval is worked out from the measured ratio of emulated
+ *	to host time so that a check falls about every THROTTLE_CHECK_NS of
+ *	host time whatever the speed. When the emulator falls behind, the
+ *	catch-up policy decides what happens to the lost time: burst runs
+ *	flat out until it is made up, forgive drops it once it passes
+ *	THROTTLE_FORGIVE_NS, and cap makes it up but at no more than a set
+ *	multiple of the requested speed.
+ */
+#define THROTTLE_CHECK_NS	(1 * ONE_MILISECOND_NS)
+#define THROTTLE_MIN_NS		(10 * ONE_MICROSECOND_NS)
+#define THROTTLE_MAX_NS		(100 * ONE_MILISECOND_NS)
+#define THROTTLE_SLEEP_NS	(5 * ONE_MILISECOND_NS)
+#define THROTTLE_FORGIVE_NS	(50 * ONE_MILISECOND_NS)
+
+static uint64_t throttle_start_time;	/* Host time matching throttle_base */
+static uint64_t throttle_base;		/* Emulated time at the start */
+static float throttle_speed = 1.0;
+static unsigned throttle_policy = THROTTLE_BURST;
+static float throttle_cap;
+static uint64_t last_host, last_emulated;	/* At the previous check */
 
 void throttle_init() {
 	throttle_start_time = monotonic_time_ns();
+	throttle_base = 0;
+	last_host = throttle_start_time;
+	last_emulated = 0;
 }
 
 void throttle_set_speed(float speed) {
 	throttle_speed = speed;
 }
 
-// Stall emulation if running faster than realtime
-void throttle_emulation(uint64_t expected_time_ns) {
+// Start again from here after emulated time stood still, as it does while
+// the debugger has the machine stopped
+void throttle_resume(uint64_t emulated_ns) {
+	throttle_start_time = monotonic_time_ns();
+	throttle_base = emulated_ns;
+	last_host = throttle_start_time;
+	last_emulated = emulated_ns;
+}
+
+void throttle_set_policy(unsigned policy, float cap) {
+	throttle_policy = policy;
+	throttle_cap = cap;
+}
+
+static void throttle_sleep(int64_t ns)
+{
+	struct timespec delta;
+
+	delta.tv_sec = ns / 1000000000ULL;
+	delta.tv_nsec = ns % 1000000000ULL;
+	stats.throttle_sleep_ns += ns;
+
+	// sometimes nanosecond returns early, so loop until it finishes
+	do
+		host_syscalls++;
+	while (nanosleep(&delta, &delta));
+}
+
+// Stall emulation if running faster than realtime. Returns the emulated
+// time at which it wants to be called again
+uint64_t throttle_emulation(uint64_t emulated_ns) {
 	uint64_t now = monotonic_time_ns();
-	uint64_t adjusted_target = expected_time_ns / throttle_speed;
+	uint64_t adjusted_target = (emulated_ns - throttle_base) / throttle_speed;
 	int64_t delta_ns = (throttle_start_time + adjusted_target) - now;
+	double rate;
+	uint64_t interval;
 
 	// We don't want to sleep if the delta is less than 5ms
-	if (delta_ns > (5 * ONE_MILISECOND_NS)) {
-		struct timespec delta;
-		delta.tv_sec = delta_ns / 1000000000ULL;
-		delta.tv_nsec = delta_ns % 1000000000ULL;
-
-		// sometimes nanosecond returns early, so loop until it finishes
-		while (nanosleep(&delta, &delta));
-	} else if (delta_ns < -(50 * ONE_MILISECOND_NS)) {
+	if (delta_ns > THROTTLE_SLEEP_NS) {
+		throttle_sleep(delta_ns);
+		now = monotonic_time_ns();
+	} else if (delta_ns < 0 && throttle_policy == THROTTLE_FORGIVE) {
 		// If have lagged by too much, we forgive the time
-		//throttle_start_time += delta_ns;
+		if (delta_ns < -THROTTLE_FORGIVE_NS) {
+			throttle_start_time = now;
+			throttle_base = emulated_ns;
+		}
+	} else if (delta_ns < 0 && throttle_policy == THROTTLE_CAP) {
+		// Catch up, but no faster than the cap
+		int64_t earliest = last_host + (emulated_ns - last_emulated)
+			/ (throttle_speed * throttle_cap);
+
+		if (earliest - (int64_t)now > THROTTLE_SLEEP_NS) {
+			throttle_sleep(earliest - now);
+			now = monotonic_time_ns();
+		}
 	}
+
+	if (now > last_host && emulated_ns > last_emulated) {
+		rate = (double)(emulated_ns - last_emulated) / (now - last_host);
+		interval = rate * THROTTLE_CHECK_NS;
+		if (interval < THROTTLE_MIN_NS)
+			interval = THROTTLE_MIN_NS;
+		if (interval > THROTTLE_MAX_NS)
+			interval = THROTTLE_MAX_NS;
+	} else
+		interval = THROTTLE_MIN_NS;
+	last_host = now;
+	last_emulated = emulated_ns;
+	return emulated_ns + interval;
 }
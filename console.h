@@ -4,7 +4,28 @@
 
 void tty_init(void);
 void net_init(unsigned short port);
+int net_listen(unsigned short port, const char *what);
 
-void throttle_emulation(uint64_t expected_time_ns);
+uint64_t monotonic_time_ns(void);
+
+/* Host I/O thread, see console.c */
+#define HOSTIO_EOF	0x100
+
+extern int hostio_enabled;
+void hostio_start(void);
+void hostio_stop(void);
+void hostio_flush(void);
+int hostio_rx_pending(unsigned unit);
+int hostio_read(unsigned unit);
+void hostio_write(unsigned unit, uint8_t val);
+
+/* Catch-up policies when the emulator falls behind */
+#define THROTTLE_BURST		0	/* Run flat out until caught up */
+#define THROTTLE_FORGIVE	1	/* Drop the lost time */
+#define THROTTLE_CAP		2	/* Catch up at a limited speed */
+
+uint64_t throttle_emulation(uint64_t emulated_ns);
 void throttle_init();
 void throttle_set_speed(float speed);
+void throttle_resume(uint64_t emulated_ns);
+void throttle_set_policy(unsigned policy, float cap);
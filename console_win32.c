@@ -52,6 +52,12 @@ void tty_init(void)
         mux_attach(0, STDIN_FILENO, STDOUT_FILENO);
 }
 
+int net_listen(unsigned short port, const char *what)
+{
+        fprintf(stderr, "Network is not implemented yet on Win32\n");
+        abort();
+}
+
 void net_init(unsigned short port)
 {
         fprintf(stderr, "Network is not implemented yet on Win32\n");
@@ -105,8 +111,49 @@ void mux_poll_fds(unsigned trace)
 }
 
 
-void throttle_emulation(uint64_t expected_time_ns) {
+uint64_t monotonic_time_ns(void) {
+        LARGE_INTEGER freq, count;
+
+        QueryPerformanceFrequency(&freq);
+        QueryPerformanceCounter(&count);
+        return (count.QuadPart / freq.QuadPart) * 1000000000ULL
+                + (count.QuadPart % freq.QuadPart) * 1000000000ULL / freq.QuadPart;
+}
+
+/* No host I/O thread on Win32 */
+int hostio_enabled;
+
+void hostio_start(void)
+{
+        fprintf(stderr, "Threaded host I/O is not implemented yet on Win32\n");
+        exit(1);
+}
+
+void hostio_stop(void)
+{
+}
+
+void hostio_flush(void)
+{
+}
+
+int hostio_rx_pending(unsigned unit)
+{
+        return 0;
+}
+
+int hostio_read(unsigned unit)
+{
+        return -1;
+}
+
+void hostio_write(unsigned unit, uint8_t val)
+{
+}
+
+uint64_t throttle_emulation(uint64_t emulated_ns) {
         // Unimplemented
+        return UINT64_MAX;
 }
 
 void throttle_init() {
@@ -115,4 +162,12 @@ void throttle_init() {
 
 void throttle_set_speed(float speed) {
         // Unimplemented
+}
+
+void throttle_resume(uint64_t emulated_ns) {
+        // Unimplemented
+}
+
+void throttle_set_policy(unsigned policy, float cap) {
+        // Unimplemented
 }
\ No newline at end of file
@@ -20,9 +20,16 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "bignum.h"
 #include "cbin.h"
+#include "checkpoint.h"
 #include "cpu6.h"
+#include "debug.h"
 #include "disassemble.h"
+#include "dma.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "stats.h"
 
 static uint8_t cpu_ipl = 0;	/* IPL 0-15 */
 static uint8_t cpu_mmu = 0;	/* MMU tag 0-7 */
@@ -34,19 +41,71 @@ static uint8_t switches = 0xF0;
 static uint8_t int_enable;
 static unsigned halted;
 static unsigned pending_ipl_mask = 0;
+static unsigned cycles;		/* Cost of the current instruction */
+
+/*
+ *	Interrupt lifecycle, in emulated ns. A level is asserted, taken when
+ *	the CPU switches to it, returned from with RI or RIM, and deasserted.
+ *	Latency is assert to the first take, service is take to return and
+ *	active is assert to deassert.
+ */
+static uint64_t irq_asserted_ns[16];
+static uint64_t irq_taken_ns[16];
+static unsigned irq_latency_pending;	/* Asserted, not yet taken */
+static unsigned irq_in_service;		/* Taken, not yet returned from */
+static unsigned irq_trace;
+
+/* For -t, the time in the same form as the scheduler trace */
+static void irq_log(unsigned ipl, const char *what, int64_t ns)
+{
+	int64_t now = get_current_time();
+
+	if (!irq_trace)
+		return;
+	fprintf(stderr, "%li.%06li: IRQ %X %s", (long)(now / ONE_SECOND_NS),
+		(long)((now % (int64_t)ONE_SECOND_NS) / ONE_MICROSECOND_NS),
+		ipl, what);
+	if (ns >= 0)
+		fprintf(stderr, " %.3f us", ns / ONE_MICROSECOND_NS);
+	fputc('\n', stderr);
+}
+
+static void irq_taken(unsigned ipl)
+{
+	uint64_t now = get_current_time();
+	uint64_t latency;
+
+	stats.interrupts[ipl]++;
+	irq_taken_ns[ipl] = now;
+	irq_in_service |= 1 << ipl;
+	if (irq_latency_pending & (1 << ipl)) {
+		irq_latency_pending &= ~(1 << ipl);
+		latency = now - irq_asserted_ns[ipl];
+		histogram_record(&stats.irq_latency[ipl], latency);
+		irq_log(ipl, "taken after", latency);
+	} else
+		irq_log(ipl, "taken again", -1);
+	if (debug_armed)
+		debug_irq(ipl);
+}
+
+static void irq_returned(unsigned ipl)
+{
+	uint64_t service;
+
+	if (!(irq_in_service & (1 << ipl)))
+		return;
+	irq_in_service &= ~(1 << ipl);
+	service = get_current_time() - irq_taken_ns[ipl];
+	histogram_record(&stats.irq_service[ipl], service);
+	irq_log(ipl, "returned after", service);
+}
 
 #define BS1	0x01
 #define BS2	0x02
 #define BS3	0x04
 #define BS4	0x08
 
-static uint16_t dma_addr;
-static uint16_t dma_count;
-static uint8_t dma_mode;
-static uint8_t dma_enable;
-static uint8_t dma_mystery;	/* We don't know what this reg on the AM2901 is
-				   about */
-
 /* SRAM on the CPU card */
 static uint8_t cpu_sram[256];
 static uint8_t mmu[8][32];
@@ -59,61 +118,105 @@ static uint32_t mmu_map(uint16_t addr);
 static void logic_flags16(unsigned r);
 
 /*
- *	DMA engine guesswork
+ *	Lazy flags
+ *
+ *	Nearly every load, store, logic and arithmetic instruction sets M and
+ *	V (and F for add and subtract), yet little looks at them before the
+ *	next instruction replaces them. Rather than work them out each time
+ *	the last such operation is recorded, and alu_out is only brought up
+ *	to date by flags_sync() before anything else reads or changes F, M or
+ *	V. L is always kept current.
  */
+#define FLAGS_NONE	0	/* alu_out is up to date */
+#define FLAGS_MV8	1	/* M and V as ldflags(flag_r) */
+#define FLAGS_MV16	2
+#define FLAGS_ADD8	3	/* F, M and V as arith_flags(flag_r, flag_a, flag_b) */
+#define FLAGS_ADD16	4
+#define FLAGS_SUB8	5	/* F, M and V as sub_flags(flag_r, flag_a, flag_b) */
+#define FLAGS_SUB16	6
+
+static unsigned flag_op;
+static unsigned flag_r, flag_a, flag_b;
+
+static void ldflags_now(unsigned r);
+static void arith_flags_now(unsigned r, uint8_t a, uint8_t b);
+static void sub_flags_now(uint8_t r, uint8_t a, uint8_t b);
+static void ldflags16_now(unsigned r);
+static void arith_flags16_now(unsigned r, uint16_t a, uint16_t b);
+static void sub_flags16_now(uint16_t r, uint16_t a, uint16_t b);
 
-int dma_read_cycle(uint8_t byte)
+static void flags_sync(void)
 {
-	if (dma_enable == 0)
-		return 1;
-	/* DMA is done when it incs to 0 */
-	if (++dma_count == 0) {
-		dma_enable = 0;
-		return 1;
-	}
-	if (dma_enable) {
-/*		fprintf(stderr, "%04X: DMA %04X <- %02X\n", dma_count, dma_addr, byte); */
-		mem_write8(dma_addr++, byte);
+	switch (flag_op) {
+	case FLAGS_MV8:
+		ldflags_now(flag_r);
+		break;
+	case FLAGS_MV16:
+		ldflags16_now(flag_r);
+		break;
+	case FLAGS_ADD8:
+		arith_flags_now(flag_r, flag_a, flag_b);
+		break;
+	case FLAGS_ADD16:
+		arith_flags16_now(flag_r, flag_a, flag_b);
+		break;
+	case FLAGS_SUB8:
+		sub_flags_now(flag_r, flag_a, flag_b);
+		break;
+	case FLAGS_SUB16:
+		sub_flags16_now(flag_r, flag_a, flag_b);
+		break;
 	}
-	return 0;
+	flag_op = FLAGS_NONE;
 }
 
-int dma_write_active(void)
+/* Loads leave F alone, so F from a pending add or subtract is needed */
+static void ldflags(unsigned r)
 {
-	if (dma_enable == 1)
-		return 1;
-	return 0;
+	if (flag_op >= FLAGS_ADD8)
+		flags_sync();
+	flag_op = FLAGS_MV8;
+	flag_r = r;
 }
 
-uint8_t dma_write_cycle(void)
+static void ldflags16(unsigned r)
 {
-	uint8_t r;
-	if (dma_enable == 0) {
-		fprintf(stderr, "DMA write cycle with no DMA\n");
-		exit(1);
-	}
-	r = mmu_mem_read8(dma_addr++);
-	dma_count++;
-	if (dma_count == 0)
-		dma_enable = 0;
-	return r;
+	if (flag_op >= FLAGS_ADD8)
+		flags_sync();
+	flag_op = FLAGS_MV16;
+	flag_r = r;
 }
 
-uint16_t cpu6_dma_count(void) {
-	return ~dma_count;
+static void arith_flags(unsigned r, uint8_t a, uint8_t b)
+{
+	flag_op = FLAGS_ADD8;
+	flag_r = r;
+	flag_a = a;
+	flag_b = b;
 }
 
-void cpu6_dma_write(uint8_t byte) {
-	/* DMA is done when it incs to 0 */
-	if (dma_enable == 0) {
-		return;
-	}
-	if (dma_enable) {
-		mem_write8(dma_addr++, byte);
-	}
-	if (++dma_count == 0xffff) {
-		dma_enable = 0;
-	}
+static void arith_flags16(unsigned r, uint16_t a, uint16_t b)
+{
+	flag_op = FLAGS_ADD16;
+	flag_r = r;
+	flag_a = a;
+	flag_b = b;
+}
+
+static void sub_flags(uint8_t r, uint8_t a, uint8_t b)
+{
+	flag_op = FLAGS_SUB8;
+	flag_r = r;
+	flag_a = a;
+	flag_b = b;
+}
+
+static void sub_flags16(uint16_t r, uint16_t a, uint16_t b)
+{
+	flag_op = FLAGS_SUB16;
+	flag_r = r;
+	flag_a = a;
+	flag_b = b;
 }
 
 /*
@@ -126,6 +229,80 @@ void cpu6_dma_write(uint8_t byte) {
 #define ALU_V	0x80
 
 
+/*
+ *	Instruction timing
+ *
+ *	Every memory access, instruction or data, read or write, takes
+ *	MEM_CYCLES microcycles of CYCLE_NS. cycle_table[] holds the cost of
+ *	each opcode with its fixed operand bytes and data accesses, assuming
+ *	the cheapest addressing mode. The handlers add anything that depends
+ *	on the operands: address mode bytes and indirection, block and bignum
+ *	lengths, register counts, a taken branch and so on. The total goes on
+ *	the clock once when the instruction completes so memory accesses
+ *	themselves are free. Accesses to the register file below 0x100 that
+ *	do not come from an operand are internal and also free.
+ *
+ *	Beyond the memory cycles only a few internal costs are modelled. The
+ *	numbers are estimates, there is no cycle level documentation.
+ */
+#define BRANCH_TAKEN_CYCLES	3	/* Reload of the PC */
+#define PAGE_CROSS_CYCLES	1	/* 16bit access straddling a 2K page */
+#define MULDIV_CYCLES		32	/* Shift and add/subtract per bit */
+
+#define M(n)	((n) * MEM_CYCLES)
+
+static const uint8_t cycle_table[256] = {
+	/* 00-0F: 09 RSR pops X, 0F RSYS pops five bytes */
+	M(1), M(1), M(1), M(1), M(1), M(1), M(1), M(1),
+	M(1), M(3), M(1), M(1), M(1), M(1), M(1), M(6),
+	/* 10-1F: branches */
+	M(2), M(2), M(2), M(2), M(2), M(2), M(2), M(2),
+	M(2), M(2), M(2), M(2), M(2), M(2), M(2), M(2),
+	/* 20-2F: byte register ops, 2E reads its first operand */
+	M(2), M(2), M(2), M(2), M(2), M(2), M(2), M(2),
+	M(1), M(1), M(1), M(1), M(1), M(1), M(3), M(2),
+	/* 30-3F: word register ops */
+	M(2), M(2), M(2), M(2), M(2), M(2), M(2), M(2),
+	M(1), M(1), M(1), M(1), M(1), M(1), M(1), M(1),
+	/* 40-4F: byte ALU, 46 bignum, 47 block */
+	M(2), M(2), M(2), M(2), M(2), M(2), M(3), M(2),
+	M(1), M(1), M(1), M(1), M(1), M(1), M(1), M(1),
+	/* 50-5F: word ALU */
+	M(2), M(2), M(2), M(2), M(2), M(2), M(1), M(1),
+	M(1), M(1), M(1), M(1), M(1), M(1), M(1), M(1),
+	/* 60-6F: X load/store, 66 JSYS pushes five bytes, 6F STCC */
+	M(3), M(3), M(3), M(3), M(3), M(3), M(7), M(2),
+	M(3), M(3), M(3), M(3), M(3), M(3), M(3), M(4),
+	/* 70-7F: jumps, 77/78 mul/div, JSR pushes X, 7E/7F push/pop */
+	M(1), M(1), M(1), M(1), M(1), M(1), M(1), M(2),
+	M(2), M(3), M(3), M(3), M(3), M(3), M(2), M(2),
+	/* 80-BF: AL/A load/store, B6 semaphore */
+	M(2), M(2), M(2), M(2), M(2), M(2), M(2), M(2),
+	M(2), M(2), M(2), M(2), M(2), M(2), M(2), M(2),
+	M(3), M(3), M(3), M(3), M(3), M(3), M(3), M(3),
+	M(3), M(3), M(3), M(3), M(3), M(3), M(3), M(3),
+	M(2), M(2), M(2), M(2), M(2), M(2), M(2), M(2),
+	M(2), M(2), M(2), M(2), M(2), M(2), M(2), M(2),
+	M(3), M(3), M(3), M(3), M(3), M(3), M(1), M(3),
+	M(3), M(3), M(3), M(3), M(3), M(3), M(3), M(3),
+	/* C0-FF: BL/B load/store, C6 semaphore, D6 store16, D7/E6 level
+	   moves, F6 indexed load/store, F7 memcpy16 */
+	M(2), M(2), M(2), M(2), M(2), M(2), M(1), M(2),
+	M(2), M(2), M(2), M(2), M(2), M(2), M(2), M(2),
+	M(3), M(3), M(3), M(3), M(3), M(3), M(2), M(2),
+	M(3), M(3), M(3), M(3), M(3), M(3), M(3), M(3),
+	M(2), M(2), M(2), M(2), M(2), M(2), M(2), M(2),
+	M(2), M(2), M(2), M(2), M(2), M(2), M(2), M(2),
+	M(3), M(3), M(3), M(3), M(3), M(3), M(3), M(1),
+	M(3), M(3), M(3), M(3), M(3), M(3), M(3), M(3)
+};
+
+/* Operand cost of the decode_address modes, 5 adds more for its options */
+static const uint8_t mode_cycles[16] = {
+	0, M(2), M(4), M(1), M(3), M(1), 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0
+};
+
 /*
  *	System memory access
  *
@@ -151,6 +328,14 @@ uint8_t mmu_mem_read8_debug(uint16_t addr)
 	return mem_read8_debug(mmu_map(addr));
 }
 
+void mmu_mem_write8_debug(uint16_t addr, uint8_t val)
+{
+	if (addr < 0x0100)
+		cpu_sram[addr] = val;
+	else
+		mem_write8_debug(mmu_map(addr), val);
+}
+
 static void mmu_mem_write8(uint16_t addr, uint8_t val)
 {
 	if (addr < 0x0100)
@@ -161,13 +346,19 @@ static void mmu_mem_write8(uint16_t addr, uint8_t val)
 
 static uint16_t mmu_mem_read16(uint16_t addr)
 {
-	uint16_t r = mmu_mem_read8(addr) << 8;
+	uint16_t r;
+
+	if ((addr & 0x7FF) == 0x7FF)
+		cycles += PAGE_CROSS_CYCLES;
+	r = mmu_mem_read8(addr) << 8;
 	r |= mmu_mem_read8(addr + 1);
 	return r;
 }
 
 static void mmu_mem_write16(uint16_t addr, uint16_t val)
 {
+	if ((addr & 0x7FF) == 0x7FF)
+		cycles += PAGE_CROSS_CYCLES;
 	mmu_mem_write8(addr, val >> 8);
 	mmu_mem_write8(addr + 1, val);
 }
@@ -305,6 +496,7 @@ static uint16_t get_twobit(unsigned mode, unsigned idx, unsigned len) {
 	case 0:
 		// EA <- PC
 		addr = fetch16();
+		cycles += M(2);
 		//fprintf(stderr, "%x EA <- (PC) = %04x\n", idx, addr);
 		break;
 	case 1:
@@ -312,6 +504,7 @@ static uint16_t get_twobit(unsigned mode, unsigned idx, unsigned len) {
 		//fprintf(stderr, "%x EA <- ", idx);
 		regs = fetch();
 		addr =  (regs & 0x10) ? fetch16() : fetch(); // if r1 is odd, do imm16
+		cycles += (regs & 0x10) ? M(3) : M(2);
 		//fprintf(stderr, "%04x", addr);
 		addr += regpair_read((regs >> 4) & 0xe);
 		//fprintf(stderr, " + (%x) %04x", (regs >> 4) & 0xe, regpair_read((regs >> 4) & 0xe));
@@ -329,6 +522,7 @@ static uint16_t get_twobit(unsigned mode, unsigned idx, unsigned len) {
 			regs = twobit_cached_reg;
 		} else {
 			twobit_cached_reg = regs = fetch();
+			cycles += M(1);
 		}
 		if (idx == 0)
 			regs >>= 4;
@@ -411,6 +605,7 @@ static int mmu_transfer_op(void)
 	// The microcode might have a requirement for this to not be implicit
 	uint16_t addr = get_twobit(subop, 1, len);
 
+	cycles += M(len);
 	switch(subop & 0x10) {
 	case 0x00:
 		while(len--) {
@@ -439,6 +634,7 @@ static uint8_t block_op_getLen(int inst, int op) {
 
 	if (inst == 0x47) {
 		// 47 instructions take a literal
+		cycles += M(1);
 		return fetch();
 	} else {
 		// 67 instructions take the length in AL
@@ -448,6 +644,184 @@ static uint8_t block_op_getLen(int inst, int op) {
 	}
 }
 
+/*
+ *	Page at a time helpers for the block operations
+ *
+ *	Each run stops at the next 2K page boundary of either address so it
+ *	maps to one contiguous stretch of physical memory. Runs that are not
+ *	plain RAM go a byte at a time through the normal path. The callers
+ *	charge the time for the whole operation.
+ */
+static unsigned page_run(uint16_t sa, uint16_t da, unsigned len)
+{
+	unsigned n = 0x800 - (sa & 0x7FF);
+
+	if (n > 0x800 - (da & 0x7FF))
+		n = 0x800 - (da & 0x7FF);
+	if (n > len)
+		n = len;
+	return n;
+}
+
+uint8_t *mmu_map_ram(uint16_t addr, unsigned len, unsigned write)
+{
+	if (addr < 0x0100)
+		return NULL;
+	return mem_map_ram(mmu_map(addr), len, write);
+}
+
+/* Count parity for the bytes actually read from a mmu_map_ram run */
+void mmu_parity_read(uint16_t addr, unsigned len)
+{
+	if (len)
+		mem_parity_read(mmu_map(addr), len);
+}
+
+/* The copy is done in ascending byte order, so a destination just above
+   the source replicates the start of it as the microcode would */
+static void block_copy(uint16_t sa, uint16_t da, unsigned len)
+{
+	while (len) {
+		unsigned n = page_run(sa, da, len);
+		uint8_t *s = mmu_map_ram(sa, n, 0);
+		uint8_t *d = s ? mmu_map_ram(da, n, 1) : NULL;
+		unsigned i;
+
+		if (d == NULL) {
+			for (i = 0; i < n; i++)
+				mmu_mem_write8(da + i, mmu_mem_read8(sa + i));
+		} else {
+			if (d > s && d < s + n) {
+				/* Past d - s it reads back what it wrote */
+				mmu_parity_read(sa, d - s);
+				for (i = 0; i < n; i++)
+					d[i] = s[i];
+			} else {
+				mmu_parity_read(sa, n);
+				memmove(d, s, n);
+			}
+		}
+		sa += n;
+		da += n;
+		len -= n;
+	}
+}
+
+static void block_fill(uint16_t da, uint8_t chr, unsigned len)
+{
+	while (len) {
+		unsigned n = page_run(da, da, len);
+		uint8_t *d = mmu_map_ram(da, n, 1);
+		unsigned i;
+
+		if (d == NULL) {
+			for (i = 0; i < n; i++)
+				mmu_mem_write8(da + i, chr);
+		} else
+			memset(d, chr, n);
+		da += n;
+		len -= n;
+	}
+}
+
+/* Returns 1 if the ranges match. Like the byte loop it stops reading at
+   the first difference */
+static int block_compare(uint16_t sa, uint16_t da, unsigned len)
+{
+	cycles += M(2 * len);
+	while (len) {
+		unsigned n = page_run(sa, da, len);
+		uint8_t *s = mmu_map_ram(sa, n, 0);
+		uint8_t *d = s ? mmu_map_ram(da, n, 0) : NULL;
+		unsigned i;
+
+		if (d == NULL) {
+			for (i = 0; i < n; i++)
+				if (mmu_mem_read8(da + i) != mmu_mem_read8(sa + i))
+					break;
+		} else {
+			if (memcmp(d, s, n))
+				for (i = 0; d[i] == s[i]; i++);
+			else
+				i = n;
+			mmu_parity_read(da, i < n ? i + 1 : n);
+			mmu_parity_read(sa, i < n ? i + 1 : n);
+		}
+		if (i < n) {
+			/* The bytes after the difference were not read */
+			cycles -= M(2 * (len - i - 1));
+			return 0;
+		}
+		sa += n;
+		da += n;
+		len -= n;
+	}
+	return 1;
+}
+
+/*
+ *	The binary loader is a copy that sums what it reads, done a page run
+ *	at a time like block_copy. A run is summed before it is copied, which
+ *	only differs from the byte loop if it overlaps itself from above.
+ */
+static uint8_t cbin_copy(uint16_t sa, uint16_t da, unsigned len)
+{
+	uint8_t sum = 0;
+
+	while (len) {
+		unsigned n = page_run(sa, da, len);
+		uint8_t *s = mmu_map_ram(sa, n, 0);
+		uint8_t *d = s ? mmu_map_ram(da, n, 1) : NULL;
+		unsigned i;
+
+		if (d == NULL || (d > s && d < s + n)) {
+			for (i = 0; i < n; i++) {
+				uint8_t val = mmu_mem_read8(sa + i);
+
+				mmu_mem_write8(da + i, val);
+				sum += val;
+			}
+		} else {
+			mmu_parity_read(sa, n);
+			sum += cbin_sum(s, n);
+			memmove(d, s, n);
+		}
+		sa += n;
+		da += n;
+		len -= n;
+	}
+	return sum;
+}
+
+/* Apply the fixup at sa, returns the address it held for the checksum */
+static uint16_t cbin_fixup(uint16_t sa, uint16_t load_offset, uint16_t offset)
+{
+	uint8_t *s = NULL, *p = NULL;
+	uint16_t fixup_addr, fixup_val;
+
+	if ((sa & 0x7FF) != 0x7FF)
+		s = mmu_map_ram(sa, 2, 0);
+	if (s) {
+		mmu_parity_read(sa, 2);
+		fixup_addr = (s[0] << 8) | s[1];
+	} else
+		fixup_addr = mmu_mem_read16(sa);
+	sa = fixup_addr + load_offset;
+	if ((sa & 0x7FF) != 0x7FF)
+		p = mmu_map_ram(sa, 2, 0);
+	if (p == NULL) {
+		fixup_val = mmu_mem_read16(sa);
+		mmu_mem_write16(sa, fixup_val + offset);
+		return fixup_addr;
+	}
+	mmu_parity_read(sa, 2);
+	fixup_val = ((p[0] << 8) | p[1]) + offset;
+	p = mmu_map_ram(sa, 2, 1);
+	p[0] = fixup_val >> 8;
+	p[1] = fixup_val;
+	return fixup_addr;
+}
+
 static void cbin_load_segment(uint16_t sa, uint16_t load_offset, unsigned trace)
 {
 	uint8_t type = mmu_mem_read8(sa);
@@ -461,17 +835,16 @@ static void cbin_load_segment(uint16_t sa, uint16_t load_offset, unsigned trace)
 	        	cpu6_pc(), sa, type, len, addr, load_offset);
 
         sa += 4;
+	cycles += M(5);
+	flags_sync();
 	alu_out &= ~ALU_L;
 
         switch (type)
 	{
         case CBIN_DATA:
-	    for (int i = 0; i < len; i++) {
-		uint8_t val = mmu_mem_read8(sa++);
-
-	        mmu_mem_write8(load_offset + addr + i, val);
-		checksum += val;
-            }
+	    cycles += M(2 * len);
+	    checksum += cbin_copy(sa, load_offset + addr, len);
+	    sa += len;
             break;
         case CBIN_FIXUPS:
             // Apply fixups
@@ -481,11 +854,11 @@ static void cbin_load_segment(uint16_t sa, uint16_t load_offset, unsigned trace)
             } else {
                 uint16_t offset = load_offset + addr;
 
+                cycles += M(3 * len);
+
                 for (size_t i = 0; i < len; i += 2) {
-                    uint16_t fixup_addr = mmu_mem_read16(sa);
-                    uint16_t fixup_val = mmu_mem_read16(fixup_addr + load_offset);
+                    uint16_t fixup_addr = cbin_fixup(sa, load_offset, offset);
 
-                    mmu_mem_write16(fixup_addr + load_offset, fixup_val + offset);
 		    checksum += (fixup_addr >> 8) + (fixup_addr & 0xFF);
 		    sa += 2;
                 }
@@ -533,6 +906,7 @@ static int block_op(int inst, unsigned trace)
 	uint8_t chr;
 
 	// clear the fault flag
+	flags_sync();
 	alu_out &= ~ALU_F;
 
 	// memset only reads the source once
@@ -543,6 +917,7 @@ static int block_op(int inst, unsigned trace)
 	if ((op & 0xF0) == 0x20) {
 		if (inst == 0x47) {
 			chr = fetch();
+			cycles += M(1);
 		} else {
 			// This gets it's chr from somewhere else. Probally a register?
 			fprintf(stderr, "Unsupported 67 2x memchr at %x\n", exec_pc);
@@ -558,6 +933,7 @@ static int block_op(int inst, unsigned trace)
 		// Load a segment of a binary file
 		// [sa] = destination offset
 		// da = a pointer to a segment
+		cycles += M(2);
 		cbin_load_segment(da, mmu_mem_read16(sa), trace);
 		return 0;
 	case 0x20:
@@ -568,6 +944,7 @@ static int block_op(int inst, unsigned trace)
 		while(dst_len--) {
 			uint8_t val = mmu_mem_read8(sa);
 			mmu_mem_write8(da, val);
+			cycles += M(2);
 			if (val == chr) { // Match
 				regpair_write(Y, sa);
 				regpair_write(Z, da);
@@ -580,11 +957,11 @@ static int block_op(int inst, unsigned trace)
 		alu_out |= ALU_F;
 		return 0;
 	case 0x40:
-		while(dst_len--) {
-			mmu_mem_write8(da++, mmu_mem_read8(sa++));
-		};
+		cycles += M(2 * dst_len);
+		block_copy(sa, da, dst_len);
 		return 0;
 	case 0x60:
+		cycles += M(3 * dst_len);
 		// Complete Guess, but this might be OR
 		while(dst_len--) {
 			uint8_t val = mmu_mem_read8(da++) | mmu_mem_read8(sa++);
@@ -593,26 +970,22 @@ static int block_op(int inst, unsigned trace)
 		return 0;
 	case 0x70:
 		// Complete Guess, but this might be AND
+		cycles += M(3 * dst_len);
 		while(dst_len--) {
 			uint8_t val = mmu_mem_read8(da++) & mmu_mem_read8(sa++);
 			mmu_mem_write8(da, val);
 		};
 		return 0;
 	case 0x80:
-		alu_out |= ALU_V;
-		while (dst_len--) {
-			if(mmu_mem_read8(da++) !=
-				mmu_mem_read8(sa++)) {
-				alu_out &= ~ALU_V;
-				break;
-			}
-		}
+		if (block_compare(sa, da, dst_len))
+			alu_out |= ALU_V;
+		else
+			alu_out &= ~ALU_V;
 		return 0;
 	case 0x90: /* memset */
+		cycles += M(1 + dst_len);
 		chr = mmu_mem_read8(sa);
-		while (dst_len--) {
-			mmu_mem_write8(da++, chr);
-		}
+		block_fill(da, chr, dst_len);
 		return 0;
 	default:
 		fprintf(stderr, "%04X: Unknown block xfer %02X\n", cpu6_pc(), op);
@@ -634,66 +1007,236 @@ static int memcpy16(void) {
 	uint16_t sa  = regpair_read(B);
 	uint16_t da  = regpair_read(Y);
 
-	do {
-		mmu_mem_write8(da++, mmu_mem_read8(sa++));
-	} while(len--);
+	cycles += M(2 * (len + 1));
+	block_copy(sa, da, len + 1);
 	return 0;
 }
 
-static void sub_flags(uint8_t r, uint8_t a, uint8_t b);
+static void bignum_fetch(uint64_t *r, uint16_t addr, unsigned len)
+{
+	uint8_t buf[BIGNUM_MAX_BYTES];
+	unsigned i;
 
-static int bignum_sub(int a_len, int b_len, uint64_t a_addr, uint16_t b_addr, int write_back) {
-	// b = a - b
-	if (a_len > b_len) {
-		// No idea what it should do here. Trap? overflow and set the FAULT flag?
-		fprintf(stderr, "unsupported SUBBIG at %04X\n", exec_pc);
-		exit(-1);
-	}
+	cycles += M(len);
+	for (i = 0; i < len; i++)
+		buf[i] = mmu_mem_read8(addr + i);
+	bignum_load(r, buf, len);
+}
 
-	// For debugging
-	uint64_t result_big = 0;
-	int shift = 0;
-	uint64_t a_big = 0;
-	uint64_t b_big = 0;
+static void bignum_put(const uint64_t *r, uint16_t addr, unsigned len)
+{
+	uint8_t buf[BIGNUM_MAX_BYTES];
+	unsigned i;
 
-	// Roughly the microcode state
-	uint32_t borrow = 0; // Probally just the link flag on real hardware
-	uint8_t zero_acc = 0; // will collect any one bits
-	uint8_t a_val = 0;
-	uint8_t b_val = 0;
-	uint8_t result = 0;
+	bignum_store(r, buf, len);
+	cycles += M(len);
+	for (i = 0; i < len; i++)
+		mmu_mem_write8(addr + i, buf[i]);
+}
 
-	for (a_len--, b_len--; b_len >= 0; b_len--, a_len--) {
-		if (a_len >= 0) {
-			a_val = mmu_mem_read8(a_addr + a_len);
-		} else {
-			a_val = ((int8_t)a_val) >> 8; // sign extend previous byte
+/* Most significant byte of the low len bytes */
+static uint8_t bignum_msb(const uint64_t *r, unsigned len)
+{
+	uint8_t buf[BIGNUM_MAX_BYTES];
+
+	bignum_store(r, buf, len);
+	return buf[0];
+}
+
+/*
+ *	ADD, SUB and CMP work at the width of b, with a sign extended (or
+ *	cut down) to match, and set the flags as the 8bit ops would for the
+ *	top byte. V is only set if the whole result is zero.
+ *
+ *	b = b + a, b = b - a, b - a
+ */
+static int bignum_addsub(unsigned subop, unsigned a_size, unsigned b_size,
+	uint16_t a_addr, uint16_t b_addr)
+{
+	uint64_t a[BIGNUM_LIMBS], b[BIGNUM_LIMBS], r[BIGNUM_LIMBS];
+	unsigned carry;
+	uint8_t a_ms, b_ms, r_ms;
+
+	bignum_fetch(a, a_addr, a_size);
+	bignum_fetch(b, b_addr, b_size);
+	bignum_sign_extend(a, a_size);
+	bignum_truncate(a, b_size);
+
+	if (subop == 0)
+		bignum_add(r, b, a);
+	else
+		bignum_sub(r, b, a);
+	/* Operands are zero extended so the carry/borrow lands just above */
+	carry = bignum_bit(r, b_size * 8);
+	bignum_truncate(r, b_size);
+
+	a_ms = bignum_msb(a, b_size);
+	b_ms = bignum_msb(b, b_size);
+	r_ms = bignum_msb(r, b_size);
+	if (!bignum_is_zero(r))
+		r_ms |= 1;
+
+	if (subop == 0)
+		arith_flags(r_ms, a_ms, b_ms);
+	else
+		sub_flags(r_ms, a_ms, b_ms);
+	alu_out &= ~ALU_L;
+	/* L is carry for add but no borrow for subtract */
+	if (carry == (subop == 0))
+		alu_out |= ALU_L;
+
+	if (subop != 2)
+		bignum_put(r, b_addr, b_size);
+	return 0;
+}
+
+/*
+ *	Signed MUL and DIV, b = b * a and b = b / a. The flags follow the
+ *	16bit memory forms: M and V from the result, F if it does not fit
+ *	in b or on a divide by zero, which leaves b alone.
+ */
+static int bignum_muldiv(unsigned subop, unsigned a_size, unsigned b_size,
+	uint16_t a_addr, uint16_t b_addr)
+{
+	uint64_t a[BIGNUM_LIMBS], b[BIGNUM_LIMBS], r[BIGNUM_LIMBS];
+	uint64_t rem[BIGNUM_LIMBS];
+	unsigned fault = 0;
+
+	bignum_fetch(a, a_addr, a_size);
+	bignum_fetch(b, b_addr, b_size);
+	bignum_sign_extend(a, a_size);
+	bignum_sign_extend(b, b_size);
+
+	flags_sync();
+	alu_out &= ~(ALU_F | ALU_M | ALU_V);
+
+	if (subop == 3) {
+		/* Modulo 2^256 the two's complement product is exact */
+		bignum_mul(r, b, a);
+	} else {
+		unsigned a_neg = bignum_bit(a, BIGNUM_LIMBS * 64 - 1);
+		unsigned b_neg = bignum_bit(b, BIGNUM_LIMBS * 64 - 1);
+
+		if (bignum_is_zero(a)) {
+			alu_out |= ALU_F;
+			return 0;
 		}
-		b_val = mmu_mem_read8(b_addr + b_len);
-		a_big |= a_val << shift;
-		b_big |= b_val << shift;
+		if (a_neg)
+			bignum_neg(a);
+		if (b_neg)
+			bignum_neg(b);
+		bignum_div(r, rem, b, a);
+		if (a_neg != b_neg)
+			bignum_neg(r);
+	}
+	if (!bignum_fits(r, b_size))
+		fault = 1;
+	bignum_truncate(r, b_size);
+
+	if (bignum_bit(r, b_size * 8 - 1))
+		alu_out |= ALU_M;
+	if (bignum_is_zero(r))
+		alu_out |= ALU_V;
+	if (fault)
+		alu_out |= ALU_F;
 
-		result = b_val - a_val - borrow;
-		result_big |= result << shift;
-		shift += 8;
+	bignum_put(r, b_addr, b_size);
+	return 0;
+}
 
-		//fprintf(stderr, "%i %i | %02x - %02x - %02x = %04x;", b_len, a_len, b_val, a_val, borrow, result & 0xff);
+/*
+ *	Convert the b_size byte unsigned number at src to ASCII digits in
+ *	the given base, most significant first with the top bit set. F if
+ *	it will not fit in the AL characters allowed, else A is left
+ *	pointing after the digits.
+ */
+static int bignum_to_ascii(unsigned mode, unsigned base, unsigned b_size)
+{
+	static const char digits[] = "0123456789ABCDEFG";
+	unsigned dest_width = reg_read(AL);
+	uint16_t dst_addr = get_twobit(mode, 0, dest_width);
+	uint16_t src_addr = get_twobit(mode, 1, b_size);
+	uint64_t num[BIGNUM_LIMBS];
+	char buffer[BIGNUM_MAX_BYTES * 8];
+	unsigned len = 0;
+	unsigned i;
+
+	bignum_fetch(num, src_addr, b_size);
+	do
+		buffer[len++] = digits[bignum_div_small(num, base)];
+	while (!bignum_is_zero(num));
+
+	// I'm kind of guessing here, but it seems to do this?
+	flags_sync();
+	if (len > dest_width) {
+		alu_out = ALU_F;
+		return 0;
+	}
+
+	alu_out = 0;
+
+	cycles += M(len);
+	for (i = 0; i < len; i++)
+		mmu_mem_write8(dst_addr + i, buffer[len - 1 - i] | 0x80);
+
+	// apparently A needs to be updated to point after string
+	regpair_write(A, dst_addr + len);
+	return 0;
+}
 
-		zero_acc |= (result != 0);
-		borrow = (a_val > b_val);
-		//fprintf(stderr, " borrow = %x;\n", borrow);
+/*
+ *	Parse AL characters at src as a number in the given base and store
+ *	it as b_size bytes. Like strtol leading spaces and a sign are allowed
+ *	and parsing stops at the first character that is not a digit.
+ */
+static int ascii_to_bignum(unsigned mode, unsigned base, unsigned b_size)
+{
+	unsigned src_width = reg_read(AL);
+	uint16_t src_addr = get_twobit(mode, 0, src_width);
+	uint16_t dst_addr = get_twobit(mode, 1, b_size);
+	uint64_t num[BIGNUM_LIMBS] = { 0 };
+	uint8_t buffer[256];
+	unsigned neg = 0;
+	unsigned i = 0;
 
-		if (write_back)
-			mmu_mem_write8(b_addr + b_len, result);
+	cycles += M(src_width);
+	for (i = 0; i < src_width; i++)
+		buffer[i] = mmu_mem_read8(src_addr + i) & 0x7F;
+
+	i = 0;
+	while (i < src_width && buffer[i] == ' ')
+		i++;
+	if (i < src_width && (buffer[i] == '-' || buffer[i] == '+'))
+		neg = buffer[i++] == '-';
+	for (; i < src_width; i++) {
+		uint8_t c = buffer[i];
+		unsigned d;
+
+		if (c >= '0' && c <= '9')
+			d = c - '0';
+		else if (c >= 'A' && c <= 'Z')
+			d = c - 'A' + 10;
+		else if (c >= 'a' && c <= 'z')
+			d = c - 'a' + 10;
+		else
+			break;
+		if (d >= base)
+			break;
+		bignum_mul_small(num, base, d);
 	}
+	if (neg)
+		bignum_neg(num);
 
-	//fprintf(stderr, "%s %lx - %lx == %lx\n", write_back ? "SUBBIG" : "CMPBIG", b_big, a_big, result_big);
+	flags_sync();
+	alu_out = 0;
 
-	sub_flags(result | zero_acc, a_val, b_val);
-	alu_out &= ~ALU_L;
-	if (borrow == 0)
-		alu_out |= ALU_L;
+	// Guessing that this might set some flags?
+	if (bignum_is_zero(num))
+		alu_out |= ALU_V;
+	if (neg && !bignum_is_zero(num))
+		alu_out |= ALU_M;
 
+	bignum_put(num, dst_addr, b_size);
 	return 0;
 }
 
@@ -709,116 +1252,42 @@ static int bignum_sub(int a_len, int b_len, uint64_t a_addr, uint16_t b_addr, in
  *
  * Valid sizes are 1 to 16 bytes
  * Some subops may take extra arguments via implicit registers
+ *
+ *	0 ADD	b = b + a
+ *	1 SUB	b = b - a
+ *	2 CMP	flags for b - a
+ *	3 MUL	b = b * a
+ *	4 DIV	b = b / a
+ *	8	ASCII at a (AL characters) to b, base l + 2
+ *	9	b to ASCII at a (up to AL characters), base l + 2
+ *
+ * Only SUB, CMP and the conversions have been seen in use. The others
+ * follow the same pattern but their flags are guesses.
  */
 static int bignum_op(void) {
 	unsigned sizes = fetch();
 	unsigned a_size = (sizes >> 4) + 1;
 	unsigned b_size = (sizes & 0xf) + 1;
+	uint16_t a_addr, b_addr;
 
 	unsigned mode = fetch();
 
-	if ((mode >> 4) == 9) {
-		// bignum to Ascii
-		// I have no idea how the actual microcode routine works, so here is an approximation
-		// that works upto 64bits
-		// Doesn't handle cases where buffer hasn't been memset to 0xc0
-		unsigned dest_width = reg_read(AL);
-		unsigned base = a_size + 1;
-
-		if (b_size > 8) {
-			fprintf(stderr, "%i byte baseconv too big for our modern 64bit machines\n", b_size);
-			exit(1);
-		}
-		uint16_t dst_addr = get_twobit(mode, 0, dest_width);
-		uint16_t src_addr = get_twobit(mode, 1, b_size);
-
-
-		// Convert to little endian
-		unsigned long long num = 0;
-		for (int i=0; i < b_size; i++) {
-			num = num << 8 | mmu_mem_read8(src_addr+i);
-		}
-
-		char buffer[32];
-
-		if (base == 10) {
-			snprintf(buffer, sizeof(buffer), "%llu", num);
-		} else if (base == 16) {
-			snprintf(buffer, sizeof(buffer), "%llX", num);
-		} else {
-			fprintf(stderr, "baseconv, unsupported base %i\n", base);
-			exit(1);
-		}
-
-		// I'm kind of guessing here, but it seems to do this?
-		unsigned actual_width = strlen(buffer);
-		if (actual_width > dest_width) {
-			alu_out = ALU_F;
-			return 0;
-		}
-
-		alu_out = 0;
-
-		for (int i=0; i<actual_width; i++) {
-			mmu_mem_write8(dst_addr+i, buffer[i] | 0x80);
-		}
-
-		// apparently A needs to be updated to point after string
-		regpair_write(A, dst_addr + actual_width);
-		return 0;
-	}
-	if ((mode >> 4) == 8) {
-		// ASCII to bignum
-		// I'm not sure how the actual microcode routine works, so here is an approximation
-		// that works upto 64 bits.
-		unsigned src_width = reg_read(AL);
-
-		if (b_size > 8 || src_width > 31) {
-			fprintf(stderr, "%i byte ascii-to-bignum is too big for our modern 64bit machines\n", b_size);
-			exit(1);
-		}
-
-		uint16_t src_addr = get_twobit(mode, 0, src_width);
-		uint16_t dst_addr = get_twobit(mode, 1, b_size);
-
-		// Copy string out
-		char buffer[32];
-		for (int i=0; i < src_width; i++) {
-			buffer[i] = mmu_mem_read8(src_addr+i) & 0x7f;
-		}
-		buffer[src_width] = '\0';
-
-		char* end_ptr = &buffer[src_width];
-		uint64_t result = strtol(buffer, &end_ptr, a_size + 1);
-
-		if (end_ptr == NULL) {
-			alu_out = ALU_F;
-			return 0;
-		}
-		alu_out = 0;
-
-		// Guessing that this might set some flags?
-		if (result == 0)
-			alu_out |= ALU_V;
-		if (((int64_t)result) < 0)
-			alu_out |= ALU_M;
-
-		for (int i = b_size-1; i >= 0; i--) {
-			mmu_mem_write8(dst_addr + i, result & 0xff);
-			result >>= 8;
-		}
-		return 0;
-	}
-
-	uint16_t a_addr = get_twobit(mode, 0, a_size);
-	uint16_t b_addr = get_twobit(mode, 1, b_size);
+	if ((mode >> 4) == 9)
+		return bignum_to_ascii(mode, a_size + 1, b_size);
+	if ((mode >> 4) == 8)
+		return ascii_to_bignum(mode, a_size + 1, b_size);
 
+	a_addr = get_twobit(mode, 0, a_size);
+	b_addr = get_twobit(mode, 1, b_size);
 
 	switch (mode >> 4) {
+	case 0: // ADDBIG
 	case 1: // SUBBIG
-		return bignum_sub(a_size, b_size, a_addr, b_addr, 1);
 	case 2: // CMPBIG
-		return bignum_sub(a_size, b_size, a_addr, b_addr, 0);
+		return bignum_addsub(mode >> 4, a_size, b_size, a_addr, b_addr);
+	case 3: // MULBIG
+	case 4: // DIVBIG
+		return bignum_muldiv(mode >> 4, a_size, b_size, a_addr, b_addr);
 	default:
 		fprintf(stderr, "Unsupported 46 Bignum op %i\n", mode >> 4);
 		exit(1);
@@ -831,7 +1300,7 @@ static int bignum_op(void) {
  *	L not touched
  *	M cleared then set if MSB of operand
  */
-static void ldflags(unsigned r)
+static void ldflags_now(unsigned r)
 {
 	alu_out &= ~(ALU_M | ALU_V);
 	if (r & 0x80)
@@ -850,7 +1319,7 @@ static void ldflags(unsigned r)
  *
  *	L is set only by add so done in add
  */
-static void arith_flags(unsigned r, uint8_t a, uint8_t b)
+static void arith_flags_now(unsigned r, uint8_t a, uint8_t b)
 {
 	alu_out &= ~(ALU_F | ALU_M | ALU_V);
 	if ((r & 0xFF) == 0)
@@ -874,7 +1343,7 @@ static void arith_flags(unsigned r, uint8_t a, uint8_t b)
  *	Subtract is similar but the overflow rule probably differs and
  *	L is a borrow not a carry
  */
-static void sub_flags(uint8_t r, uint8_t a, uint8_t b)
+static void sub_flags_now(uint8_t r, uint8_t a, uint8_t b)
 {
 	alu_out &= ~(ALU_F | ALU_M | ALU_V);
 	if ((r & 0xFF) == 0)
@@ -898,11 +1367,7 @@ static void sub_flags(uint8_t r, uint8_t a, uint8_t b)
  */
 static void logic_flags(unsigned r)
 {
-	alu_out &= ~(ALU_M | ALU_V);
-	if (r & 0x80)
-		alu_out |= ALU_M;
-	if (!(r & 0xFF))
-		alu_out |= ALU_V;
+	ldflags(r);
 }
 
 /*
@@ -915,6 +1380,7 @@ static void logic_flags(unsigned r)
  */
 static void shift_flags(unsigned c, unsigned r)
 {
+	flags_sync();
 	alu_out &= ~(ALU_L | ALU_M | ALU_V);
 	if ((r & 0xFF) == 0)
 		alu_out |= ALU_V;
@@ -930,7 +1396,7 @@ static void shift_flags(unsigned c, unsigned r)
  *	L not touched
  *	M cleared then set if MSB of operand
  */
-static void ldflags16(unsigned r)
+static void ldflags16_now(unsigned r)
 {
 	alu_out &= ~(ALU_M | ALU_V);
 	if (r & 0x8000)
@@ -949,7 +1415,7 @@ static void ldflags16(unsigned r)
  *
  *	L is set only by add so done in add
  */
-static void arith_flags16(unsigned r, uint16_t a, uint16_t b)
+static void arith_flags16_now(unsigned r, uint16_t a, uint16_t b)
 {
 	alu_out &= ~(ALU_F | ALU_M | ALU_V);
 	if ((r & 0xFFFF) == 0)
@@ -974,7 +1440,7 @@ static void arith_flags16(unsigned r, uint16_t a, uint16_t b)
  *	Subtract is similar but the overflow rule probably differs and
  *	L is a borrow not a carry
  */
-static void sub_flags16(uint16_t r, uint16_t a, uint16_t b)
+static void sub_flags16_now(uint16_t r, uint16_t a, uint16_t b)
 {
 	alu_out &= ~(ALU_F | ALU_M | ALU_V);
 	if ((r & 0xFFFF) == 0)
@@ -998,11 +1464,7 @@ static void sub_flags16(uint16_t r, uint16_t a, uint16_t b)
  */
 static void logic_flags16(unsigned r)
 {
-	alu_out &= ~(ALU_M | ALU_V);
-	if (r & 0x8000)
-		alu_out |= ALU_M;
-	if (!(r & 0xFFFF))
-		alu_out |= ALU_V;
+	ldflags16(r);
 }
 
 /*
@@ -1015,6 +1477,7 @@ static void logic_flags16(unsigned r)
  */
 static void shift_flags16(unsigned c, unsigned r)
 {
+	flags_sync();
 	alu_out &= ~(ALU_L | ALU_M | ALU_V);
 	if ((r & 0xFFFF) == 0)
 		alu_out |= ALU_V;
@@ -1046,6 +1509,7 @@ static int dec(unsigned reg, unsigned val)
 {
 	uint8_t r = reg_read(reg) - val;
 	reg_write(reg, r);
+	flags_sync();
 	alu_out &= ~(ALU_L | ALU_V | ALU_M | ALU_F);
 	if (r == 0)
 		alu_out |= ALU_V;
@@ -1057,6 +1521,7 @@ static int dec(unsigned reg, unsigned val)
 static int clr(unsigned reg, unsigned v)
 {
 	reg_write(reg, v);
+	flags_sync();
 	alu_out &= ~(ALU_F | ALU_L | ALU_M);
 	if (v == 0)
 		alu_out |= ALU_V;
@@ -1244,6 +1709,7 @@ static uint16_t inc16(uint16_t a, uint16_t imm)
 static uint16_t dec16(uint16_t a, uint16_t imm)
 {
 	uint16_t r = a - imm;
+	flags_sync();
 	alu_out &= ~(ALU_L | ALU_V | ALU_M | ALU_F);
 	if ((r & 0xFFFF) == 0)
 		alu_out |= ALU_V;
@@ -1255,6 +1721,7 @@ static uint16_t dec16(uint16_t a, uint16_t imm)
 /* Assume behaviour matches CLR */
 static uint16_t clr16(uint16_t a, uint16_t imm)
 {
+	flags_sync();
 	alu_out &= ~(ALU_F | ALU_L | ALU_M);
 /*	if (imm == 0) */
 		alu_out |= ALU_V;
@@ -1350,9 +1817,11 @@ static int mul16(unsigned dsta, unsigned a, unsigned b)
 	unsigned expected_sign = (a ^ b) & 0x8000;
 	unsigned sign = r & 0x8000;
 
+	cycles += MULDIV_CYCLES;
 	mmu_mem_write16(dsta, r & 0xffff);
 
 	// These flags are a total guess
+	flags_sync();
 	alu_out &= ~(ALU_F | ALU_M | ALU_V);
 	if (sign)
 		alu_out |= ALU_M;
@@ -1370,9 +1839,11 @@ static int div16(unsigned dsta, unsigned a, unsigned b)
 	unsigned expected_sign = (a ^ b) & 0x8000;
 	unsigned sign = r & 0x8000;
 
+	cycles += MULDIV_CYCLES;
 	mmu_mem_write16(dsta, r & 0xffff);
 
 	// These flags are a total guess
+	flags_sync();
 	alu_out &= ~(ALU_F | ALU_M | ALU_V);
 	if (sign)
 		alu_out |= ALU_M;
@@ -1448,8 +1919,10 @@ static uint16_t indexed_address(unsigned size)
 	unsigned addr;
 	int8_t offset = 0;	/* Signed or not ? */
 
-	if (idx & 0x08)
+	if (idx & 0x08) {
 		offset = fetch();
+		cycles += M(1);
+	}
 	switch (idx & 0x03) {
 	case 0:
 		addr = regpair_read(r) + offset;
@@ -1470,8 +1943,10 @@ static uint16_t indexed_address(unsigned size)
 			idx, exec_pc);
 		exit(1);
 	}
-	if (idx & 0x04)
+	if (idx & 0x04) {
 		addr = mmu_mem_read16(addr);
+		cycles += M(2);
+	}
 	return addr;
 }
 
@@ -1480,6 +1955,7 @@ static uint16_t decode_address(unsigned size, unsigned mode)
 	uint16_t addr;
 	uint16_t indir = 0;
 
+	cycles += mode_cycles[mode];
 	switch (mode) {
 	case 0:
 		addr = pc;
@@ -1532,12 +2008,12 @@ static uint16_t decode_address(unsigned size, unsigned mode)
  *	Branch instructions
  */
 
-static int branch_op(void)
+/* Whether the condition of a 10-1F branch holds, flags synced */
+static unsigned branch_test(unsigned cond)
 {
 	unsigned t;
-	int8_t off;
 
-	switch (op & 0x0F) {
+	switch (cond) {
 	case 0:		/* BL   Branch if link is set */
 		t = (alu_out & ALU_L);
 		break;
@@ -1590,11 +2066,22 @@ static int branch_op(void)
 		t = cpu_sram[0x10] & 0x01;
 		break;
 	}
+	return t;
+}
+
+static int branch_op(void)
+{
+	unsigned t;
+	int8_t off;
+
+	flags_sync();
+	t = branch_test(op & 0x0F);
 	/* We'll keep pc and reg separate until we know if/how it fits memory */
 	off = fetch();
 	/* Offset is applied after fetch leaves PC at next instruction */
 	if (t) {
 		pc += off;
+		cycles += BRANCH_TAKEN_CYCLES;
 		return 18;
 	}
 	return 9;
@@ -1618,6 +2105,8 @@ static void switch_ipl(unsigned new_ipl, unsigned mode)
 	 */
 
 	unsigned old_ipl = cpu_ipl;
+
+	flags_sync();
 	if (mode != SWITCH_IPL_RETURN_MODIFIED) {
 		// Save pc
 		regpair_write(P, pc);
@@ -1655,9 +2144,11 @@ static int low_op(void)
 	case 0x01:		/* NOP */
 		return 4;
 	case 0x02:		/* SF   Set Fault */
+		flags_sync();
 		alu_out |= ALU_F;
 		break;
 	case 0x03:		/* RF   Reset Fault */
+		flags_sync();
 		alu_out &= ~ALU_F;
 		break;
 	case 0x04:		/* EI   Enable Interrupts */
@@ -1682,9 +2173,11 @@ static int low_op(void)
 	case 0x0A:		/* RI   Return from interrupt */
 		/* This may differ a bit on the CPU6 seems to have a carry
 		   involvement */
+		irq_returned(cpu_ipl);
 		switch_ipl(reg_read(CH) >> 4, SWITCH_IPL_RETURN);
 		break;
 	case 0x0B:		/* RIM  Return from interrupt modified */
+		irq_returned(cpu_ipl);
 		switch_ipl(reg_read(CH) >> 4, SWITCH_IPL_RETURN_MODIFIED);
 		break;
 	case 0x0C:
@@ -1745,6 +2238,7 @@ static int low_op(void)
 static int jsys_op(void)
 {
 	uint8_t arg = fetch();
+	flags_sync();
 	pushbyte(alu_out | cpu_mmu);  // Push CCR and Page Table Base
 	pushbyte(cpu_ipl & 0xf);      // Push current level
 	push(regpair_read(X));        // Push X
@@ -1766,35 +2260,35 @@ static int dma_op(void)
 
 	switch (op & 0x0F) {
 	case 0:
-		dma_addr = regpair_read(rp);
+		dma_set_address(regpair_read(rp));
 		break;
 	case 1:
-		regpair_write(rp, dma_addr);
+		regpair_write(rp, dma_address());
 		break;
 	case 2:
-		dma_count = regpair_read(rp);
+		dma_set_count(regpair_read(rp));
 		break;
 	case 3:
-		regpair_write(rp, dma_count);
+		regpair_write(rp, dma_count());
 		break;
 	case 4:
-		dma_mode = rp;
+		dma_set_mode(rp);
 		break;
 	case 5:	/* From the microcode analysis */
-		dma_mode = regpair_read(rp);
+		dma_set_mode(regpair_read(rp));
 		break;
 	case 6:
-		dma_enable = 1;
+		dma_set_enable(1);
 		break;
 	case 7:	/* From microcode */
-		dma_enable = 0;
+		dma_set_enable(0);
 		break;
 	/* 8-9 read/write some kind of unknown byte status register */
 	case 8:
-		dma_mystery = reg_read(rp);
+		dma_set_mystery(reg_read(rp));
 		break;
 	case 9:
-		reg_write(rp, dma_mystery);
+		reg_write(rp, dma_mystery());
 		break;
 	/* A-F are not used */
 	default:
@@ -1843,6 +2337,7 @@ static int jump_op(void)
 		r += c;
 		r &= 0x0F;
 		c++;
+		cycles += M(c);
 		/* A push of S will use the original S before the push insn. */
 		while(c--) {
 			mmu_mem_write8(--addr, reg_read(r));
@@ -1858,6 +2353,7 @@ static int jump_op(void)
 		uint8_t c = (r & 0x0F) + 1;
 		unsigned addr = regpair_read(S);
 		r >>= 4;
+		cycles += M(c);
 		/* A pop of S will always update S at the end */
 		while(c--) {
 			reg_write(r, mmu_mem_read8(addr++));
@@ -1886,6 +2382,7 @@ static int jump_op(void)
 static int stcc(void)
 {
 	uint16_t addr = fetch16();
+	flags_sync();
 	mmu_mem_write8(addr, alu_out);
 	return 0;
 }
@@ -1979,6 +2476,7 @@ static int cpu6_indexed_loadstore(void)
 	uint8_t reg = regs >> 4;
 	uint16_t addr = regpair_read(regs & 0x0e) + offset;
 
+	cycles += (regs & 0x10) ? M(1) : M(2);
 	switch (regs & 0x11) {
 	case 0x00: // 16 bit load
 		regpair_write(reg, mmu_mem_read16(addr));
@@ -2046,15 +2544,18 @@ static int store16() {
 	case 0x01: // (direct) <- src_reg
 		addr = fetch16();
 		mmu_mem_write16(addr, value);
+		cycles += M(4);
 		break;
 	case 0x10: // literal <- src_reg
 	    // Writes src to next two bytes after instruction.
 		addr = fetch_literal(2);
 		mmu_mem_write16(addr, value);
+		cycles += M(2);
 		break;
 	case 0x11: // (src_reg + disp16) <- src_reg
 		addr = fetch16() + regpair_read(dst_reg);
 		mmu_mem_write16(addr, value);
+		cycles += M(4);
 		break;
 	}
 	return 0;
@@ -2196,6 +2697,7 @@ static int misc3x_op(void)
 	}
 
 	// Otherwise, we do a memory read-modify-write operation
+	cycles += M(6);
 	uint16_t addr = fetch16();
 	if (reg != A) {	// indexed
 		addr += regpair_read(reg);
@@ -2286,13 +2788,16 @@ static int alu5x_op(void)
 				       // mov takes (direct)
 				addr = fetch16();
 				movv = b = mmu_mem_read16(addr);
+				cycles += M(4);
 				break;
 			case 0x10: // dst_reg <- src_reg OP literal
 				       // mov takes literal
 				movv = b = fetch16();
+				cycles += M(2);
 				break;
 			case 0x11: // dst_reg <- (src_reg + disp16) OP dst_reg
 				       // mov takes (src_reg + disp16)
+				cycles += M(4);
 				addr = fetch16() + b;
 				b = a;
 				movv = a = mmu_mem_read16(addr);
@@ -2368,13 +2873,16 @@ static int muldiv_op() {
 				// mov takes (direct)
 		addr = fetch16();
 		b = mmu_mem_read16(addr);
+		cycles += M(4);
 		break;
 	case 0x10: // dst_reg <- src_reg OP literal
 				// mov takes literal
 		b = fetch16();
+		cycles += M(2);
 		break;
 	case 0x11: // dst_reg <- (src_reg + disp16) OP dst_reg
 				// mov takes (src_reg + disp16)
+		cycles += M(4);
 		addr = fetch16() + b;
 		b = a;
 		a = mmu_mem_read16(addr);
@@ -2419,6 +2927,7 @@ static int semaphore_op(void) {
 static char *flagcode(void)
 {
 	static char buf[6];
+	flags_sync();
 	strcpy(buf, "-----");
 	if (alu_out & ALU_F)
 		*buf = 'F';
@@ -2444,6 +2953,7 @@ void cpu6_interrupt(unsigned trace)
 	if (pending_ipl > cpu_ipl) {
 		halted = 0;
 		switch_ipl(pending_ipl, SWITCH_IPL_RETURN);
+		irq_taken(pending_ipl);
 
 		if (trace)
 			fprintf(stderr,
@@ -2454,29 +2964,165 @@ void cpu6_interrupt(unsigned trace)
 
 // Not quite accurate to real hardware, but hopefully close enough
 void cpu_assert_irq(unsigned ipl) {
+	if (pending_ipl_mask & (1 << ipl))
+		return;
 	pending_ipl_mask |= 1 << ipl;
+	irq_asserted_ns[ipl] = get_current_time();
+	irq_latency_pending |= 1 << ipl;
+	irq_log(ipl, "asserted", -1);
 }
 
 void cpu_deassert_irq(unsigned ipl) {
+	uint64_t active;
+
+	if (!(pending_ipl_mask & (1 << ipl)))
+		return;
 	pending_ipl_mask &= ~(1 << ipl);
+	active = get_current_time() - irq_asserted_ns[ipl];
+	histogram_record(&stats.irq_active[ipl], active);
+	irq_log(ipl, "deasserted after", active);
 }
 
-unsigned cpu6_execute_one(unsigned trace)
+void cpu6_trace_irq(unsigned on)
 {
-	cpu6_interrupt(trace);
-	exec_pc = pc;
+	irq_trace = on;
+}
 
-	if (trace)
-		fprintf(stderr, "CPU %04X: ", pc);
-	op = fetch();
-	if (trace) {
-		fprintf(stderr,
-			"%02X %s A:%04X  B:%04X X:%04X Y:%04X Z:%04X S:%04X C:%04X LVL:%x MAP:%x | ",
-			op, flagcode(), regpair_read(A), regpair_read(B),
-			regpair_read(X), regpair_read(Y), regpair_read(Z),
-			regpair_read(S), regpair_read(C), cpu_ipl, cpu_mmu);
-		disassemble(op);
+/* Percentiles for each level that saw any interrupts, for -t */
+void cpu6_irq_report(void)
+{
+	static const char *name[] = { "latency", "service", "active" };
+	const struct histogram *h;
+	unsigned ipl, i;
+
+	if (!irq_trace)
+		return;
+	for (ipl = 0; ipl < 16; ipl++) {
+		for (i = 0; i < 3; i++) {
+			h = i == 0 ? &stats.irq_latency[ipl] :
+			    i == 1 ? &stats.irq_service[ipl] :
+			    &stats.irq_active[ipl];
+			if (h->count == 0)
+				continue;
+			fprintf(stderr, "IRQ %X %-7s n=%llu mean=%.3f p50=%.3f "
+				"p90=%.3f p99=%.3f max=%.3f us\n", ipl, name[i],
+				(unsigned long long)h->count,
+				(double)h->sum / h->count / ONE_MICROSECOND_NS,
+				histogram_percentile(h, 50) / ONE_MICROSECOND_NS,
+				histogram_percentile(h, 90) / ONE_MICROSECOND_NS,
+				histogram_percentile(h, 99) / ONE_MICROSECOND_NS,
+				h->max / ONE_MICROSECOND_NS);
+		}
+	}
+}
+
+/*
+ *	Opcode n-gram profile (-n), to find the idioms guest code is built
+ *	from. Pairs are counted directly, triples in a small open hash that
+ *	stops taking new entries once full.
+ */
+#define NGRAM_HASH	65536
+
+struct ngram {
+	uint32_t key;		/* Opcodes, first in the top byte */
+	uint32_t count;
+};
+
+static uint32_t *ngram_pairs;
+static struct ngram *ngram_triples;
+static uint32_t ngram_last;	/* Previous two opcodes */
+
+void cpu6_ngram_enable(void)
+{
+	ngram_pairs = calloc(65536, sizeof(*ngram_pairs));
+	ngram_triples = calloc(NGRAM_HASH, sizeof(*ngram_triples));
+	if (ngram_pairs == NULL || ngram_triples == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+}
+
+static void ngram_record(uint8_t code)
+{
+	uint32_t key;
+	unsigned h;
+
+	ngram_last = ((ngram_last << 8) | code) & 0xFFFFFF;
+	ngram_pairs[ngram_last & 0xFFFF]++;
+	key = ngram_last | 0x80000000;	/* So 00 00 00 is not empty */
+	h = (key * 2654435761U) >> 16;
+	while (ngram_triples[h].key != key) {
+		if (ngram_triples[h].key == 0) {
+			ngram_triples[h].key = key;
+			break;
+		}
+		h = (h + 1) & (NGRAM_HASH - 1);
+		if (h == ((key * 2654435761U) >> 16))
+			return;
 	}
+	ngram_triples[h].count++;
+}
+
+static int ngram_cmp(const void *a, const void *b)
+{
+	const struct ngram *na = a, *nb = b;
+
+	if (na->count != nb->count)
+		return na->count < nb->count ? 1 : -1;
+	return na->key < nb->key ? -1 : na->key > nb->key;
+}
+
+static void ngram_dump(FILE *fp, struct ngram *n, unsigned len, unsigned ops)
+{
+	unsigned i;
+
+	qsort(n, len, sizeof(*n), ngram_cmp);
+	for (i = 0; i < len && i < 32 && n[i].count; i++) {
+		uint8_t a = n[i].key >> 16, b = n[i].key >> 8, c = n[i].key;
+
+		fprintf(fp, "%10u  ", n[i].count);
+		if (ops == 3)
+			fprintf(fp, "%02X ", a);
+		fprintf(fp, "%02X %02X\n", b, c);
+	}
+}
+
+/* Write the most frequent pairs and triples */
+void cpu6_ngram_report(const char *name)
+{
+	struct ngram *n;
+	unsigned i, len = 0;
+	FILE *fp;
+
+	if (ngram_pairs == NULL)
+		return;
+	fp = fopen(name, "w");
+	if (fp == NULL) {
+		perror(name);
+		return;
+	}
+	n = malloc(65536 * sizeof(*n));
+	if (n == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	for (i = 0; i < 65536; i++) {
+		n[i].key = i;
+		n[i].count = ngram_pairs[i];
+	}
+	fprintf(fp, "# Opcode pairs\n");
+	ngram_dump(fp, n, 65536, 2);
+	for (i = 0; i < NGRAM_HASH; i++)
+		if (ngram_triples[i].key)
+			n[len++] = ngram_triples[i];
+	fprintf(fp, "# Opcode triples\n");
+	ngram_dump(fp, n, len, 3);
+	free(n);
+	fclose(fp);
+}
+
+static int execute_op(unsigned trace)
+{
 	if (op < 0x10)
 		return low_op();
 	if (op < 0x20)
@@ -2520,6 +3166,163 @@ unsigned cpu6_execute_one(unsigned trace)
 	return loadstore_op();
 }
 
+/*
+ *	Status polls
+ *
+ *	Waiting on a device is nearly always a loop like
+ *
+ *	P:	LDAB (addr)	81 hh ll
+ *		SRR AL ...	none or more one byte AL operations, 28-2D
+ *		Bcc P		10-1F
+ *
+ *	and the main loop has nothing to do between its instructions until
+ *	something in the machine is due to happen. poll_loop runs it round
+ *	until then as one step, decoded once. The status is read each time,
+ *	and each instruction goes on the clock when it would have run alone
+ *	with the cycles its handler would have charged, so time and state
+ *	come out the same. It is skipped while tracing, under the debugger
+ *	and with -n, which need to see every instruction.
+ */
+#define POLL_MAX_OPS	4	/* AL operations in the loop */
+#define POLL_MAX_RUN	4096	/* Instructions before going back */
+
+/* Advance to the end of an instruction of the loop, 1 if it must stop */
+static unsigned poll_step(int64_t *until, unsigned n)
+{
+	advance_time(cycles * CYCLE_NS);
+	if (get_current_time() >= *until || n >= POLL_MAX_RUN)
+		return 1;
+	/* New input can be due sooner, or no time left for any */
+	if (machine_skip_poll())
+		*until = machine_quiet_until();
+	return 0;
+}
+
+static void poll_next(void)
+{
+	exec_pc = pc;
+	if (profile_hits)
+		profile_hits[exec_pc]++;
+}
+
+/* The 81 at exec_pc has been fetched. Returns the instructions run or 0 */
+static unsigned poll_loop(void)
+{
+	uint8_t ops[POLL_MAX_OPS];
+	uint16_t start = exec_pc;
+	uint16_t addr, a;
+	unsigned nops, i, n, t;
+	unsigned load_cycles;
+	uint8_t bcc, r;
+	int64_t until;
+
+	for (nops = 0; nops < POLL_MAX_OPS; nops++) {
+		ops[nops] = mmu_mem_read8_debug(start + 3 + nops);
+		if (ops[nops] < 0x28 || ops[nops] > 0x2D)
+			break;
+	}
+	bcc = mmu_mem_read8_debug(start + 3 + nops);
+	if ((bcc & 0xF0) != 0x10 || (uint16_t)(start + 5 + nops
+	    + (int8_t)mmu_mem_read8_debug(start + 4 + nops)) != start)
+		return 0;
+	/* The code is only fetched the once */
+	for (a = start; a != (uint16_t)(start + 5 + nops); a++)
+		if (a >= 0x0100 && !mem_fetch_quiet(mmu_map(a)))
+			return 0;
+	addr = (mmu_mem_read8_debug(start + 1) << 8)
+		| mmu_mem_read8_debug(start + 2);
+	if (addr >= 0x0100 && !mem_poll_quiet(mmu_map(addr)))
+		return 0;
+	until = machine_quiet_until();
+	if (until == 0)
+		return 0;
+
+	/* As decode_address would charge for mode 1 */
+	load_cycles = cycle_table[0x81] + mode_cycles[1];
+	if (((start + 1) & 0x7FF) == 0x7FF)
+		load_cycles += PAGE_CROSS_CYCLES;
+	n = 0;
+	for (;;) {
+		r = mmu_mem_read8(addr);
+		reg_write(AL, r);
+		ldflags(r);
+		pc = start + 3;
+		cycles = load_cycles;
+		if (poll_step(&until, ++n))
+			break;
+		for (i = 0; i < nops; i++) {
+			poll_next();
+			op = ops[i];
+			cycles = cycle_table[op];
+			pc++;
+			misc2x_op();
+			if (poll_step(&until, ++n))
+				return n;
+		}
+		poll_next();
+		op = bcc;
+		cycles = cycle_table[op];
+		flags_sync();
+		t = branch_test(op & 0x0F);
+		pc += 2;
+		n++;
+		if (!t) {
+			/* Out of the loop, the main loop takes it from here */
+			advance_time(cycles * CYCLE_NS);
+			break;
+		}
+		pc = start;
+		cycles += BRANCH_TAKEN_CYCLES;
+		if (poll_step(&until, n))
+			break;
+		poll_next();
+		op = 0x81;
+	}
+	return n;
+}
+
+/* Returns the number of instructions run, 0 if the debugger went back to
+   a checkpoint instead */
+unsigned cpu6_execute_one(unsigned trace)
+{
+	struct dis_insn insn;
+	uint8_t code;
+	unsigned n;
+
+	cpu6_interrupt(trace);
+	/* May stop here until the debugger lets the machine go, and it may
+	   have gone back to a checkpoint meanwhile */
+	if (debug_armed && debug_check(pc, cpu_mmu))
+		return 0;
+	exec_pc = pc;
+	if (profile_hits)
+		profile_hits[exec_pc]++;
+
+	if (trace)
+		fprintf(stderr, "CPU %04X: ", pc);
+	op = fetch();
+	if (trace) {
+		fprintf(stderr,
+			"%02X %s A:%04X  B:%04X X:%04X Y:%04X Z:%04X S:%04X C:%04X LVL:%x MAP:%x | ",
+			op, flagcode(), regpair_read(A), regpair_read(B),
+			regpair_read(X), regpair_read(Y), regpair_read(Z),
+			regpair_read(S), regpair_read(C), cpu_ipl, cpu_mmu);
+		dis_decode(&insn, exec_pc, mmu_mem_read8_debug);
+		fprintf(stderr, "%s\n", insn.text);
+	}
+	/* Keep the opcode, 2F reuses op for its sub-operation */
+	code = op;
+	cycles = cycle_table[code];
+	if (code == 0x81 && !trace && !debug_armed && !ngram_pairs
+	    && (n = poll_loop()) != 0)
+		return n;
+	execute_op(trace);
+	advance_time(cycles * CYCLE_NS);
+	if (ngram_pairs)
+		ngram_record(code);
+	return 1;
+}
+
 uint16_t cpu6_pc(void)
 {
 	return exec_pc;
@@ -2529,10 +3332,44 @@ void set_pc_debug(uint16_t new_pc) {
 	pc = new_pc;
 }
 
+uint16_t get_pc_debug(void) {
+	return pc;
+}
+
 void reg_write_debug(uint8_t r, uint8_t v) {
 	reg_write(r, v);
 }
 
+uint8_t reg_read_debug(uint8_t r) {
+	return mmu_mem_read8_debug((cpu_ipl << 4) | r);
+}
+
+uint16_t regpair_read_debug(uint8_t r) {
+	return (reg_read_debug(r & ~1) << 8) | reg_read_debug(r | 1);
+}
+
+uint8_t cpu6_flags(void)
+{
+	flags_sync();
+	return alu_out;
+}
+
+unsigned cpu6_ipl(void)
+{
+	return cpu_ipl;
+}
+
+unsigned cpu6_mmu(void)
+{
+	return cpu_mmu;
+}
+
+/* Where an address is in physical memory with the current mapping */
+uint32_t cpu6_map_debug(uint16_t addr)
+{
+	return mmu_map(addr);
+}
+
 void regpair_write_debug(uint8_t r, uint16_t v) {
 	regpair_write(r, v);
 }
@@ -2563,4 +3400,26 @@ void cpu6_init(void)
 	*mp++ = 0x7E;
 	*mp = 0x7F;
 	pc = 0xFC00;
+
+	CHECKPOINT(cpu_ipl);
+	CHECKPOINT(cpu_mmu);
+	CHECKPOINT(pc);
+	CHECKPOINT(exec_pc);
+	CHECKPOINT(op);
+	CHECKPOINT(alu_out);
+	CHECKPOINT(switches);
+	CHECKPOINT(int_enable);
+	CHECKPOINT(halted);
+	CHECKPOINT(pending_ipl_mask);
+	CHECKPOINT(irq_asserted_ns);
+	CHECKPOINT(irq_taken_ns);
+	CHECKPOINT(irq_latency_pending);
+	CHECKPOINT(irq_in_service);
+	CHECKPOINT(cpu_sram);
+	CHECKPOINT(mmu);
+	CHECKPOINT(twobit_cached_reg);
+	CHECKPOINT(flag_op);
+	CHECKPOINT(flag_r);
+	CHECKPOINT(flag_a);
+	CHECKPOINT(flag_b);
 }
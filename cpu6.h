@@ -26,29 +26,47 @@
 #define C		12	/* Flags ? */
 #define P		14	/* PC */
 
+/* CPU timing, see the cycle table in cpu6.c */
+#define CYCLE_NS	200	/* One microcycle */
+#define MEM_CYCLES	3	/* Cycles per memory access */
+
 extern uint8_t mem_read8(uint32_t addr);
+extern uint8_t *mem_map_ram(uint32_t addr, unsigned len, unsigned write);
+extern void mem_parity_read(uint32_t addr, unsigned len);
 extern uint8_t mem_read8_debug(uint32_t addr);
 extern uint16_t mem_read16_debug(uint32_t addr);
 extern void mem_write8_debug(uint32_t addr, uint8_t val);
 extern void mem_write16_debug(uint32_t addr, uint16_t val);
 extern uint8_t mmu_mem_read8(uint16_t addr);
 extern uint8_t mmu_mem_read8_debug(uint16_t addr);
+extern void mmu_mem_write8_debug(uint16_t addr, uint8_t val);
+extern uint8_t *mmu_map_ram(uint16_t addr, unsigned len, unsigned write);
+extern void mmu_parity_read(uint16_t addr, unsigned len);
 extern void mem_write8(uint32_t addr, uint8_t val);
 extern void halt_system(void);
 extern uint16_t cpu6_pc(void);
 extern void set_pc_debug(uint16_t new_pc);
+extern uint16_t get_pc_debug(void);
 extern void reg_write_debug(uint8_t r, uint8_t v);
 extern void regpair_write_debug(uint8_t r, uint16_t v);
+extern uint8_t reg_read_debug(uint8_t r);
+extern uint16_t regpair_read_debug(uint8_t r);
+extern uint8_t cpu6_flags(void);
+extern unsigned cpu6_ipl(void);
+extern unsigned cpu6_mmu(void);
+extern uint32_t cpu6_map_debug(uint16_t addr);
 extern unsigned cpu6_execute_one(unsigned trace);
-extern int dma_read_cycle(uint8_t data);
-extern uint8_t dma_write_cycle(void);
-extern int dma_write_active(void);
+extern void cpu6_ngram_enable(void);
+extern void cpu6_ngram_report(const char *name);
 extern void cpu6_set_switches(unsigned switches);
 extern unsigned cpu6_halted(void);
 extern void cpu6_init(void);
 extern void cpu_assert_irq(unsigned ipl);
 extern void cpu_deassert_irq(unsigned ipl);
+extern void cpu6_trace_irq(unsigned on);
+extern void cpu6_irq_report(void);
 extern void advance_time(uint64_t nanoseconds);
-extern uint16_t cpu6_dma_count(void);
-extern void cpu6_dma_write(uint8_t);
-extern uint8_t cpu6_dma_read(void);
+extern int mem_fetch_quiet(uint32_t addr);
+extern int mem_poll_quiet(uint32_t addr);
+extern int64_t machine_quiet_until(void);
+extern int machine_skip_poll(void);
@@ -0,0 +1,616 @@
+/*
+ *	Disassemble CPU6 code from ROMs, Centurion binaries or memory dumps.
+ *
+ *	Code is found by following the flow of control from the entry points,
+ *	so data is left alone. The instructions found are cut into basic
+ *	blocks, which are shared out between the functions, a function being
+ *	an entry point or anything called with JSR. The output is a listing
+ *	with labels, the control flow graph as DOT or JSON, and the blocks for
+ *	the emulator's --blocks.
+ *
+ *	The entry points are the start of each raw image, the entry of each
+ *	binary and any given with -e. Jumps through registers or memory, and
+ *	instructions whose length is only known at run time, end the search
+ *	along that path, so anything only reached that way (interrupt
+ *	handlers, say) needs an -e.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cbin.h"
+#include "disassemble.h"
+
+#define LOADED		0x01
+#define INSN		0x02	/* Start of an instruction */
+#define BODY		0x04	/* Rest of one */
+#define LEADER		0x08	/* Start of a block */
+#define FUNC		0x10	/* Start of a function */
+#define QUEUED		0x20
+#define BLOCKED		0x40	/* Put in a block */
+
+#define MAX_ENTRIES	256
+
+#define EDGE_NEXT	0	/* Falls or branches not taken into it */
+#define EDGE_TAKEN	1
+#define EDGE_CALL	2
+
+struct edge {
+	uint16_t to;
+	unsigned kind;
+};
+
+struct block {
+	uint16_t start;
+	uint16_t end;		/* Exclusive, 0 if it runs to the top */
+	unsigned insns;
+	unsigned flow;		/* Of the last instruction */
+	unsigned num_edges;
+	struct edge edge[3];
+	int func;		/* Block index of the function, -1 for none */
+};
+
+static uint8_t image[65536];
+static uint8_t state[65536];
+static char *symbol[65536];
+static int block_at[65536];
+
+static struct block *blocks;
+static unsigned num_blocks;
+
+static uint16_t queue[65536];
+static unsigned queue_len;
+
+static uint8_t image_read(uint16_t addr)
+{
+	return image[addr];
+}
+
+static void load_raw(const char *name, unsigned addr)
+{
+	FILE *fp = fopen(name, "rb");
+	int c;
+
+	if (fp == NULL) {
+		perror(name);
+		exit(1);
+	}
+	while ((c = getc(fp)) != EOF) {
+		if (addr > 0xFFFF) {
+			fprintf(stderr, "%s: does not fit in 64K.\n", name);
+			exit(1);
+		}
+		image[addr] = c;
+		state[addr++] |= LOADED;
+	}
+	fclose(fp);
+}
+
+static uint16_t read_word(struct cbin_record *record, size_t offset)
+{
+	return record->data[offset] << 8 | record->data[offset + 1];
+}
+
+/* As cbin_load() does into memory, returns the entry point */
+static int load_cbin(const char *name, uint16_t load_offset)
+{
+	struct cbin_record *record;
+	cbin_state *cbin = cbin_open(name);
+	int entry = -1;
+	uint16_t addr, v;
+	unsigned i;
+
+	while ((record = cbin_next_record(cbin))) {
+		switch (record->type) {
+		case CBIN_DATA:
+			if (record->len == 0) {
+				entry = (uint16_t)(record->addr + load_offset);
+				break;
+			}
+			/* The old table loader convention, see cbin_load.c */
+			if (record->addr == 0x004C && record->len > 0x1B) {
+				load_offset = read_word(record, 0x1B);
+				break;
+			}
+			for (i = 0; i < record->len; i++) {
+				addr = record->addr + i + load_offset;
+				image[addr] = record->data[i];
+				state[addr] |= LOADED;
+			}
+			break;
+		case CBIN_FIXUPS:
+			for (i = 0; i + 1 < record->len; i += 2) {
+				addr = read_word(record, i) + load_offset;
+				v = image[addr] << 8 | image[(uint16_t)(addr + 1)];
+				v += load_offset + record->addr;
+				image[addr] = v >> 8;
+				image[(uint16_t)(addr + 1)] = v;
+			}
+			break;
+		default:
+			fprintf(stderr, "unknown type %02x", record->type);
+			cbin_error(cbin);
+		}
+	}
+	if (!cbin_finished(cbin)) {
+		fprintf(stderr, "%s: could not load.\n", name);
+		exit(1);
+	}
+	cbin_free(cbin);
+	return entry;
+}
+
+/* Lines of <addr> <name> */
+static void load_symbols(const char *name)
+{
+	FILE *fp = fopen(name, "r");
+	char buf[256], sym[64];
+	unsigned addr;
+
+	if (fp == NULL) {
+		perror(name);
+		exit(1);
+	}
+	while (fgets(buf, sizeof(buf), fp)) {
+		if (sscanf(buf, "%x %63s", &addr, sym) != 2 || addr > 0xFFFF)
+			continue;
+		free(symbol[addr]);
+		symbol[addr] = strdup(sym);
+	}
+	fclose(fp);
+}
+
+static const char *name_of(uint16_t addr)
+{
+	static char buf[4][16];
+	static unsigned n;
+
+	if (symbol[addr])
+		return symbol[addr];
+	n = (n + 1) & 3;
+	snprintf(buf[n], sizeof(buf[n]), "%s%04X",
+		(state[addr] & FUNC) ? "sub_" : "L", addr);
+	return buf[n];
+}
+
+/*
+ *	Finding the code
+ */
+
+static void follow(uint16_t addr, unsigned flags)
+{
+	state[addr] |= LEADER | flags;
+	if (!(state[addr] & QUEUED)) {
+		state[addr] |= QUEUED;
+		queue[queue_len++] = addr;
+	}
+}
+
+static int all_loaded(uint16_t addr, unsigned len)
+{
+	while (len--)
+		if (!(state[addr++] & LOADED))
+			return 0;
+	return 1;
+}
+
+static void trace_code(void)
+{
+	struct dis_insn in;
+	uint16_t addr;
+	unsigned i;
+
+	while (queue_len) {
+		addr = queue[--queue_len];
+		for (;;) {
+			if (state[addr] & INSN)
+				break;
+			if (!(state[addr] & LOADED))
+				break;
+			dis_decode(&in, addr, image_read);
+			if (!all_loaded(addr, in.len))
+				break;
+			if (state[addr] & BODY)
+				fprintf(stderr, "%04X: overlaps another instruction\n",
+					addr);
+			state[addr] |= INSN;
+			for (i = 1; i < in.len; i++)
+				state[(uint16_t)(addr + i)] |= BODY;
+			if (in.flow == DIS_NEXT) {
+				addr += in.len;
+				continue;
+			}
+			if (in.flow == DIS_BRANCH || in.flow == DIS_CALL
+			    || in.flow == DIS_RESUME)
+				follow(addr + in.len, 0);
+			if (in.target != -1) {
+				if (in.flow == DIS_CALL)
+					follow(in.target, FUNC);
+				else if (in.flow != DIS_BAD)
+					follow(in.target, 0);
+			}
+			break;
+		}
+	}
+}
+
+/*
+ *	Cutting it into blocks
+ */
+
+static void add_edge(struct block *b, int to, unsigned kind)
+{
+	if (to == -1)
+		return;
+	b->edge[b->num_edges].to = to;
+	b->edge[b->num_edges++].kind = kind;
+}
+
+static void make_blocks(void)
+{
+	struct dis_insn in;
+	struct block *b;
+	unsigned addr;
+	uint16_t pc;
+
+	blocks = calloc(65536, sizeof(*blocks));
+	if (blocks == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	for (addr = 0; addr < 65536; addr++)
+		block_at[addr] = -1;
+	for (addr = 0; addr < 65536; addr++) {
+		if ((state[addr] & (INSN | BLOCKED)) != INSN)
+			continue;
+		b = &blocks[num_blocks];
+		b->start = pc = addr;
+		b->func = -1;
+		block_at[addr] = num_blocks++;
+		for (;;) {
+			state[pc] |= BLOCKED;
+			dis_decode(&in, pc, image_read);
+			b->insns++;
+			pc += in.len;
+			if (in.flow != DIS_NEXT || pc <= addr)
+				break;
+			/* Into another block, or off the end of what we know */
+			if ((state[pc] & (INSN | LEADER | BLOCKED)) != INSN) {
+				if (state[pc] & INSN)
+					add_edge(b, pc, EDGE_NEXT);
+				break;
+			}
+		}
+		b->end = pc;
+		b->flow = in.flow;
+		if (in.flow == DIS_BRANCH || in.flow == DIS_CALL
+		    || in.flow == DIS_RESUME)
+			add_edge(b, pc, EDGE_NEXT);
+		if (in.flow == DIS_BRANCH || in.flow == DIS_JUMP)
+			add_edge(b, in.target, EDGE_TAKEN);
+		if (in.flow == DIS_CALL)
+			add_edge(b, in.target, EDGE_CALL);
+	}
+}
+
+/* Everything reached from a function's start without a call is in it */
+static void claim(unsigned n, int func)
+{
+	struct block *b = &blocks[n];
+	unsigned i;
+	int to;
+
+	if (b->func != -1)
+		return;
+	b->func = func;
+	for (i = 0; i < b->num_edges; i++) {
+		if (b->edge[i].kind == EDGE_CALL)
+			continue;
+		to = block_at[b->edge[i].to];
+		if (to != -1 && !(state[b->edge[i].to] & FUNC))
+			claim(to, func);
+	}
+}
+
+static void make_functions(void)
+{
+	unsigned i;
+
+	for (i = 0; i < num_blocks; i++)
+		if (state[blocks[i].start] & FUNC)
+			claim(i, i);
+}
+
+/*
+ *	Output
+ */
+
+static void list_data(FILE *fp, unsigned addr, unsigned len)
+{
+	unsigned i;
+
+	fprintf(fp, "\t%04X  DB ", addr);
+	for (i = 0; i < len; i++)
+		fprintf(fp, "%s%02X", i ? "," : "", image[addr + i]);
+	fputc('\n', fp);
+}
+
+static void listing(FILE *fp)
+{
+	struct dis_insn in;
+	unsigned addr, i, data = 0, data_len = 0;
+	int n;
+
+	for (addr = 0; addr < 65536; addr++) {
+		/* Runs of data up to 8 bytes a line */
+		if ((state[addr] & (LOADED | INSN | BODY)) == LOADED) {
+			if (data_len == 8 || (data_len && data + data_len != addr)) {
+				list_data(fp, data, data_len);
+				data_len = 0;
+			}
+			if (data_len++ == 0)
+				data = addr;
+			continue;
+		}
+		if (data_len) {
+			list_data(fp, data, data_len);
+			data_len = 0;
+		}
+		if (!(state[addr] & INSN))
+			continue;
+		n = block_at[addr];
+		if (n != -1 && blocks[n].func == n)
+			fprintf(fp, "\n; function %s\n", name_of(addr));
+		if (state[addr] & LEADER || symbol[addr])
+			fprintf(fp, "%s:\n", name_of(addr));
+		dis_decode(&in, addr, image_read);
+		fprintf(fp, "\t%04X  ", addr);
+		for (i = 0; i < 6; i++) {
+			if (i < in.len)
+				fprintf(fp, "%02X", image[(uint16_t)(addr + i)]);
+			else
+				fputs("  ", fp);
+		}
+		fprintf(fp, "%s  ", in.len > 6 ? ".." : "  ");
+		if (in.target != -1)
+			fprintf(fp, "%-28s; %s", in.text, name_of(in.target));
+		else if (state[addr] & BODY)
+			fprintf(fp, "%-28s; overlaps", in.text);
+		else
+			fputs(in.text, fp);
+		fputc('\n', fp);
+	}
+	if (data_len)
+		list_data(fp, data, data_len);
+}
+
+static const char *edge_style[] = { "", " [color=green]", " [style=dashed]" };
+
+static void dot_escape(FILE *fp, const char *s)
+{
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', fp);
+		fputc(*s, fp);
+	}
+}
+
+static void write_dot(const char *name)
+{
+	FILE *fp = fopen(name, "w");
+	struct dis_insn in;
+	struct block *b;
+	unsigned i, j;
+	uint16_t pc;
+
+	if (fp == NULL) {
+		perror(name);
+		exit(1);
+	}
+	fprintf(fp, "digraph cfg {\n\tnode [shape=box fontname=monospace];\n");
+	for (i = 0; i < num_blocks; i++) {
+		if (blocks[i].func != i)
+			continue;
+		fprintf(fp, "\tsubgraph cluster_%04X {\n\t\tlabel=\"%s\";\n",
+			blocks[i].start, name_of(blocks[i].start));
+		for (j = 0; j < num_blocks; j++)
+			if (blocks[j].func == i)
+				fprintf(fp, "\t\tb%04X;\n", blocks[j].start);
+		fprintf(fp, "\t}\n");
+	}
+	for (i = 0; i < num_blocks; i++) {
+		b = &blocks[i];
+		fprintf(fp, "\tb%04X [label=\"%s:\\l", b->start,
+			name_of(b->start));
+		pc = b->start;
+		for (j = 0; j < b->insns; j++) {
+			pc += dis_decode(&in, pc, image_read);
+			fprintf(fp, "%04X  ", in.addr);
+			dot_escape(fp, in.text);
+			fprintf(fp, "\\l");
+		}
+		fprintf(fp, "\"];\n");
+		for (j = 0; j < b->num_edges; j++)
+			fprintf(fp, "\tb%04X -> b%04X%s;\n", b->start,
+				b->edge[j].to, edge_style[b->edge[j].kind]);
+	}
+	fprintf(fp, "}\n");
+	fclose(fp);
+}
+
+static const char *flow_name[] = {
+	"next", "branch", "jump", "call", "return", "halt", "unknown", "resume"
+};
+
+static const char *edge_name[] = { "next", "taken", "call" };
+
+static void write_json(const char *name)
+{
+	FILE *fp = fopen(name, "w");
+	struct block *b;
+	unsigned i, j;
+	const char *s;
+
+	if (fp == NULL) {
+		perror(name);
+		exit(1);
+	}
+	fprintf(fp, "{\n\"functions\": [");
+	s = "";
+	for (i = 0; i < num_blocks; i++) {
+		if (blocks[i].func != i)
+			continue;
+		fprintf(fp, "%s\n  {\"name\": \"%s\", \"entry\": %u, \"blocks\": [",
+			s, name_of(blocks[i].start), blocks[i].start);
+		s = "";
+		for (j = 0; j < num_blocks; j++) {
+			if (blocks[j].func == i) {
+				fprintf(fp, "%s%u", s, blocks[j].start);
+				s = ", ";
+			}
+		}
+		fprintf(fp, "]}");
+		s = ",";
+	}
+	fprintf(fp, "\n],\n\"blocks\": [");
+	for (i = 0; i < num_blocks; i++) {
+		b = &blocks[i];
+		fprintf(fp, "%s\n  {\"name\": \"%s\", \"start\": %u, \"end\": %u, "
+			"\"instructions\": %u, \"exit\": \"%s\", \"function\": ",
+			i ? "," : "", name_of(b->start), b->start,
+			b->end ? b->end : 65536, b->insns, flow_name[b->flow]);
+		if (b->func == -1)
+			fprintf(fp, "null");
+		else
+			fprintf(fp, "\"%s\"", name_of(blocks[b->func].start));
+		fprintf(fp, ", \"edges\": [");
+		for (j = 0; j < b->num_edges; j++)
+			fprintf(fp, "%s{\"to\": %u, \"kind\": \"%s\"}",
+				j ? ", " : "", b->edge[j].to,
+				edge_name[b->edge[j].kind]);
+		fprintf(fp, "]}");
+	}
+	fprintf(fp, "\n]\n}\n");
+	fclose(fp);
+}
+
+/* For centurion --blocks */
+static void write_blocks(const char *name)
+{
+	FILE *fp = fopen(name, "w");
+	unsigned i;
+
+	if (fp == NULL) {
+		perror(name);
+		exit(1);
+	}
+	fprintf(fp, "# start end instructions name\n");
+	for (i = 0; i < num_blocks; i++)
+		fprintf(fp, "%04X %04X %u %s\n", blocks[i].start,
+			blocks[i].end ? blocks[i].end : 0x10000,
+			blocks[i].insns, name_of(blocks[i].start));
+	fclose(fp);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: cpu6dis [options] [cbin]...\n"
+		" -r <file>@<addr>  load a raw image (ROM or memory dump) at <addr> (hex)\n"
+		" -o <addr>         load offset for the Centurion binaries\n"
+		" -e <addr>         more code starts at <addr>, as an interrupt handler\n"
+		" -s <file>         symbols, lines of <addr> <name>\n"
+		" -d <file>         write the control flow graph as DOT\n"
+		" -j <file>         write the control flow graph as JSON\n"
+		" -B <file>         write the basic blocks for centurion --blocks\n"
+		" -q                no listing\n");
+	exit(1);
+}
+
+static unsigned parse_addr(const char *s)
+{
+	char *end;
+	unsigned long v = strtoul(s, &end, 16);
+
+	if (*s == 0 || *end || v > 0xFFFF) {
+		fprintf(stderr, "cpu6dis: bad address '%s'\n", s);
+		exit(1);
+	}
+	return v;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned entry[MAX_ENTRIES];
+	unsigned num_entries = 0, quiet = 0;
+	char *dot_file = NULL, *json_file = NULL, *block_file = NULL;
+	uint16_t load_offset = 0;
+	char *p;
+	unsigned i;
+	int opt, n;
+
+	while ((opt = getopt(argc, argv, "r:o:e:s:d:j:B:q")) != -1) {
+		if (num_entries == MAX_ENTRIES) {
+			fprintf(stderr, "cpu6dis: too many entry points\n");
+			exit(1);
+		}
+		switch (opt) {
+		case 'r':
+			p = strrchr(optarg, '@');
+			if (p == NULL)
+				usage();
+			*p++ = 0;
+			load_raw(optarg, parse_addr(p));
+			entry[num_entries++] = parse_addr(p);
+			break;
+		case 'o':
+			load_offset = parse_addr(optarg);
+			break;
+		case 'e':
+			entry[num_entries++] = parse_addr(optarg);
+			break;
+		case 's':
+			load_symbols(optarg);
+			break;
+		case 'd':
+			dot_file = optarg;
+			break;
+		case 'j':
+			json_file = optarg;
+			break;
+		case 'B':
+			block_file = optarg;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	for (; optind < argc; optind++) {
+		n = load_cbin(argv[optind], load_offset);
+		if (n != -1 && num_entries < MAX_ENTRIES)
+			entry[num_entries++] = n;
+	}
+	if (num_entries == 0)
+		usage();
+
+	for (i = 0; i < num_entries; i++)
+		follow(entry[i], FUNC);
+	trace_code();
+	make_blocks();
+	make_functions();
+
+	if (!quiet)
+		listing(stdout);
+	if (dot_file)
+		write_dot(dot_file);
+	if (json_file)
+		write_json(json_file);
+	if (block_file)
+		write_blocks(block_file);
+	return 0;
+}
@@ -0,0 +1,874 @@
+/*
+ *	Debugger
+ *
+ *	Breakpoints on the PC, optionally for one MMU bank and only when a
+ *	register holds a given value, watchpoints on physical memory and
+ *	breaks when an interrupt level is taken. A debugger drives them over
+ *	a local socket (--gdb <port>) with the GDB remote protocol.
+ *
+ *	None of it costs anything until it is used. The CPU only looks at the
+ *	PC when debug_armed is set, and then only goes through the list for
+ *	PCs in the bitmap. Watched memory is flagged per 1K block in the bus
+ *	map so that accesses to the rest go the usual way.
+ *
+ *	The registers are A B X Y Z S C and the PC as words, then the flags,
+ *	the interrupt level and the MMU bank as bytes, all big endian. Memory
+ *	is the CPU's view through the current MMU bank. Watchpoints set with
+ *	Z2-Z4 are placed on the physical memory their address maps to at the
+ *	time. Everything else is done with monitor commands:
+ *
+ *	break <addr> [bank <n>] [if <reg>=<value>]
+ *	watch <physaddr> [<len>] [r|w|rw]
+ *	irq <level>
+ *	delete
+ *	info
+ *	goto <instruction count>
+ *
+ *	Breaking on an interrupt stops at the first instruction of the
+ *	handler. Watchpoints stop after the instruction that hit them.
+ *
+ *	With --checkpoint the machine can go backwards too (see checkpoint.c).
+ *	A reverse step puts back the last checkpoint before the instruction
+ *	and runs on to it. A reverse continue runs from the checkpoint before
+ *	to where the machine is, noting the last place it would have stopped,
+ *	then goes back and runs to that, trying earlier checkpoints in turn
+ *	if there was nowhere. Goto does the same for any instruction count,
+ *	the machine getting there on the next continue.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <poll.h>
+#endif
+
+#include "centurion.h"
+#include "checkpoint.h"
+#include "console.h"
+#include "cpu6.h"
+#include "debug.h"
+#include "scheduler.h"
+
+#define DEBUG_MAX	32		/* Breakpoints and watchpoints */
+#define DEBUG_PACKET	1024
+#define DEBUG_POLL_NS	(10 * ONE_MILISECOND_NS)
+
+#define BREAK_PC	0
+#define WATCH_WRITE	1
+#define WATCH_READ	2
+#define WATCH_ACCESS	3
+
+struct breakpoint {
+	unsigned type;
+	uint32_t addr;		/* Logical for a PC, else physical */
+	uint32_t len;
+	uint16_t gdb_addr;	/* As the debugger gave it, for Z/z */
+	int bank;		/* -1 for any */
+	int reg;		/* Condition, -1 for none */
+	unsigned wide;
+	uint16_t value;
+};
+
+unsigned debug_armed;
+
+static struct breakpoint breaks[DEBUG_MAX];
+static unsigned num_breaks;
+static uint8_t pc_map[0x10000 / 8];
+static unsigned irq_mask;
+
+static int debug_fd = -1;
+static unsigned stepping;
+static unsigned stop_pending;
+static char stop_reply[48] = "S05";
+static char stop_note[48];
+
+/* Going backwards */
+#define REV_NONE	0
+#define REV_TO		1	/* Run on to rev_target and stop there */
+#define REV_SCAN	2	/* Look for the last stop before rev_target */
+
+static unsigned rev_mode;
+static long long rev_target;
+static long long rev_from;	/* Checkpoint the scan started from */
+static long long rev_hit;	/* Last stop seen by the scan, -1 for none */
+static char rev_reply[48];
+static char rev_note[48];
+static unsigned restored;	/* Put a checkpoint back while stopped */
+
+static void debug_poll(struct event_t *event, int64_t late_ns);
+static struct event_t debug_poll_evt = {
+	.name = "debug_poll",
+	.callback = debug_poll
+};
+
+static const char *reg_name[16] = {
+	"AH", "AL", "BH", "BL", "XH", "XL", "YH", "YL",
+	"ZH", "ZL", "SH", "SL", "CH", "CL", "PH", "PL"
+};
+
+static void debug_rearm(void)
+{
+	debug_armed = debug_fd != -1
+		&& (num_breaks || irq_mask || stepping || stop_pending || rev_mode);
+}
+
+/* Redo the PC bitmap and the watched blocks after a change */
+static void debug_update(void)
+{
+	static uint32_t watched[DEBUG_MAX * 2];
+	static unsigned num_watched;
+	struct breakpoint *b;
+	uint32_t a;
+	unsigned i;
+
+	for (i = 0; i < num_watched; i++)
+		mem_watch(watched[i], 0);
+	num_watched = 0;
+	memset(pc_map, 0, sizeof(pc_map));
+
+	for (b = breaks; b < breaks + num_breaks; b++) {
+		if (b->type == BREAK_PC) {
+			pc_map[b->addr >> 3] |= 1 << (b->addr & 7);
+			continue;
+		}
+		/* At most two blocks as a watch is no longer than 1K */
+		for (a = b->addr & ~0x3FF; a < b->addr + b->len; a += 0x400) {
+			mem_watch(a, 1);
+			watched[num_watched++] = a;
+		}
+	}
+	debug_rearm();
+}
+
+static int debug_add(struct breakpoint *b)
+{
+	if (num_breaks == DEBUG_MAX)
+		return -1;
+	if (b->type != BREAK_PC && (b->len == 0 || b->len > 0x400))
+		return -1;
+	breaks[num_breaks++] = *b;
+	debug_update();
+	return 0;
+}
+
+static void debug_delete(unsigned n)
+{
+	breaks[n] = breaks[--num_breaks];
+	debug_update();
+}
+
+/*
+ *	Talking to the debugger
+ */
+
+static void debug_disconnect(void)
+{
+	close(debug_fd);
+	debug_fd = -1;
+	num_breaks = 0;
+	irq_mask = 0;
+	stepping = 0;
+	stop_pending = 0;
+	rev_mode = REV_NONE;
+	cancel_event(&debug_poll_evt);
+	debug_update();
+	fprintf(stderr, "[Debugger disconnected]\n");
+}
+
+/* -1 if the debugger went away */
+static int debug_getc(void)
+{
+	uint8_t c;
+
+	host_syscalls++;
+	if (read(debug_fd, &c, 1) != 1)
+		return -1;
+	return c;
+}
+
+static void debug_send(const char *p, unsigned len)
+{
+	int n;
+
+	while (len) {
+		host_syscalls++;
+		n = write(debug_fd, p, len);
+		if (n <= 0)
+			return;
+		p += n;
+		len -= n;
+	}
+}
+
+static void put_packet(const char *data)
+{
+	char buf[DEBUG_PACKET + 8];
+	unsigned len = strlen(data);
+	uint8_t sum = 0;
+	unsigned i;
+
+	buf[0] = '$';
+	for (i = 0; i < len; i++)
+		sum += data[i];
+	memcpy(buf + 1, data, len);
+	snprintf(buf + len + 1, 4, "#%02x", sum);
+	debug_send(buf, len + 4);
+}
+
+/* Wait for a packet, returns 0 if the debugger went away */
+static int get_packet(char *buf)
+{
+	unsigned len;
+	int c;
+
+	for (;;) {
+		do {
+			c = debug_getc();
+			if (c == -1)
+				return 0;
+		} while (c != '$');
+		len = 0;
+		while ((c = debug_getc()) != '#') {
+			if (c == -1)
+				return 0;
+			if (len < DEBUG_PACKET - 1)
+				buf[len++] = c;
+		}
+		buf[len] = 0;
+		/* The checksum. It's a local socket so trust it */
+		if (debug_getc() == -1 || debug_getc() == -1)
+			return 0;
+		debug_send("+", 1);
+		return 1;
+	}
+}
+
+static char *hex_bytes(char *p, uint32_t val, unsigned bytes)
+{
+	while (bytes--)
+		p += sprintf(p, "%02X", (val >> (bytes * 8)) & 0xFF);
+	return p;
+}
+
+/* Text for the debugger's console */
+static void debug_print(const char *text)
+{
+	char buf[DEBUG_PACKET];
+	char *p = buf;
+
+	*p++ = 'O';
+	while (*text && p < buf + sizeof(buf) - 3)
+		p = hex_bytes(p, *text++, 1);
+	*p = 0;
+	put_packet(buf);
+}
+
+/*
+ *	Registers
+ */
+
+#define REG_FLAGS	8
+#define REG_IPL		9
+#define REG_MMU		10
+#define NUM_REGS	11
+
+static uint16_t reg_get(unsigned n)
+{
+	switch (n) {
+	case 7:
+		return get_pc_debug();
+	case REG_FLAGS:
+		return cpu6_flags();
+	case REG_IPL:
+		return cpu6_ipl();
+	case REG_MMU:
+		return cpu6_mmu();
+	}
+	return regpair_read_debug(n * 2);
+}
+
+static int reg_set(unsigned n, uint16_t val)
+{
+	if (n == 7)
+		set_pc_debug(val);
+	else if (n < 7)
+		regpair_write_debug(n * 2, val);
+	else
+		return -1;
+	return 0;
+}
+
+static void read_registers(char *out)
+{
+	unsigned i;
+
+	for (i = 0; i < NUM_REGS; i++)
+		out = hex_bytes(out, reg_get(i), i < REG_FLAGS ? 2 : 1);
+	*out = 0;
+}
+
+static void write_registers(const char *in)
+{
+	unsigned i;
+	unsigned v;
+
+	for (i = 0; i < REG_FLAGS; i++) {
+		if (sscanf(in + i * 4, "%4x", &v) != 1)
+			return;
+		reg_set(i, v);
+	}
+}
+
+/* Condition register by name, A to C or one of their halves */
+static int reg_lookup(const char *name, unsigned *wide)
+{
+	static const char *pairs = "ABXYZSC";
+	const char *p;
+	unsigned i;
+
+	if (name[0] && name[1] == 0 && (p = strchr(pairs, name[0])) != NULL) {
+		*wide = 1;
+		return (p - pairs) * 2;
+	}
+	for (i = 0; i < 14; i++) {
+		if (strcmp(name, reg_name[i]) == 0) {
+			*wide = 0;
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ *	Going backwards
+ */
+
+/* Run on from the last checkpoint to the instruction and stop there */
+static int reverse_to(long long target, const char *reply, const char *note)
+{
+	if (target < 0 || checkpoint_goto(target) == -1)
+		return -1;
+	rev_mode = REV_TO;
+	rev_target = target;
+	snprintf(rev_reply, sizeof(rev_reply), "%s", reply);
+	snprintf(rev_note, sizeof(rev_note), "%s", note);
+	restored = 1;
+	return 0;
+}
+
+/* Look for the last stop between the checkpoint before and here */
+static int reverse_scan(long long end)
+{
+	long long from = checkpoint_goto(end - 1);
+
+	if (from == -1)
+		return -1;
+	rev_mode = REV_SCAN;
+	rev_from = from;
+	rev_target = end;
+	rev_hit = -1;
+	restored = 1;
+	return 0;
+}
+
+/* Got to rev_target, returns 1 if it went back to a checkpoint */
+static int debug_stopped(void);
+static int reverse_done(void)
+{
+	if (rev_mode == REV_TO) {
+		rev_mode = REV_NONE;
+		snprintf(stop_reply, sizeof(stop_reply), "%s", rev_reply);
+		snprintf(stop_note, sizeof(stop_note), "%s", rev_note);
+		return debug_stopped();
+	}
+	if (rev_hit != -1) {
+		checkpoint_goto(rev_hit);
+		rev_mode = REV_TO;
+		rev_target = rev_hit;
+		return 1;
+	}
+	if (reverse_scan(rev_from) == 0)
+		return 1;
+	/* Nowhere at all, so stop at the start of what is kept */
+	reverse_to(rev_from, "T05replaylog:begin;", "");
+	return 1;
+}
+
+/*
+ *	Monitor commands
+ */
+
+static void monitor_info(void)
+{
+	struct breakpoint *b;
+	char buf[96];
+	unsigned i;
+
+	for (b = breaks; b < breaks + num_breaks; b++) {
+		if (b->type == BREAK_PC) {
+			i = snprintf(buf, sizeof(buf), "break %04X", b->addr);
+			if (b->bank != -1)
+				i += snprintf(buf + i, sizeof(buf) - i,
+					" bank %d", b->bank);
+			if (b->reg != -1)
+				i += snprintf(buf + i, sizeof(buf) - i,
+					" if %.*s=%X", b->wide ? 1 : 2,
+					reg_name[b->reg], b->value);
+		} else
+			i = snprintf(buf, sizeof(buf), "watch %05X %u %s",
+				b->addr, b->len,
+				b->type == WATCH_READ ? "r" :
+				b->type == WATCH_WRITE ? "w" : "rw");
+		snprintf(buf + i, sizeof(buf) - i, "\n");
+		debug_print(buf);
+	}
+	for (i = 0; i < 16; i++) {
+		if (irq_mask & (1 << i)) {
+			snprintf(buf, sizeof(buf), "irq %u\n", i);
+			debug_print(buf);
+		}
+	}
+	snprintf(buf, sizeof(buf), "instruction %lld\n", instruction_count);
+	debug_print(buf);
+	if (checkpoint_enabled()) {
+		checkpoint_info(buf, sizeof(buf));
+		debug_print(buf);
+	}
+}
+
+static int monitor_goto(char *args)
+{
+	long long n;
+
+	if (sscanf(args, "%lld", &n) != 1 || n < 0)
+		return -1;
+	if (n < instruction_count)
+		return reverse_to(n, "S05", "");
+	rev_mode = REV_TO;
+	rev_target = n;
+	strcpy(rev_reply, "S05");
+	*rev_note = 0;
+	return 0;
+}
+
+static int monitor_break(char *args)
+{
+	struct breakpoint b;
+	char reg[4];
+	unsigned addr, val;
+	int n;
+
+	memset(&b, 0, sizeof(b));
+	b.type = BREAK_PC;
+	b.bank = -1;
+	b.reg = -1;
+	if (sscanf(args, "%x%n", &addr, &n) != 1 || addr > 0xFFFF)
+		return -1;
+	b.addr = addr;
+	args += n;
+	if (sscanf(args, " bank %d%n", &b.bank, &n) == 1) {
+		if (b.bank < 0 || b.bank > 7)
+			return -1;
+		args += n;
+	}
+	if (sscanf(args, " if %3[A-Z]=%x%n", reg, &val, &n) == 2) {
+		b.reg = reg_lookup(reg, &b.wide);
+		if (b.reg == -1)
+			return -1;
+		b.value = val;
+		args += n;
+	}
+	if (args[strspn(args, " ")])
+		return -1;
+	return debug_add(&b);
+}
+
+static int monitor_watch(char *args)
+{
+	struct breakpoint b;
+	char how[4] = "w";
+	unsigned addr;
+	int n;
+
+	memset(&b, 0, sizeof(b));
+	b.len = 1;
+	if (sscanf(args, "%x%n", &addr, &n) != 1 || addr >= 0x80000)
+		return -1;
+	b.addr = addr;
+	args += n;
+	if (sscanf(args, " %u%n", &b.len, &n) == 1)
+		args += n;
+	if (sscanf(args, " %3s%n", how, &n) == 1)
+		args += n;
+	if (strcmp(how, "r") == 0)
+		b.type = WATCH_READ;
+	else if (strcmp(how, "w") == 0)
+		b.type = WATCH_WRITE;
+	else if (strcmp(how, "rw") == 0)
+		b.type = WATCH_ACCESS;
+	else
+		return -1;
+	if (args[strspn(args, " ")])
+		return -1;
+	return debug_add(&b);
+}
+
+static void monitor(const char *hex, char *reply)
+{
+	char cmd[DEBUG_PACKET / 2];
+	unsigned i, c;
+	int r = 0;
+
+	for (i = 0; i < sizeof(cmd) - 1 && sscanf(hex + i * 2, "%2x", &c) == 1; i++)
+		cmd[i] = c;
+	cmd[i] = 0;
+
+	if (strncmp(cmd, "break ", 6) == 0)
+		r = monitor_break(cmd + 6);
+	else if (strncmp(cmd, "watch ", 6) == 0)
+		r = monitor_watch(cmd + 6);
+	else if (sscanf(cmd, "irq %u", &c) == 1 && c < 16) {
+		irq_mask |= 1 << c;
+		debug_rearm();
+	} else if (strcmp(cmd, "delete") == 0) {
+		num_breaks = 0;
+		irq_mask = 0;
+		debug_update();
+	} else if (strcmp(cmd, "info") == 0)
+		monitor_info();
+	else if (strncmp(cmd, "goto ", 5) == 0)
+		r = monitor_goto(cmd + 5);
+	else {
+		debug_print("break <addr> [bank <n>] [if <reg>=<value>]\n"
+			"watch <physaddr> [<len>] [r|w|rw]\n"
+			"irq <level>\ndelete\ninfo\n"
+			"goto <instruction count>\n");
+		r = strcmp(cmd, "help") ? -1 : 0;
+	}
+	strcpy(reply, r ? "E01" : "OK");
+}
+
+/* Z and z packets */
+static void set_break(const char *args, unsigned on, char *reply)
+{
+	struct breakpoint b;
+	unsigned type, addr, len;
+	unsigned i;
+
+	strcpy(reply, "E01");
+	if (sscanf(args, "%u,%x,%x", &type, &addr, &len) != 3 || type > 4
+	    || addr > 0xFFFF) {
+		*reply = 0;
+		return;
+	}
+	memset(&b, 0, sizeof(b));
+	b.gdb_addr = addr;
+	b.bank = -1;
+	b.reg = -1;
+	b.len = len;
+	if (type < 2) {
+		b.type = BREAK_PC;
+		b.addr = addr;
+	} else {
+		b.type = type == 2 ? WATCH_WRITE :
+			type == 3 ? WATCH_READ : WATCH_ACCESS;
+		b.addr = cpu6_map_debug(addr);
+	}
+	if (on) {
+		if (debug_add(&b) == 0)
+			strcpy(reply, "OK");
+		return;
+	}
+	for (i = 0; i < num_breaks; i++) {
+		if (breaks[i].type == b.type && breaks[i].gdb_addr == addr
+		    && breaks[i].bank == -1 && breaks[i].reg == -1) {
+			debug_delete(i);
+			strcpy(reply, "OK");
+			return;
+		}
+	}
+}
+
+/*
+ *	The machine is stopped, take commands until it is to go again. Returns
+ *	1 if a checkpoint was put back meanwhile.
+ */
+static int debug_stopped(void)
+{
+	char buf[DEBUG_PACKET];
+	char reply[DEBUG_PACKET];
+	unsigned addr, len, i, v;
+	char *p;
+
+	restored = 0;
+	stop_pending = 0;
+	stepping = 0;
+	debug_rearm();
+	if (*stop_note) {
+		debug_print(stop_note);
+		*stop_note = 0;
+	}
+	put_packet(stop_reply);
+
+	while (get_packet(buf)) {
+		*reply = 0;
+		switch (*buf) {
+		case '?':
+			strcpy(reply, stop_reply);
+			break;
+		case 'g':
+			read_registers(reply);
+			break;
+		case 'G':
+			write_registers(buf + 1);
+			strcpy(reply, "OK");
+			break;
+		case 'p':
+			if (sscanf(buf + 1, "%x", &i) == 1 && i < NUM_REGS)
+				hex_bytes(reply, reg_get(i), i < REG_FLAGS ? 2 : 1);
+			else
+				strcpy(reply, "E01");
+			break;
+		case 'P':
+			if (sscanf(buf + 1, "%x=%x", &i, &v) == 2
+			    && reg_set(i, v) == 0)
+				strcpy(reply, "OK");
+			else
+				strcpy(reply, "E01");
+			break;
+		case 'm':
+			if (sscanf(buf + 1, "%x,%x", &addr, &len) != 2
+			    || len > sizeof(reply) / 2 - 1) {
+				strcpy(reply, "E01");
+				break;
+			}
+			p = reply;
+			for (i = 0; i < len; i++)
+				p = hex_bytes(p, mmu_mem_read8_debug(addr + i), 1);
+			*p = 0;
+			break;
+		case 'M':
+			p = strchr(buf, ':');
+			if (p == NULL || sscanf(buf + 1, "%x,%x", &addr, &len) != 2) {
+				strcpy(reply, "E01");
+				break;
+			}
+			for (i = 0; i < len && sscanf(p + 1 + i * 2, "%2x", &v) == 1; i++)
+				mmu_mem_write8_debug(addr + i, v);
+			strcpy(reply, "OK");
+			break;
+		case 's':
+			stepping = 1;
+			/* Fall through */
+		case 'c':
+			if (sscanf(buf + 1, "%x", &addr) == 1)
+				set_pc_debug(addr);
+			debug_rearm();
+			throttle_resume(get_current_time());
+			return restored;
+		case 'b':
+			if (!checkpoint_enabled())
+				break;
+			if (buf[1] == 's')
+				i = reverse_to(instruction_count - 1, "S05", "");
+			else if (buf[1] == 'c')
+				i = reverse_scan(instruction_count);
+			else
+				break;
+			if (i == 0) {
+				debug_rearm();
+				return 1;
+			}
+			/* Already as far back as it goes */
+			strcpy(stop_reply, "T05replaylog:begin;");
+			strcpy(reply, stop_reply);
+			break;
+		case 'k':
+			emulator_done = 1;
+			debug_disconnect();
+			return restored;
+		case 'D':
+			put_packet("OK");
+			debug_disconnect();
+			return restored;
+		case 'Z':
+		case 'z':
+			set_break(buf + 1, *buf == 'Z', reply);
+			break;
+		case 'H':
+			strcpy(reply, "OK");
+			break;
+		case 'q':
+			if (strncmp(buf, "qSupported", 10) == 0)
+				sprintf(reply, "PacketSize=%X%s", DEBUG_PACKET,
+					checkpoint_enabled()
+					? ";ReverseStep+;ReverseContinue+" : "");
+			else if (strcmp(buf, "qAttached") == 0)
+				strcpy(reply, "1");
+			else if (strncmp(buf, "qRcmd,", 6) == 0)
+				monitor(buf + 6, reply);
+			break;
+		}
+		put_packet(reply);
+	}
+	debug_disconnect();
+	return restored;
+}
+
+static void debug_stop(const char *reply, const char *note)
+{
+	snprintf(stop_reply, sizeof(stop_reply), "%s", reply);
+	snprintf(stop_note, sizeof(stop_note), "%s", note);
+	stop_pending = 1;
+	debug_rearm();
+}
+
+/* Stop, unless looking for the last place to stop */
+static int debug_halt(void)
+{
+	if (rev_mode == REV_SCAN) {
+		rev_hit = instruction_count;
+		strcpy(rev_reply, stop_reply);
+		strcpy(rev_note, stop_note);
+		*stop_note = 0;
+		stop_pending = 0;
+		debug_rearm();
+		return 0;
+	}
+	return debug_stopped();
+}
+
+/* Called before each instruction while armed, returns 1 if a checkpoint
+   has been put back and the instruction is not to be run */
+int debug_check(uint16_t pc, unsigned bank)
+{
+	struct breakpoint *b;
+	uint16_t v;
+
+	if (rev_mode && instruction_count >= rev_target)
+		return reverse_done();
+	/* Nothing stops it on the way */
+	if (rev_mode == REV_TO) {
+		stop_pending = 0;
+		*stop_note = 0;
+		return 0;
+	}
+	if (stop_pending || stepping) {
+		if (!stop_pending)
+			debug_stop("S05", "");
+		return debug_halt();
+	}
+	if (!(pc_map[pc >> 3] & (1 << (pc & 7))))
+		return 0;
+	for (b = breaks; b < breaks + num_breaks; b++) {
+		if (b->type != BREAK_PC || b->addr != pc)
+			continue;
+		if (b->bank != -1 && b->bank != bank)
+			continue;
+		if (b->reg != -1) {
+			v = b->wide ? regpair_read_debug(b->reg)
+				: reg_read_debug(b->reg);
+			if (v != b->value)
+				continue;
+		}
+		debug_stop("T05swbreak:;", "");
+		return debug_halt();
+	}
+	return 0;
+}
+
+void debug_irq(unsigned ipl)
+{
+	char note[32];
+
+	if (irq_mask & (1 << ipl)) {
+		snprintf(note, sizeof(note), "Interrupt level %X taken\n", ipl);
+		debug_stop("S05", note);
+	}
+}
+
+/* An access to a watched block */
+void debug_watch(uint32_t addr, unsigned write)
+{
+	static const char *kind[] = { "", "watch", "rwatch", "awatch" };
+	struct breakpoint *b;
+	char reply[48];
+	char note[48];
+
+	for (b = breaks; b < breaks + num_breaks; b++) {
+		if (b->type == BREAK_PC || addr < b->addr
+		    || addr >= b->addr + b->len)
+			continue;
+		if (b->type == (write ? WATCH_READ : WATCH_WRITE))
+			continue;
+		snprintf(reply, sizeof(reply), "T05%s:%X;", kind[b->type],
+			b->gdb_addr ? b->gdb_addr : addr);
+		snprintf(note, sizeof(note), "%04X: %s %05X\n", cpu6_pc(),
+			write ? "write" : "read", addr);
+		debug_stop(reply, note);
+		return;
+	}
+}
+
+/* Look for the debugger asking to stop the machine */
+static void debug_poll(struct event_t *event, int64_t late_ns)
+{
+#ifndef _WIN32
+	struct pollfd pfd;
+	int c;
+
+	pfd.fd = debug_fd;
+	pfd.events = POLLIN;
+	host_syscalls++;
+	while (poll(&pfd, 1, 0) == 1) {
+		c = debug_getc();
+		if (c == -1) {
+			debug_disconnect();
+			return;
+		}
+		if (c == 0x03) {
+			rev_mode = REV_NONE;
+			debug_stop("S02", "");
+			break;
+		}
+		host_syscalls++;
+	}
+#endif
+	debug_poll_evt.delta_ns = DEBUG_POLL_NS;
+	schedule_event(&debug_poll_evt);
+}
+
+/* Tell the debugger the machine has gone */
+void debug_exit(int status)
+{
+	char buf[8];
+
+	if (debug_fd == -1)
+		return;
+	snprintf(buf, sizeof(buf), "W%02X", status & 0xFF);
+	put_packet(buf);
+	close(debug_fd);
+	debug_fd = -1;
+}
+
+/* The queue went back with a checkpoint, but the poll carries on */
+static void debug_restored(void *arg)
+{
+	cancel_event(&debug_poll_evt);
+	if (debug_fd == -1)
+		return;
+	debug_poll_evt.delta_ns = DEBUG_POLL_NS;
+	schedule_event(&debug_poll_evt);
+}
+
+/* Wait for the debugger, which gets the machine stopped before it starts */
+void debug_init(unsigned short port)
+{
+	checkpoint_hook(debug_restored, NULL);
+	debug_fd = net_listen(port, "debugger");
+	debug_stop("S05", "");
+	debug_poll_evt.delta_ns = DEBUG_POLL_NS;
+	schedule_event(&debug_poll_evt);
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Set while there is anything for the CPU to check for */
+extern unsigned debug_armed;
+
+void debug_init(unsigned short port);
+void debug_exit(int status);
+int debug_check(uint16_t pc, unsigned bank);
+void debug_irq(unsigned ipl);
+void debug_watch(uint32_t addr, unsigned write);
@@ -1,9 +1,25 @@
+#include <stdarg.h>
 #include <stdio.h>
 
-#include "cpu6.h"
 #include "disassemble.h"
 
-/* Disassembler */
+/*
+ *	Disassembler
+ *
+ *	Works on a single instruction at a time, reading it through the
+ *	function it is given so that it can be used on the running machine
+ *	or on an image. As well as the text it gives the length and where
+ *	the instruction can go next, which is what cpu6dis follows. Operand
+ *	lengths follow cpu6.c, including its guesses.
+ */
+
+struct dis {
+	struct dis_insn *in;
+	uint16_t pc;		/* Next byte of the instruction */
+	uint8_t (*read)(uint16_t addr);
+	unsigned pos;
+	uint8_t twobit_reg;	/* See get_twobit() in cpu6.c */
+};
 
 static const char *r8map[16] = {
 	"AH", "AL",
@@ -39,149 +55,280 @@ static const char *r16name(unsigned n)
 	return r16map[n];
 }
 
-static uint16_t get8d(unsigned rpc)
+static void out(struct dis *d, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (d->pos >= DIS_TEXT - 1)
+		return;
+	va_start(ap, fmt);
+	n = vsnprintf(d->in->text + d->pos, DIS_TEXT - d->pos, fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		d->pos += n;
+	if (d->pos > DIS_TEXT - 1)
+		d->pos = DIS_TEXT - 1;
+}
+
+/* Not something the CPU runs, or not one we can follow */
+static void bad(struct dis *d)
+{
+	d->in->flow = DIS_BAD;
+}
+
+static uint8_t get8d(struct dis *d)
 {
-	return mmu_mem_read8_debug(rpc);
+	return d->read(d->pc++);
 }
-static uint16_t get16d(unsigned rpc)
+
+static uint16_t get16d(struct dis *d)
 {
-	uint16_t n = mmu_mem_read8_debug(rpc) << 8;
-	n |= mmu_mem_read8_debug(rpc + 1);
+	uint16_t n = get8d(d) << 8;
+	n |= get8d(d);
 	return n;
 }
 
-static void dis16d(unsigned rpc)
+static void dis16d(struct dis *d)
 {
-	uint16_t n = get16d(rpc);
-	fprintf(stderr, "%04X", n);
+	out(d, "%04X", get16d(d));
 }
 
-static void disindexed(unsigned rpc)
+static void disindexed(struct dis *d)
 {
-	unsigned r = mmu_mem_read8_debug(rpc);
+	unsigned r = get8d(d);
 	if (r & 4)
-		fputc('@', stderr);
+		out(d, "@");
 	if (r & 8)
-		fprintf(stderr, "%d", mmu_mem_read8_debug(rpc + 1));
+		out(d, "%d", (int8_t)get8d(d));
 	switch (r & 3) {
 	case 0:
-		fprintf(stderr, "(%s)", r16name(r >> 4));
+		out(d, "(%s)", r16name(r >> 4));
 		break;
 	case 1:
-		fprintf(stderr, "(%s+)", r16name(r >> 4));
+		out(d, "(%s+)", r16name(r >> 4));
 		break;
 	case 2:
-		fprintf(stderr, "(-%s)", r16name(r >> 4));
+		out(d, "(-%s)", r16name(r >> 4));
 		break;
 	case 3:
-		fprintf(stderr, "Bad indexing mode.");
+		out(d, "Bad indexing mode.");
+		bad(d);
 		break;
 	}
 }
 
-static void disaddr(unsigned rpc, unsigned size, unsigned op,
+/* The addressing modes of decode_address(), a jump gets its target */
+static void disaddr(struct dis *d, unsigned size, unsigned op,
 		    unsigned isjump)
 {
+	int8_t off;
+
 	switch (op) {
 	case 0:
 		if (size == 1)
-			fprintf(stderr, "%02X", mmu_mem_read8_debug(rpc));
+			out(d, "%02X", get8d(d));
 		else
-			dis16d(rpc);
+			dis16d(d);
 		break;
 	case 1:
 		if (!isjump)
-			fputc('(', stderr);
-		dis16d(rpc);
+			out(d, "(");
+		d->in->target = d->read(d->pc) << 8 | d->read(d->pc + 1);
+		dis16d(d);
 		if (!isjump)
-			fputc(')', stderr);
+			out(d, ")");
 		break;
 	case 2:
 		if (!isjump)
-			fputc('@', stderr);
-		fputc('(', stderr);
-		dis16d(rpc);
-		fputc(')', stderr);
+			out(d, "@");
+		out(d, "(");
+		dis16d(d);
+		out(d, ")");
 		break;
 	case 3:
-		fprintf(stderr, "(PC+%d)", (int8_t) mmu_mem_read8_debug(rpc));
+		off = get8d(d);
+		d->in->target = (uint16_t)(d->pc + off);
+		out(d, "(PC+%d)", off);
 		break;
 	case 4:
-		fprintf(stderr, "@(PC+%d)", (int8_t) mmu_mem_read8_debug(rpc));
+		out(d, "@(PC+%d)", (int8_t)get8d(d));
 		break;
 	case 5:
-		disindexed(rpc);
+		disindexed(d);
 		break;
 	case 6:
 	case 7:
-		fprintf(stderr, "invalid address decode.");
+		out(d, "invalid address decode.");
+		bad(d);
 		break;
 	default:
-		fprintf(stderr, "(%s)", r16name((op & 0x07) << 1));
+		out(d, "(%s)", r16name((op & 0x07) << 1));
+		break;
+	}
+}
+
+/*
+ *	The operands of the block, bignum and MMU instructions. A literal is
+ *	len bytes long, -1 if that comes from a register at run time.
+ */
+static void twobit(struct dis *d, unsigned mode, unsigned idx, int len)
+{
+	unsigned regs;
+	uint16_t n;
+	int i;
+
+	switch ((idx == 0 ? mode >> 2 : mode) & 3) {
+	case 0:
+		out(d, "(%04X)", get16d(d));
+		break;
+	case 1:
+		regs = get8d(d);
+		n = (regs & 0x10) ? get16d(d) : get8d(d);
+		if (regs & 0x0E)
+			out(d, "%X(%s,%s)", n, r16name((regs >> 4) & 0x0E),
+				r16name(regs & 0x0E));
+		else
+			out(d, "%X(%s)", n, r16name((regs >> 4) & 0x0E));
+		break;
+	case 2:
+		if (idx == 1 && mode == 0x0A)
+			regs = d->twobit_reg;
+		else
+			d->twobit_reg = regs = get8d(d);
+		if (idx == 0)
+			regs >>= 4;
+		out(d, "(%s)", r16name(regs & 0x0E));
+		break;
+	case 3:
+		if (len < 0) {
+			out(d, "=?");
+			bad(d);
+			break;
+		}
+		out(d, "=");
+		for (i = 0; i < len; i++) {
+			if (i < 4)
+				out(d, "%02X", d->read(d->pc));
+			d->pc++;
+		}
+		if (len > 4)
+			out(d, "..");
 		break;
 	}
-	fputc('\n', stderr);
 }
 
 static const char *dmaname[4] = { "STDMA", "LDDMA", "STDMAC", "LDDMAC" };
 
-static void dis_dma(unsigned addr)
+static void dis_dma(struct dis *d)
 {
-	unsigned dmaop = mmu_mem_read8_debug(addr);
+	unsigned dmaop = get8d(d);
 	unsigned rp = dmaop >> 4;
 	dmaop &= 15;
 	if (dmaop == 5 || dmaop > 6) {
-		fprintf(stderr, "DMA unknown(%d), %s\n", dmaop, r16name(rp));
+		out(d, "DMA unknown(%d), %s", dmaop, r16name(rp));
+		if (dmaop > 9)
+			bad(d);
 		return;
 	}
 	if (dmaop < 4)
-		fprintf(stderr, "%s %s\n", dmaname[dmaop], r16name(rp));
+		out(d, "%s %s", dmaname[dmaop], r16name(rp));
 	else if (dmaop == 4)
-		fprintf(stderr, "dmamode %d\n", rp);
+		out(d, "dmamode %d", rp);
 	else
-		fprintf(stderr, "dmaen\n");
+		out(d, "dmaen");
 }
 
-static void dis_mmu(unsigned addr)
+/* 2E, see mmu_transfer_op() */
+static void dis_mmu(struct dis *d)
 {
-	unsigned op;
-
-	op = mmu_mem_read8_debug(addr);
-	switch(op) {
-	case 0x0C:
-		fprintf(stderr, "LDMMU %d (%04X)\n",
-			mmu_mem_read8_debug(addr + 1) & 7,
-			get16d(addr + 2));
-		break;
-	case 0x1C:
-		fprintf(stderr, "STMMU %d (%04X)\n",
-			mmu_mem_read8_debug(addr + 1) & 7,
-			get16d(addr + 2));
-		break;
-	default:
-		fprintf(stderr, "Unknown MMU op %02X\n", op);
-		break;
+	static const char *suffix[] = { "", "1", "32" };
+	unsigned subop = get8d(d);
+	int len = -1;
+	unsigned x;
+
+	if (subop >= 0x60) {
+		out(d, "Unknown MMU op %02X", subop);
+		bad(d);
+		return;
 	}
+	out(d, "%s%s ", (subop & 0x10) ? "RPF" : "WPF", suffix[subop >> 5]);
+	/* How many entries is only known when the first is a literal */
+	if ((subop & 0x0C) == 0x0C) {
+		x = d->read(d->pc) >> 3;
+		len = (subop & 0xE0) == 0x00 ? x + 1
+			: (subop & 0xE0) == 0x20 ? 1 : 32 - x;
+	} else if ((subop & 0xE0) == 0x20)
+		len = 1;
+	twobit(d, subop, 0, 1);
+	out(d, ", ");
+	twobit(d, subop, 1, len);
 }
 
-static void dis_block_op(unsigned addr)
+static const char *blockname[16] = {
+	"bload", NULL, "bcpc", NULL, "bcp", NULL, "bor", "band",
+	"bcmp", "bfill", NULL, NULL, NULL, NULL, NULL, NULL
+};
+
+/* 47 takes the length as a literal, 67 from AL */
+static void dis_block_op(struct dis *d, unsigned inst)
 {
-	unsigned op = mmu_mem_read8_debug(addr);
-	switch(op) {
-	case 0x40:
-		fprintf(stderr, "bcp ");
-		break;
-	case 0x80:
-		fprintf(stderr, "bcmp ");
-		break;
-	default:
-		fprintf(stderr, "Unknown 0x47 op %02X\n", op);
+	unsigned op = get8d(d);
+	unsigned am = op & 0x0F;
+	int len = -1;
+
+	if (blockname[op >> 4] == NULL) {
+		out(d, "Unknown 0x%02X op %02X", inst, op);
+		bad(d);
+		return;
+	}
+	out(d, "%s ", blockname[op >> 4]);
+	if ((op & 0xF0) == 0x00)
+		len = 1;
+	else if (inst == 0x47) {
+		len = get8d(d) + 1;
+		out(d, "%02X, ", len);
+	} else
+		out(d, "AL, ");
+	if ((op & 0xF0) == 0x20) {
+		if (inst == 0x67) {
+			bad(d);
+			return;
+		}
+		out(d, "'%c', ", get8d(d) & 0x7F);
+	}
+	twobit(d, am, 0, (op & 0xF0) == 0x90 ? 1 : len);
+	out(d, ", ");
+	twobit(d, am, 1, len);
+}
+
+static const char *bignumname[16] = {
+	"ADDBIG", "SUBBIG", "CMPBIG", "MULBIG", "DIVBIG", NULL, NULL, NULL,
+	"ATOBIG", "BIGTOA", NULL, NULL, NULL, NULL, NULL, NULL
+};
+
+/* 46, see bignum_op() */
+static void dis_bignum(struct dis *d)
+{
+	unsigned sizes = get8d(d);
+	unsigned mode = get8d(d);
+	int a_size = (sizes >> 4) + 1;
+	int b_size = (sizes & 0x0F) + 1;
+
+	if (bignumname[mode >> 4] == NULL) {
+		out(d, "Unknown 46 op %02X", mode);
+		bad(d);
 		return;
 	}
-	fprintf(stderr, "%02X, (%04X), (%04X)\n",
-		mmu_mem_read8_debug(addr + 1) + 1,
-		get16d(addr + 2),
-		get16d(addr + 4));
+	/* The conversions have a base and the ASCII side is AL long */
+	if ((mode >> 4) >= 8) {
+		out(d, "%s %d, %d, ", bignumname[mode >> 4], a_size + 1, b_size);
+		a_size = -1;
+	} else
+		out(d, "%s %d/%d, ", bignumname[mode >> 4], a_size, b_size);
+	twobit(d, mode, 0, a_size);
+	out(d, ", ");
+	twobit(d, mode, 1, b_size);
 }
 
 static const char *op0name[] = {
@@ -209,167 +356,284 @@ static const char *ldst[] = {
 	"STBB ", "STB "
 };
 
-static void stack_op(const char *op, unsigned rpc)
+static void stack_op(struct dis *d, const char *op)
 {
-        uint8_t byte2 = mmu_mem_read8_debug(rpc);
-        uint8_t r = byte2 >> 4;
-        uint8_t end = r + (byte2 & 0x0F) + 1;
-        const char* s = "";
-
-        fprintf(stderr, "%s {", op);
-
-        if (r & 1) {
-                fputs(r8map[r], stderr);
-                s = ",";
-        }
-        while (r + 1 < end) {
-                fprintf(stderr, "%s%s", s, r16map[r]);
-                s = ",";
-                r += 2;
-        }
-        if (r < end) {
-                fprintf(stderr, "%s%s", s, r8map[r]);
-        }
-        fputs("}\n", stderr);
+	uint8_t byte2 = get8d(d);
+	uint8_t r = byte2 >> 4;
+	uint8_t end = r + (byte2 & 0x0F) + 1;
+	const char *s = "";
+
+	out(d, "%s {", op);
+
+	if (r & 1) {
+		out(d, "%s", r8map[r]);
+		s = ",";
+		r++;
+	}
+	while (r + 1 < end) {
+		out(d, "%s%s", s, r16map[r & 0x0F]);
+		s = ",";
+		r += 2;
+	}
+	if (r < end)
+		out(d, "%s%s", s, r8map[r & 0x0F]);
+	out(d, "}");
 }
 
-void disassemble(unsigned op)
+/* 50-55 and 77/78, see alu5x_op() */
+static void dis_alu5(struct dis *d, const char *name)
 {
-	unsigned rpc = cpu6_pc() + 1;
+	uint8_t v = get8d(d);
+	uint8_t f = v & 0x11;
+
+	v &= 0xEE;
+	switch (f) {
+	case 0x00:
+		out(d, "%s %s, %s", name, r16name(v >> 4), r16name(v));
+		break;
+	case 0x01:
+		out(d, "%s %s, (%X)", name, r16name(v >> 4), get16d(d));
+		break;
+	case 0x10:
+		out(d, "%s %s, %X", name, r16name(v >> 4), get16d(d));
+		break;
+	case 0x11:
+		out(d, "%s (%X), %s", name, get16d(d), r16name(v));
+		break;
+	}
+}
+
+static void decode(struct dis *d, unsigned op)
+{
+	uint8_t v;
+	int8_t off;
+
 	if (op < 0x10) {
-		fprintf(stderr, "%s\n", op0name[op]);
+		out(d, "%s", op0name[op]);
+		if (op == 0x00)
+			d->in->flow = DIS_HALT;
+		else if (op == 0x09 || op == 0x0F)
+			d->in->flow = DIS_RETURN;
+		/* The level's PC is left after RI, handlers jump back after it */
+		else if (op == 0x0A || op == 0x0B)
+			d->in->flow = DIS_RESUME;
 		return;
 	}
 	if (op < 0x20) {
-		fprintf(stderr, "%s %d\n", braname[op & 0x0F],
-			mmu_mem_read8_debug(rpc));
+		off = get8d(d);
+		d->in->flow = DIS_BRANCH;
+		d->in->target = (uint16_t)(d->pc + off);
+		out(d, "%s %d", braname[op & 0x0F], (uint8_t)off);
 		return;
 	}
 	if (op < 0x28) {
-		uint8_t v = mmu_mem_read8_debug(rpc);
-		fprintf(stderr, "%sB %s", alu1name[op & 7],
-			r8name(v >> 4));
+		v = get8d(d);
+		out(d, "%sB %s", alu1name[op & 7], r8name(v >> 4));
 		if (v & 0x0F)
-			fprintf(stderr, ", %d", v & 0x0F);
-		fprintf(stderr, "\n");
+			out(d, ", %d", v & 0x0F);
 		return;
 	}
 	if (op < 0x2E) {
-		fprintf(stderr, "%s AL\n", alu1name[op & 7]);
+		out(d, "%s AL", alu1name[op & 7]);
 		return;
 	}
 	if (op == 0x2E) {
-		dis_mmu(rpc);
+		dis_mmu(d);
 		return;
 	}
 	if (op == 0x2F) {
-		dis_dma(rpc);
+		dis_dma(d);
 		return;
 	}
-	/* TODO DMA 2E MMU 2F */
 	if (op < 0x38) {
-		uint8_t v = mmu_mem_read8_debug(rpc);
-		fprintf(stderr, "%s %s", alu1name[op & 7],
-			r16name(v >> 4));
+		v = get8d(d);
+		if (v & 0x10) {
+			/* Read-modify-write on memory, indexed unless A */
+			out(d, "%s (%04X", alu1name[op & 7], get16d(d));
+			if ((v >> 4) & 0x0E)
+				out(d, "+%s", r16name((v >> 4) & 0x0E));
+			out(d, ")");
+		} else
+			out(d, "%s %s", alu1name[op & 7], r16name(v >> 4));
 		if (v & 0x0F)
-			fprintf(stderr, ", %d", v & 0x0F);
-		fprintf(stderr, "\n");
+			out(d, ", %d", v & 0x0F);
 		return;
 	}
 	if (op < 0x3E) {
-		fprintf(stderr, "%s A\n", alu1name[op & 7]);
+		out(d, "%s A", alu1name[op & 7]);
 		return;
 	}
 	if (op == 0x3E) {
-		fputs("INX\n", stderr);
+		out(d, "INX");
 		return;
 	}
 	if (op == 0x3F) {
-		fputs("DCX\n", stderr);
+		out(d, "DCX");
 		return;
 	}
 	if (op < 0x46) {
-		uint8_t v = mmu_mem_read8_debug(rpc);
-		fprintf(stderr, "%sB %s, %s\n", alu2name[op & 7],
-			r8name(v >> 4), r8name(v));
+		v = get8d(d);
+		out(d, "%sB %s, %s", alu2name[op & 7], r8name(v >> 4),
+			r8name(v));
+		return;
+	}
+	if (op == 0x46) {
+		dis_bignum(d);
 		return;
 	}
 	if (op == 0x47) {
-		dis_block_op(rpc);
+		dis_block_op(d, op);
+		return;
+	}
+	if (op < 0x4B) {
+		out(d, "%sB AL,BL", alu2name[op & 7]);
 		return;
 	}
-	/* TODO 46 47 */
 	if (op < 0x4E) {
-		fprintf(stderr, "%sB AL,BL\n", alu2name[op & 7]);
+		out(d, "XFRB AL,%s", op == 0x4B ? "XL" : op == 0x4C ? "YL" : "BL");
+		return;
+	}
+	if (op < 0x50) {
+		out(d, "Unknown ALU4 op %02X", op);
+		bad(d);
 		return;
 	}
-	/* 4E 4F mystery */
 	if (op < 0x56) {
-		uint8_t v = mmu_mem_read8_debug(rpc);
-		uint8_t f = v & 0x11;
-		v &= 0xEE;
-		switch(f) {
-		case 0x00:
-			fprintf(stderr, "%s %s, %s\n", alu2name[op & 7],
-				r16name(v >> 4), r16name(v));
-			break;
-		case 0x01:
-			fprintf(stderr, "%s %s, (%X)\n", alu2name[op & 7],
-				r16name(v >> 4), get16d(rpc + 1));
-			break;
-		case 0x10:
-			fprintf(stderr, "%s %s, %X\n", alu2name[op & 7],
-				r16name(v >> 4), get16d(rpc + 1));
-			break;
-		case 0x11:
-			fprintf(stderr, "%s (%X), %s\n", alu2name[op & 7],
-				get16d(rpc + 1), r16name(v));
-			break;
-		}
+		dis_alu5(d, alu2name[op & 7]);
+		return;
+	}
+	if (op < 0x58) {
+		out(d, "Unknown ALU5 op %02X", op);
+		bad(d);
 		return;
 	}
-	/* TODO 46 47 */
 	if (op < 0x5B) {
-		fprintf(stderr, "%s A,B\n", alu2name[op & 7]);
+		out(d, "%s A,B", alu2name[op & 7]);
 		return;
 	}
 	if (op < 0x60) {
-		fprintf(stderr, "XA%c\n", "XYBZS"[op - 0x5B]);
+		out(d, "XA%c", "XYBZS"[op - 0x5B]);
 		return;
 	}
 	if (op == 0x66) {
-		fprintf(stderr, "JSYS %02X\n", get8d(rpc));
+		/* To 0100 in map 0 and back with RSYS */
+		d->in->flow = DIS_CALL;
+		out(d, "JSYS %02X", get8d(d));
+		return;
+	}
+	if (op == 0x67) {
+		dis_block_op(d, op);
+		return;
+	}
+	if (op == 0x6F) {
+		out(d, "STCC (%04X)", get16d(d));
 		return;
 	}
 	if (op < 0x70) {
 		/* X ops */
 		if (op & 0x08)
-			fputs("STX ", stderr);
+			out(d, "STX ");
 		else
-			fputs("LDX ", stderr);
-		disaddr(rpc, 2, op & 7, 1);
-		return;
-	}
-        if (op == 0x7e) {
-                stack_op("PUSH", rpc);
-                return;
-        }
-        if (op == 0x7f) {
-                stack_op("POP", rpc);
-                return;
-        }
+			out(d, "LDX ");
+		disaddr(d, 2, op & 7, 1);
+		d->in->target = -1;
+		return;
+	}
+	if (op == 0x7E) {
+		stack_op(d, "PUSH");
+		return;
+	}
+	if (op == 0x7F) {
+		stack_op(d, "POP");
+		return;
+	}
+	if (op == 0x77 || op == 0x78) {
+		dis_alu5(d, op == 0x77 ? "MUL" : "DIV");
+		return;
+	}
 	if (op < 0x80) {
 		if (op == 0x76) {
-			fputs("SYSCALL?\n", stderr);
+			out(d, "SYSCALL?");
 			return;
 		}
-		if (op & 0x08)
-			fputs("JSR ", stderr);
-		else
-			fputs("JMP ", stderr);
-		disaddr(rpc, 2, op & 7, 0);
+		if (op & 0x08) {
+			out(d, "JSR ");
+			d->in->flow = DIS_CALL;
+		} else {
+			out(d, "JMP ");
+			d->in->flow = DIS_JUMP;
+		}
+		/* Jumping into its own operand is no use to anyone */
+		if ((op & 7) == 0)
+			bad(d);
+		disaddr(d, 2, op & 7, 0);
+		return;
+	}
+	switch (op) {
+	case 0xB6:
+		out(d, "SEMSET");
+		return;
+	case 0xC6:
+		out(d, "SEMCLR");
+		return;
+	case 0xD6:
+		/* See store16() */
+		v = get8d(d);
+		switch (v & 0x11) {
+		case 0x00:
+			out(d, "STW %s, %s", r16name(v & 0x0E), r16name((v >> 4) & 0x0E));
+			break;
+		case 0x01:
+			out(d, "STW %s, (%04X)", r16name(v & 0x0E), get16d(d));
+			break;
+		case 0x10:
+			out(d, "STW %s, =%04X", r16name(v & 0x0E), get16d(d));
+			break;
+		case 0x11:
+			out(d, "STW %s, %X(%s)", r16name(v & 0x0E), get16d(d),
+				r16name((v >> 4) & 0x0E));
+			break;
+		}
+		return;
+	case 0xD7:
+	case 0xE6:
+		v = get8d(d);
+		out(d, "%s %d, %s", op == 0xD7 ? "STIL" : "LDIL", v >> 4,
+			r16name(v));
+		return;
+	case 0xF6:
+		/* See cpu6_indexed_loadstore() */
+		v = get8d(d);
+		off = get8d(d);
+		out(d, "%s%s %s, %d(%s)", (v & 0x01) ? "STIO" : "LDIO",
+			(v & 0x10) ? "B" : "", (v & 0x10) ? r8name(v >> 4)
+			: r16name(v >> 4), off, r16name(v & 0x0E));
+		return;
+	case 0xF7:
+		out(d, "bcp16 A, (B), (Y)");
 		return;
 	}
-	fputs(ldst[(op & 0x7F) >> 4], stderr);
-	disaddr(rpc, (op & 0x10) ? 2 : 1, op & 15, 0);
+	out(d, "%s", ldst[(op & 0x7F) >> 4]);
+	disaddr(d, (op & 0x10) ? 2 : 1, op & 15, 0);
+	d->in->target = -1;
+}
+
+unsigned dis_decode(struct dis_insn *in, uint16_t addr,
+		    uint8_t (*read)(uint16_t addr))
+{
+	struct dis d;
+
+	d.in = in;
+	d.pc = addr;
+	d.read = read;
+	d.pos = 0;
+	d.twobit_reg = 0;
+
+	in->addr = addr;
+	in->flow = DIS_NEXT;
+	in->target = -1;
+	*in->text = 0;
+	decode(&d, get8d(&d));
+	in->len = (uint16_t)(d.pc - addr);
+	return in->len;
 }
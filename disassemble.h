@@ -1 +1,27 @@
-void disassemble(unsigned op);
+#pragma once
+
+#include <stdint.h>
+
+/* Where an instruction goes next */
+#define DIS_NEXT	0	/* On to the following instruction */
+#define DIS_BRANCH	1	/* To the target or on to the following one */
+#define DIS_JUMP	2	/* To the target */
+#define DIS_CALL	3	/* To the target and back to the following one */
+#define DIS_RETURN	4
+#define DIS_HALT	5
+#define DIS_BAD		6	/* Not known, or its length is only known at run time */
+#define DIS_RESUME	7	/* Off the level, on to the following one when back */
+
+#define DIS_TEXT	80
+
+struct dis_insn {
+	uint16_t addr;
+	unsigned len;
+	unsigned flow;
+	int target;		/* -1 if only known at run time */
+	char text[DIS_TEXT];
+};
+
+/* Decode the instruction at addr, returns its length */
+unsigned dis_decode(struct dis_insn *in, uint16_t addr,
+		    uint8_t (*read)(uint16_t addr));
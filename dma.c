@@ -0,0 +1,378 @@
+/*
+ *	DMA engine and arbiter
+ *
+ *	There is one DMA engine, on the CPU card, and the controllers take
+ *	turns with it. The CPU loads an address and a count, the count being
+ *	the ones complement of the length, and enables it. Each byte moved
+ *	bumps both.
+ *
+ *	A transfer into memory stops with the count at FFFF, after the
+ *	length asked for. One out of memory runs on to 0000, a byte further.
+ *	That is how the controllers have always been driven here and nothing
+ *	yet says otherwise. Into memory goes to the physical address, out of
+ *	memory through the MMU, which likewise is what has always been done
+ *	rather than anything known.
+ *
+ *	Bus masters come in two kinds. A controller with a buffer of its own
+ *	(the FDC and CMD) asks for a transfer on its channel once the guest
+ *	has set the engine up. The arbiter then moves the data from a
+ *	scheduler event, a burst at a time, spaced at the rate the controller
+ *	takes or supplies bytes, and calls the channel back when the count
+ *	runs out. The CPU runs meanwhile, losing a memory cycle for each byte
+ *	moved. A channel that asks while another one has the engine waits its
+ *	turn.
+ *
+ *	The Hawk can't wait for anything so it holds the bus for as long as
+ *	its transfer lasts, stopping the CPU, and moves each byte as it comes
+ *	off the disk. Bursts for other channels wait until it lets go.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "checkpoint.h"
+#include "cpu6.h"
+#include "dma.h"
+#include "scheduler.h"
+#include "stats.h"
+
+static uint16_t dma_addr;
+static uint16_t dma_cnt;
+static uint8_t dma_mod;
+static uint8_t dma_enable;
+static uint8_t dma_myst;	/* We don't know what this reg on the AM2901 is
+				   about */
+
+static struct dma_channel *dma_owner;
+static struct dma_channel *dma_waiting;
+static struct dma_channel *dma_holder;
+
+void dma_init(void)
+{
+	CHECKPOINT(dma_addr);
+	CHECKPOINT(dma_cnt);
+	CHECKPOINT(dma_mod);
+	CHECKPOINT(dma_enable);
+	CHECKPOINT(dma_myst);
+	CHECKPOINT(dma_owner);
+	CHECKPOINT(dma_waiting);
+	CHECKPOINT(dma_holder);
+}
+
+/* Checkpoints keep the arbiter's state for the channel, the scheduler
+   looks after its event */
+void dma_checkpoint(struct dma_channel *ch)
+{
+	checkpoint_register(&ch->dir, offsetof(struct dma_channel, evt)
+		- offsetof(struct dma_channel, dir));
+}
+
+void dma_set_address(uint16_t addr)
+{
+	dma_addr = addr;
+}
+
+uint16_t dma_address(void)
+{
+	return dma_addr;
+}
+
+void dma_set_count(uint16_t count)
+{
+	dma_cnt = count;
+}
+
+uint16_t dma_count(void)
+{
+	return dma_cnt;
+}
+
+void dma_set_mode(uint8_t mode)
+{
+	dma_mod = mode;
+}
+
+uint8_t dma_mode(void)
+{
+	return dma_mod;
+}
+
+void dma_set_enable(unsigned on)
+{
+	dma_enable = on;
+}
+
+void dma_set_mystery(uint8_t val)
+{
+	dma_myst = val;
+}
+
+uint8_t dma_mystery(void)
+{
+	return dma_myst;
+}
+
+int dma_active(void)
+{
+	return dma_enable;
+}
+
+/* The count ran out. Tell whoever holds the bus, once they are done with
+   the byte in hand */
+static void dma_finished(void)
+{
+	dma_enable = 0;
+	if (dma_holder)
+		schedule_event(&dma_holder->evt);
+}
+
+/* Bytes left before the count runs out */
+static unsigned dma_left(unsigned into)
+{
+	if (!dma_enable)
+		return 0;
+	if (into)
+		return 0xFFFF - dma_cnt;
+	return 0x10000 - dma_cnt;
+}
+
+int dma_put(uint8_t byte)
+{
+	if (!dma_enable)
+		return 0;
+	mem_write8(dma_addr++, byte);
+	stats.dma_bytes++;
+	if (++dma_cnt == 0xFFFF)
+		dma_finished();
+	return 1;
+}
+
+int dma_get(uint8_t *byte)
+{
+	if (!dma_enable)
+		return 0;
+	*byte = mmu_mem_read8(dma_addr++);
+	stats.dma_bytes++;
+	if (++dma_cnt == 0)
+		dma_finished();
+	return 1;
+}
+
+/* Up to the end of the count and no further than the 2K page */
+static unsigned dma_run(unsigned into, unsigned len)
+{
+	unsigned n = 0x800 - (dma_addr & 0x7FF);
+
+	if (n > len)
+		n = len;
+	if (n > dma_left(into))
+		n = dma_left(into);
+	return n;
+}
+
+unsigned dma_put_block(const uint8_t *buf, unsigned len)
+{
+	unsigned done = 0;
+	unsigned n;
+	uint8_t *p;
+
+	while ((n = dma_run(1, len - done)) != 0) {
+		p = mem_map_ram(dma_addr, n, 1);
+		if (p == NULL) {
+			dma_put(buf[done++]);
+			continue;
+		}
+		memcpy(p, buf + done, n);
+		done += n;
+		dma_addr += n;
+		stats.dma_bytes += n;
+		if ((dma_cnt += n) == 0xFFFF)
+			dma_finished();
+	}
+	return done;
+}
+
+unsigned dma_get_block(uint8_t *buf, unsigned len)
+{
+	unsigned done = 0;
+	unsigned n;
+	uint8_t *p;
+
+	while ((n = dma_run(0, len - done)) != 0) {
+		p = mmu_map_ram(dma_addr, n, 0);
+		if (p == NULL) {
+			dma_get(buf + done++);
+			continue;
+		}
+		mmu_parity_read(dma_addr, n);
+		memcpy(buf + done, p, n);
+		done += n;
+		dma_addr += n;
+		stats.dma_bytes += n;
+		if ((dma_cnt += n) == 0)
+			dma_finished();
+	}
+	return done;
+}
+
+static void dma_event(struct event_t *event, int64_t late_ns);
+static void dma_hold_event(struct event_t *event, int64_t late_ns);
+
+static void dma_grant(struct dma_channel *ch)
+{
+	dma_owner = ch;
+	ch->finished = 0;
+	ch->evt.name = ch->name;
+	ch->evt.callback = dma_event;
+	ch->evt.delta_ns = 0;
+	schedule_event(&ch->evt);
+}
+
+static void dma_next(void)
+{
+	struct dma_channel *ch = dma_waiting;
+
+	dma_owner = NULL;
+	if (ch) {
+		dma_waiting = ch->next;
+		ch->next = NULL;
+		dma_grant(ch);
+	}
+}
+
+/*
+ *	Move a burst between memory and the channel's buffer, returns how
+ *	many bytes went. Anything past the end of the buffer is lost going
+ *	in and reads as FF coming out, but still uses up the count.
+ */
+static unsigned dma_burst(struct dma_channel *ch)
+{
+	static uint8_t spill[256];
+	unsigned want = ch->burst;
+	unsigned room = ch->size - *ch->ptr;
+	unsigned n;
+
+	if (want > room)
+		want = room;
+	if (ch->dir == DMA_TO_DEVICE)
+		n = dma_get_block(ch->buf + *ch->ptr, want);
+	else
+		n = dma_put_block(ch->buf + *ch->ptr, want);
+	*ch->ptr += n;
+
+	if (dma_active() && n < ch->burst && *ch->ptr == ch->size) {
+		want = ch->burst - n;
+		if (want > sizeof(spill))
+			want = sizeof(spill);
+		fprintf(stderr, "%04X: overlong %s transfer\n", cpu6_pc(),
+			ch->name);
+		if (ch->dir == DMA_TO_DEVICE) {
+			n += dma_get_block(spill, want);
+		} else {
+			memset(spill, 0xFF, want);
+			n += dma_put_block(spill, want);
+		}
+	}
+	if (!dma_active())
+		ch->finished = 1;
+	return n;
+}
+
+static void dma_event(struct event_t *event, int64_t late_ns)
+{
+	struct dma_channel *ch = dma_owner;
+	unsigned n;
+
+	/* The Hawk has the bus, go again when it lets go. Only the grant
+	   can get here, dma_hold takes a burst off the queue. */
+	if (dma_holder)
+		return;
+	/* The last burst has had time to arrive */
+	if (ch->finished) {
+		dma_next();
+		ch->done();
+		return;
+	}
+	n = dma_burst(ch);
+	/* The CPU loses the bus for a memory cycle a byte */
+	advance_time((uint64_t)n * MEM_CYCLES * CYCLE_NS);
+	if (ch->finished && n == 0) {
+		dma_next();
+		ch->done();
+		return;
+	}
+	ch->evt.delta_ns = (int64_t)n * ch->byte_ns;
+	schedule_event(&ch->evt);
+}
+
+/* Queue a burst transfer on the channel, replacing any it already has */
+void dma_request(struct dma_channel *ch, unsigned dir)
+{
+	struct dma_channel **p;
+
+	dma_release(ch);
+	ch->dir = dir;
+	if (dma_owner == NULL) {
+		dma_grant(ch);
+		return;
+	}
+	for (p = &dma_waiting; *p; p = &(*p)->next)
+		;
+	*p = ch;
+}
+
+static void dma_hold_event(struct event_t *event, int64_t late_ns)
+{
+	dma_holder->done();
+}
+
+/* Take the bus until the count runs out or the channel lets go */
+void dma_hold(struct dma_channel *ch)
+{
+	if (dma_holder == ch)
+		return;
+	dma_holder = ch;
+	/* The owner's next burst waits for the bus, dma_release sets it
+	   going again */
+	if (dma_owner)
+		cancel_event(&dma_owner->evt);
+	ch->evt.name = ch->name;
+	ch->evt.callback = dma_hold_event;
+	ch->evt.delta_ns = 0;
+	if (!dma_enable)
+		schedule_event(&ch->evt);
+}
+
+void dma_release(struct dma_channel *ch)
+{
+	struct dma_channel **p;
+
+	if (dma_holder == ch) {
+		cancel_event(&ch->evt);
+		dma_holder = NULL;
+		if (dma_owner) {
+			dma_owner->evt.delta_ns = 0;
+			schedule_event(&dma_owner->evt);
+		}
+		return;
+	}
+	if (dma_owner == ch) {
+		cancel_event(&ch->evt);
+		dma_next();
+		return;
+	}
+	for (p = &dma_waiting; *p; p = &(*p)->next) {
+		if (*p == ch) {
+			*p = ch->next;
+			ch->next = NULL;
+			return;
+		}
+	}
+}
+
+/* Something has the bus and the CPU must wait */
+int dma_bus_held(void)
+{
+	return dma_holder != NULL;
+}
@@ -1 +1,58 @@
-void hawk_set_dma(unsigned mode);
+#pragma once
+
+#include <stdint.h>
+
+#include "scheduler.h"
+
+/* The engine registers, as the CPU sees them (2F xx) */
+void dma_set_address(uint16_t addr);
+uint16_t dma_address(void);
+void dma_set_count(uint16_t count);
+uint16_t dma_count(void);
+void dma_set_mode(uint8_t mode);
+uint8_t dma_mode(void);
+void dma_set_enable(unsigned on);
+void dma_set_mystery(uint8_t val);
+uint8_t dma_mystery(void);
+int dma_active(void);
+
+/*
+ *	Moving data for a bus master. Each returns how much it moved, which
+ *	is short once the count runs out.
+ */
+int dma_put(uint8_t byte);			/* Into memory */
+int dma_get(uint8_t *byte);			/* Out of memory */
+unsigned dma_put_block(const uint8_t *buf, unsigned len);
+unsigned dma_get_block(uint8_t *buf, unsigned len);
+
+/*
+ *	A bus master. A controller with a buffer of its own fills in the
+ *	buffer, its size and where in it the transfer is, and the arbiter
+ *	moves the data in bursts. One that streams data itself, like the
+ *	Hawk, just needs the name and done.
+ */
+struct dma_channel {
+	const char *name;
+	unsigned byte_ns;		/* Time per byte at the controller */
+	unsigned burst;			/* Most bytes moved at once */
+	uint8_t *buf;
+	unsigned size;
+	unsigned *ptr;
+	void (*done)(void);		/* Count ran out */
+
+	/* Arbiter state */
+	unsigned dir;
+	unsigned finished;
+	struct dma_channel *next;
+	struct event_t evt;
+};
+
+#define DMA_TO_DEVICE	1
+#define DMA_FROM_DEVICE	2
+
+void dma_init(void);
+void dma_checkpoint(struct dma_channel *ch);
+void dma_request(struct dma_channel *ch, unsigned dir);
+void dma_hold(struct dma_channel *ch);
+void dma_release(struct dma_channel *ch);
+int dma_bus_held(void);
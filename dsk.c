@@ -1,19 +1,15 @@
 #include <assert.h>
-#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
-#include <unistd.h>
 
+#include "checkpoint.h"
 #include "cpu6.h"
 #include "dma.h"
 #include "dsk.h"
 #include "hawk.h"
+#include "hawk_image.h"
 #include "scheduler.h"
 
-#ifndef O_BINARY
-#define O_BINARY 0
-#endif
-
 /* DSK: A controller for the CDC 9427H "Hawk" drive
  *
  * Split across two cards: DSK/AUT and DSKII
@@ -37,7 +33,12 @@
  *	the Fin Fout Busy style interface and sequencer but something smarter
  *	of its own.
  *
- *
+ *	Seeks overlap. A seek or RTZ keeps the controller busy only until a
+ *	new command comes along, and a seek for another drive can be started
+ *	in the middle of a transfer. Either way the seek finishes on its own
+ *	and shows up in the per-drive seek complete status bits. Any other
+ *	command issued during a transfer is queued, with the unit and address
+ *	it was issued with, and started when the controller goes idle.
  */
 
 /* I've taken the number from the ceiling */
@@ -55,6 +56,31 @@ static uint8_t dsk_write_mask;
 static uint16_t dsk_cylinder;
 static uint8_t  dsk_head;
 static uint8_t  dsk_sector;
+static unsigned dsk_addr_written;	// F141/F142 written since the last command
+
+#define DSK_CMD_READ	0
+#define DSK_CMD_WRITE	1
+#define DSK_CMD_SEEK	2
+#define DSK_CMD_RTZ	3
+
+// A command, with the unit and address registers as they were when it
+// was issued
+struct dsk_command {
+	uint8_t cmd;
+	uint8_t unit;
+	uint16_t cylinder;
+	uint8_t head;
+	uint8_t sector;
+};
+
+// The command the state machine is running
+static struct dsk_command dsk_active;
+
+#define DSK_QUEUE_LEN	4
+
+static struct dsk_command dsk_queue[DSK_QUEUE_LEN];
+static unsigned dsk_queue_head;
+static unsigned dsk_queue_len;
 
 static unsigned dsk_interrupt_enabled;
 static unsigned dsk_interrupt_ack;
@@ -104,7 +130,8 @@ static uint8_t dsk_seek_complete;
 
 static struct hawk_drive hawk[NUM_HAWK_DRIVES];
 
-static void dsk_seek(unsigned trace);
+static int dsk_start_seek(const struct dsk_command *c, unsigned trace);
+static void dsk_start(const struct dsk_command *c, unsigned trace);
 static void dsk_update_status();
 
 enum dsk_state_t {
@@ -147,17 +174,25 @@ static void dsk_reschedule(int64_t delta_ns)
 	schedule_event(&dsk_runstate_evt);
 }
 
+static void dsk_dma_done(void);
+
+// The controller holds the bus for the whole of a read or write
+static struct dma_channel dsk_dma = {
+	.name = "hawk dma",
+	.done = dsk_dma_done
+};
+
 static void dsk_goto_finish() {
 	dsk_state = STATE_FINISH;
 	cancel_event(&dsk_timeout_evt);
-	hawk_set_dma(0);
+	dma_release(&dsk_dma);
 
 	dsk_reschedule(0); // Immediately
 }
 
 static void dsk_check_sync(enum dsk_state_t success_state, int64_t time)
 {
-	struct hawk_drive* unit = &hawk[dsk_selected_unit / 2];
+	struct hawk_drive* unit = &hawk[dsk_active.unit / 2];
 
 	hawk_update(unit, time);
 	if (hawk_wait_sync(unit))
@@ -199,7 +234,7 @@ static void dsk_check_sync(enum dsk_state_t success_state, int64_t time)
 
 static void dsk_verify_addr(int64_t time)
 {
-	struct hawk_drive* unit = &hawk[dsk_selected_unit / 2];
+	struct hawk_drive* unit = &hawk[dsk_active.unit / 2];
 
 	int remaining = hawk_remaining_bits(unit, time);
 
@@ -208,7 +243,7 @@ static void dsk_verify_addr(int64_t time)
 		return;
 	}
 
-	uint16_t expected = (dsk_cylinder << 5) | (dsk_head << 4) | dsk_sector;
+	uint16_t expected = (dsk_active.cylinder << 5) | (dsk_active.head << 4) | dsk_active.sector;
 	uint16_t addr = hawk_read_word(unit);
 	// Guess: checkword is just inverted addrs
 	uint16_t checkword = ~hawk_read_word(unit);
@@ -225,13 +260,13 @@ static void dsk_verify_addr(int64_t time)
 
 static void dsk_read_data(int64_t time)
 {
-	struct hawk_drive* unit = &hawk[dsk_selected_unit / 2];
+	struct hawk_drive* unit = &hawk[dsk_active.unit / 2];
 	//time = get_current_time();
 	int remaining = hawk_remaining_bits(unit, time);
 
 	while (remaining >= 8) {
 		uint8_t data = hawk_read_byte(unit);
-		cpu6_dma_write(data);
+		dma_put(data);
 		// fprintf(stderr, "%02x ", data);
 		// if (dsk_transfer_count % 16 == 1) {
 		// 	fprintf(stderr, "\n");
@@ -249,7 +284,7 @@ static void dsk_read_data(int64_t time)
 
 static void dsk_do_crc(int64_t time)
 {
-	struct hawk_drive* unit = &hawk[dsk_selected_unit / 2];
+	struct hawk_drive* unit = &hawk[dsk_active.unit / 2];
 	int remaining = hawk_remaining_bits(unit, time);
 
 	if (remaining < 16) {
@@ -265,8 +300,12 @@ static void dsk_do_crc(int64_t time)
 			dsk_crc_error = 1;
 			dsk_goto_finish();
 		} else {
-			dsk_sector = (dsk_sector + 1) & 0xf;
-			hawk_wait_sector(unit, dsk_sector);
+			dsk_active.sector = (dsk_active.sector + 1) & 0xf;
+			// The sector register follows along unless the guest has
+			// already loaded it for a later command
+			if (!dsk_addr_written)
+				dsk_sector = dsk_active.sector;
+			hawk_wait_sector(unit, dsk_active.sector);
 			dsk_state = STATE_WAIT_SECTOR;
 		}
 	} else {
@@ -276,7 +315,7 @@ static void dsk_do_crc(int64_t time)
 
 static void dsk_run_state_machine(unsigned trace, int64_t time)
 {
-	unsigned drive = dsk_selected_unit / 2;
+	unsigned drive = dsk_active.unit / 2;
 	unsigned drive_bit = 1 << drive;
 	dsk_tracing = trace;
 
@@ -290,40 +329,31 @@ static void dsk_run_state_machine(unsigned trace, int64_t time)
 
 		switch (dsk_state) {
 		case STATE_SEEK:
-			// Start a sync
-			dsk_seek(trace);
-			if (hawk[drive].addr_ack) {
-				dsk_state = STATE_WAIT_SEEK;
-
-				dsk_seek_active |= drive_bit;
-				dsk_seek_complete &= ~drive_bit;
-			}
-			break;
 		case STATE_RTZ:
-			// start a rtz
-			hawk_rtz(&hawk[drive], dsk_selected_unit & 1);
-			if (hawk[drive].addr_ack) {
-				dsk_seek_active |= drive_bit;
-				dsk_seek_complete &= ~drive_bit;
+			// Start a seek or rtz
+			if (dsk_start_seek(&dsk_active, trace))
 				dsk_state = STATE_WAIT_SEEK;
-			}
 			break;
 		case STATE_WAIT_SEEK:
-			// Wait until all active seeks/RTZs are complete
-			if (dsk_seek_active == 0) {
+			// Wait until the seek/RTZ on this drive is complete. A new
+			// command ends the wait and leaves the seek to finish alone.
+			if (!(dsk_seek_active & drive_bit)) {
 				dsk_goto_finish();
 			}
 			break;
 
 		case STATE_START:
-			// Start of a read or write
-			hawk_wait_sector(&hawk[drive], dsk_sector);
+			// Start of a read or write, once an overlapped seek on the
+			// drive has finished
+			if (hawk[drive].seeking)
+				break;
+			hawk_wait_sector(&hawk[drive], dsk_active.sector);
 			dsk_state = STATE_WAIT_SECTOR;
 			break;
 		case STATE_WAIT_SECTOR:
 			// wait for the sector
 			hawk_update(&hawk[drive], time);
-			if (hawk[drive].sector_pulse && hawk[drive].sector_addr == dsk_sector) {
+			if (hawk[drive].sector_pulse && hawk[drive].sector_addr == dsk_active.sector) {
 				dsk_state = STATE_ADDR_SYNC;
 			}
 			break;
@@ -338,7 +368,7 @@ static void dsk_run_state_machine(unsigned trace, int64_t time)
 			// wait for a sync
 			// guess: In order to allow enough time for the current instruction to finish
 			//        DSK requests a DMA lock as soon as it starts looking for sync
-			hawk_set_dma(dsk_transfer_mode);
+			dma_hold(&dsk_dma);
 			dsk_check_sync(STATE_READ_DATA, time);
 			dsk_transfer_count = HAWK_SECTOR_BYTES;
 			break;
@@ -367,6 +397,11 @@ static void dsk_run_state_machine(unsigned trace, int64_t time)
 				dsk_state = STATE_IDLE;
 			}
 		case STATE_IDLE:
+			if (dsk_state == STATE_IDLE && dsk_queue_len) {
+				dsk_start(&dsk_queue[dsk_queue_head], trace);
+				dsk_queue_head = (dsk_queue_head + 1) % DSK_QUEUE_LEN;
+				dsk_queue_len--;
+			}
 			break;
 		}
 
@@ -393,7 +428,7 @@ static void dsk_timeout_cb(struct event_t* event, int64_t late_ns)
 	}
 
 	// Kill any outstanding DMA transfers
-	hawk_set_dma(0);
+	dma_release(&dsk_dma);
 
 	dsk_timeout = 1;
 	dsk_goto_finish();
@@ -401,38 +436,90 @@ static void dsk_timeout_cb(struct event_t* event, int64_t late_ns)
 
 void dsk_hawk_changed(unsigned drive, int64_t time)
 {
-	if (hawk[drive].on_cyl) {
-		unsigned drive_bit = 1 << drive;
+	unsigned drive_bit = 1 << drive;
+	unsigned active = drive == dsk_active.unit / 2;
 
-		if (dsk_seek_active & drive_bit) {
-			dsk_seek_active &= ~drive_bit;
-			dsk_seek_complete |= drive_bit;
-		}
+	if (hawk[drive].on_cyl && (dsk_seek_active & drive_bit)) {
+		dsk_seek_active &= ~drive_bit;
+		dsk_seek_complete |= drive_bit;
+
+		// An overlapped seek finishing on an idle controller interrupts
+		// just as a command would
+		if (!active && dsk_state == STATE_IDLE && dsk_interrupt_enabled)
+			dsk_state = STATE_FINISH;
 	}
 
+	// Other drives only matter to the state machine when it is idle
+	if (!active && dsk_state != STATE_IDLE && dsk_state != STATE_FINISH)
+		return;
+
 	dsk_run_state_machine(dsk_tracing, time);
 }
 
-void dsk_init(void)
+// Platter images given by a machine profile. Once any is given, only the
+// given ones are opened
+static const char *dsk_image[NUM_HAWK_DRIVES * 2];
+static unsigned dsk_images_given;
+
+void dsk_attach(unsigned unit, const char *name)
+{
+	dsk_image[unit] = name;
+	dsk_images_given = 1;
+}
+
+static struct hawk_image *dsk_open_image(unsigned unit)
 {
-	int drive, fd1, fd2, unit;
 	char name[32];
 
+	if (dsk_images_given)
+		return dsk_image[unit] ? hawk_image_open(dsk_image[unit]) : NULL;
+	snprintf(name, sizeof(name), "hawk%u.disk", unit);
+	return hawk_image_open(name);
+}
+
+void dsk_init(void)
+{
+	struct hawk_image *removable, *fixed;
+	int drive, unit;
+
 	for (drive = 0; drive < NUM_HAWK_DRIVES; drive++) {
 		unit = drive * 2;
 
 		// Removable Platter
-		snprintf(name, sizeof(name), "hawk%u.disk", unit);
-		fd1 = open(name, O_RDWR|O_BINARY);
+		removable = dsk_open_image(unit);
 
 		// Fixed Platter
-		snprintf(name, sizeof(name), "hawk%u.disk", unit + 1);
-		fd2 = open(name, O_RDWR|O_BINARY);
+		fixed = dsk_open_image(unit + 1);
 
-		// We don't check status of opens
-
-		hawk_init(&hawk[drive], drive, fd1, fd2);
+		// Missing images just leave the platter out
+		hawk_init(&hawk[drive], drive, removable, fixed);
 	}
+
+	CHECKPOINT(dsk_irq);
+	CHECKPOINT(dsk_selected_unit);
+	CHECKPOINT(dsk_write_mask);
+	CHECKPOINT(dsk_cylinder);
+	CHECKPOINT(dsk_head);
+	CHECKPOINT(dsk_sector);
+	CHECKPOINT(dsk_addr_written);
+	CHECKPOINT(dsk_active);
+	CHECKPOINT(dsk_queue);
+	CHECKPOINT(dsk_queue_head);
+	CHECKPOINT(dsk_queue_len);
+	CHECKPOINT(dsk_interrupt_enabled);
+	CHECKPOINT(dsk_interrupt_ack);
+	CHECKPOINT(dsk_status);
+	CHECKPOINT(dsk_transfer_mode);
+	CHECKPOINT(dsk_transfer_count);
+	CHECKPOINT(dsk_fmt_err);
+	CHECKPOINT(dsk_addr_err);
+	CHECKPOINT(dsk_timeout);
+	CHECKPOINT(dsk_crc_error);
+	CHECKPOINT(dsk_seek_active);
+	CHECKPOINT(dsk_seek_complete);
+	CHECKPOINT(dsk_state);
+	CHECKPOINT(dsk_old_state);
+	dma_checkpoint(&dsk_dma);
 }
 
 static void dsk_update_status() {
@@ -492,21 +579,39 @@ static void hawk_clear_controller_error() {
  *	 bytes per track"
  *		-- Ken Romain
  */
-static void dsk_seek(unsigned trace)
+static void dsk_seek(const struct dsk_command *c, unsigned trace)
 {
-	unsigned drive = dsk_selected_unit / 2;
-	unsigned fixed = dsk_selected_unit & 1;
+	unsigned drive = c->unit / 2;
+	unsigned fixed = c->unit & 1;
 
 	if (trace)
 		fprintf(stderr, "%04x: %i Seek to %u/%u/%u\n", cpu6_pc(), drive,
-			dsk_cylinder, dsk_head, dsk_sector);
+			c->cylinder, c->head, c->sector);
 
 	if (hawk[drive].ready) {
-		hawk_seek(&hawk[drive], fixed, dsk_cylinder, dsk_head);
+		hawk_seek(&hawk[drive], fixed, c->cylinder, c->head);
 	}
 }
 
-void hawk_dma_done(void)
+// Start a seek or RTZ on the drive, returns 0 if the drive didn't take it
+static int dsk_start_seek(const struct dsk_command *c, unsigned trace)
+{
+	unsigned drive = c->unit / 2;
+	unsigned drive_bit = 1 << drive;
+
+	if (c->cmd == DSK_CMD_RTZ)
+		hawk_rtz(&hawk[drive], c->unit & 1);
+	else
+		dsk_seek(c, trace);
+	if (!hawk[drive].addr_ack)
+		return 0;
+	dsk_seek_active |= drive_bit;
+	dsk_seek_complete &= ~drive_bit;
+	return 1;
+}
+
+// The DMA count ran out
+static void dsk_dma_done(void)
 {
     dsk_goto_finish();
 }
@@ -536,50 +641,85 @@ void hawk_dma_done(void)
  *	 sector length and padded the sector to 512 bytes."
  *			-- Ken Romain
  */
-static void dsk_cmd(uint8_t cmd, unsigned trace)
+static void dsk_start(const struct dsk_command *c, unsigned trace)
 {
-	if (dsk_state != STATE_IDLE) {
-		if (trace)
-			fprintf(stderr, "%04X: statemachine busy. cmd=%i\n", cpu6_pc(), cmd);
-	}
-
 	schedule_event(&dsk_timeout_evt);
 
 	// Controller errors appear to be cleared when starting a new command
 	hawk_clear_controller_error();
 
-	switch (cmd) {
-	case 0:		/* Multi sector read  - 1 to 16 sectors */
+	dsk_active = *c;
+	dsk_addr_written = 0;
+
+	switch (c->cmd) {
+	case DSK_CMD_READ:	/* Multi sector read  - 1 to 16 sectors */
 		if (trace)
 			fprintf(stderr, "%04X: hawk %i Read %i bytes\n", cpu6_pc(),
-				dsk_selected_unit, cpu6_dma_count());
+				c->unit, (uint16_t)~dma_count());
 		dsk_transfer_mode = 1;
 		dsk_state = STATE_START;
 		break;
-	case 1:		/* Multi sector write - ditto */
+	case DSK_CMD_WRITE:	/* Multi sector write - ditto */
 		if (trace)
 			fprintf(stderr, "%04X: hawk %i Write %i bytes\n", cpu6_pc(),
-				dsk_selected_unit, cpu6_dma_count());
+				c->unit, (uint16_t)~dma_count());
 		dsk_transfer_mode = 2;
-        dsk_state = STATE_START;
+		dsk_state = STATE_START;
 		break;
-	case 2:		/* Seek */
+	case DSK_CMD_SEEK:
 		dsk_state = STATE_SEEK;
 		break;
-	case 3:		/* Return to Track Zero Sector (Recalibrate) */
+	case DSK_CMD_RTZ:	/* Return to Track Zero Sector (Recalibrate) */
 		if (trace)
 			fprintf(stderr, "%04X: hawk %i Return to Zero\n", cpu6_pc(),
-				dsk_selected_unit);
+				c->unit);
 		dsk_state = STATE_RTZ;
 		break;
 	case 4:		/* Format sector - Ken thinks but not sure */
 	default:
 		fprintf(stderr, "%04X: Unknown hawk command %02X\n",
-			cpu6_pc(), cmd);
+			cpu6_pc(), c->cmd);
 		break;
 	}
 }
 
+static void dsk_cmd(uint8_t cmd, unsigned trace)
+{
+	struct dsk_command c = {
+		.cmd = cmd,
+		.unit = dsk_selected_unit,
+		.cylinder = dsk_cylinder,
+		.head = dsk_head,
+		.sector = dsk_sector,
+	};
+	unsigned drive = c.unit / 2;
+
+	// Anything but a transfer can be cut short by a new command
+	if (dsk_state < STATE_START || dsk_state > STATE_CRC) {
+		dsk_start(&c, trace);
+		return;
+	}
+
+	if ((cmd == DSK_CMD_SEEK || cmd == DSK_CMD_RTZ)
+	    && drive != dsk_active.unit / 2 && !hawk[drive].seeking) {
+		if (trace)
+			fprintf(stderr, "%04X: hawk %i overlapped seek\n",
+				cpu6_pc(), c.unit);
+		dsk_start_seek(&c, trace);
+		return;
+	}
+
+	if (dsk_queue_len == DSK_QUEUE_LEN) {
+		if (trace)
+			fprintf(stderr, "%04X: statemachine busy. cmd=%i\n", cpu6_pc(), cmd);
+		return;
+	}
+	if (trace)
+		fprintf(stderr, "%04X: hawk %i queued cmd=%i\n", cpu6_pc(),
+			c.unit, cmd);
+	dsk_queue[(dsk_queue_head + dsk_queue_len++) % DSK_QUEUE_LEN] = c;
+}
+
 void dsk_write(uint16_t addr, uint8_t val, unsigned trace)
 {
 	switch (addr) {
@@ -595,6 +735,7 @@ void dsk_write(uint16_t addr, uint8_t val, unsigned trace)
 		// bits are xxCC_CCCC_CCCH_SSSS
 		dsk_cylinder &= 0x007;
 		dsk_cylinder |= (val << 3);
+		dsk_addr_written = 1;
 		break;
 	case 0xF142:
 		// continued
@@ -602,6 +743,7 @@ void dsk_write(uint16_t addr, uint8_t val, unsigned trace)
 		dsk_cylinder |= val >> 5;
 		dsk_head = !!(val & 0x10);
 		dsk_sector = val & 0x0f;
+		dsk_addr_written = 1;
 		break;
 	case 0xF143:
 		/* "It is a Write Enable Bit Mask to help protect against writing to a
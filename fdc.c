@@ -0,0 +1,509 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "centurion.h"
+#include "checkpoint.h"
+#include "cpu6.h"
+#include "dma.h"
+#include "fdc.h"
+#include "scheduler.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/*
+ *	Floppy controller (or what we know of it)
+ *
+ *	"The CMD controller and Floppy Controller are AMD2901 based
+ *	 controllers that move a command string into the controller under
+ *	 DMA control  then the AMD2901 runs the command string then moves
+ *	 the Read / Write data in or out of the controller under DMA control."
+ *			-- Ken Romain
+ *
+ *	"The first floopy was 8 inch. All Centurion disk R/W are based on
+ *	 400 ( 0x190 ) byte sectors to keep the old software from the Sykes
+ *	 tape days still usable on the disk drive systems."
+ *			-- Ken Romain
+ *
+ *	Write 43 to F800 to load a command
+ *	Write 45 to enable data receive (needed even if no data)
+ *	F801 is the in/out/busy bits, F800 the status where top bit = error
+ *
+ *	Commands
+ *	81 01 82		Restore
+ *	81 01 83 track		Seek
+ *
+ *	81 00 or 81 01		always starts
+ *	82 XX			restore
+ *	83 track		seek to track
+ *	88 sec track len.w	read
+ *
+ *	Boot uses (seek to track 0 load a super long sector 0 ?)
+ *	81 00 83 00 88 00 00 0F00
+ *
+ *	The hard disk controller seems close but not quite the same. The
+ *	bootstrap uses something like
+ *
+ *	81 00 84 0F+unit 83 00 00 85 00 0190 01 0190 02 0190 ...
+ *
+ *	The controller has 4K of its own memory. Commands are loaded at 0F00
+ *	and data is read into it from 0000, then moved out with a 45. The
+ *	aux memory test loads and reads back all of it with 46 and 47.
+ *
+ *	Commands run against image files, one per unit, holding the 400 byte
+ *	sectors in order by cylinder, head and sector. A read takes the time
+ *	to step to the cylinder, wait for the sector to come round and clock
+ *	the data off the disk, with the controller busy in the meantime.
+ *	Moving data to and from memory goes through the DMA arbiter.
+ */
+
+/*
+ *	The finch is a lot smarter
+ *
+ *	"A later rev. of the floppy controller (AMD2901 based) controlled
+ *	 5-1/4 floppy (720KB) and CDC 5-1/4 Finch 24MB or 32MB hard drive,
+ *	 letting us build a desktop Centurion Micro Plus system with CPU6,
+ *	 128KB DRAM & 4 port MUX"
+ *
+ *	81 02 is now used (is this maybe a version check ?)
+ *	82 is still restore
+ *	83 takes two bytes and it's not clear what it seeks
+ *	84 seems to be set unit
+ *	85 possibly set head (as hard disk)
+ *	8A is a table driven read, given tuples of sector, length
+ *	   terminated FF
+ *	FF is a terminator - in fact several test commands appear to DMA
+ *			     over length blocks and rely on this.
+ *
+ *	Units 0-F are the Finch hard disks and 10-1F the floppies.
+ */
+
+#define FDC_STATUS_ERROR	0x80
+
+#define FDC_SECTOR_BYTES	400
+#define FDC_CMD_BASE		0x0F00
+#define FDC_BUF_SIZE		0x1000
+#define FDC_UNITS		4
+
+/* Drive geometry and timing. Only the sector size is known for sure. */
+struct fdc_geometry {
+	const char *image;	/* Image file name pattern */
+	unsigned cylinders;
+	unsigned heads;
+	unsigned sectors;
+	uint64_t rotation_ns;	/* One revolution */
+	uint64_t step_ns;	/* Per cylinder stepped */
+	uint64_t settle_ns;	/* After the last step */
+	uint64_t byte_ns;	/* Data rate off the disk */
+};
+
+static const struct fdc_geometry fdc_8inch = {
+	"fd%u.disk", 77, 1, 10,
+	166666667, 3000000, 15000000, 32000	/* 360rpm, 250kbit/s */
+};
+
+static const struct fdc_geometry finch_floppy = {
+	"finchfd%u.disk", 80, 2, 9,
+	200000000, 3000000, 15000000, 32000	/* 300rpm, 250kbit/s */
+};
+
+/* A revolution at 5Mbit/s passes 10416 bytes under the head, so 26 whole
+   sectors is the most a track can hold and a sector's slot is longer than
+   the 640us its data takes. The gaps a real format needs are not kept. */
+static const struct fdc_geometry finch_disk = {
+	"finch%u.disk", 697, 3, 26,
+	16666667, 30000, 3000000, 1600		/* 3600rpm, 5Mbit/s */
+};
+
+struct fdc_drive {
+	const struct fdc_geometry *geo;
+	int fd;			/* Image, -1 if none */
+	unsigned cylinder;	/* Where the heads are */
+};
+
+static struct fdc_drive fdc_drives[2][FDC_UNITS];
+
+static unsigned finch;		/* Finch or original FDC */
+static unsigned fdc_trace;
+
+static uint8_t fd_buf[FDC_BUF_SIZE];
+static unsigned fd_ptr;
+static uint8_t fd_status;
+static uint8_t fd_bits;
+
+/* Command state, kept from one command string to the next */
+static struct fdc_drive *fdc_unit;
+static unsigned fdc_head;
+static uint8_t fdc_result;	/* Status for the data phase */
+static uint64_t fdc_time;	/* When the command being run is done */
+
+/* What the DMA being done is for */
+#define FDC_IDLE	0
+#define FDC_CMD_IN	1	/* Fetch a command string and run it */
+#define FDC_DATA_IN	2	/* Memory to controller */
+#define FDC_DATA_OUT	3	/* Controller to memory */
+
+static unsigned fdc_action;
+static unsigned fdc_running;	/* A command string is being run */
+static unsigned fdc_waiting;	/* Data phase held back until it is done */
+static unsigned fdc_waiting_dir;
+
+static void fdc_event_cb(struct event_t *event, int64_t late_ns);
+static struct event_t fdc_evt = {
+	.name = "fdc",
+	.callback = fdc_event_cb
+};
+
+static void fdc_dma_done(void);
+
+/*
+ *	The controller moves about a byte a microsecond (a guess) and has 4K.
+ *	Assume ptr is a shared counter - but we don't actually know from
+ *	what we have so far
+ */
+static struct dma_channel fdc_dma = {
+	.name = "fdc dma",
+	.byte_ns = 1000,
+	.burst = FDC_BUF_SIZE,
+	.buf = fd_buf,
+	.size = FDC_BUF_SIZE,
+	.ptr = &fd_ptr,
+	.done = fdc_dma_done
+};
+
+static void fdc_start_dma(unsigned action, unsigned dir)
+{
+	if (action == FDC_CMD_IN) {
+		/* A new command string replaces the one being run */
+		cancel_event(&fdc_evt);
+		fdc_running = 0;
+	} else if (fdc_running) {
+		/* The data isn't there yet, move it once the command is done */
+		fdc_waiting = action;
+		fdc_waiting_dir = dir;
+		return;
+	}
+	fdc_waiting = FDC_IDLE;
+	fdc_action = action;
+	dma_request(&fdc_dma, dir);
+}
+
+static void fdc_error(const char *what)
+{
+	if (fdc_trace)
+		fprintf(stderr, "fdc: %s\n", what);
+	fdc_result = FDC_STATUS_ERROR;
+}
+
+static void fdc_select(unsigned unit)
+{
+	fdc_unit = NULL;
+	if ((unit & 0x0F) >= FDC_UNITS || (!finch && unit >= FDC_UNITS)) {
+		fdc_error("no such unit");
+		return;
+	}
+	/* On the Finch units 10-1F are the floppies */
+	fdc_unit = &fdc_drives[finch && unit < 0x10][unit & 0x0F];
+}
+
+static void fdc_seek(unsigned cylinder)
+{
+	struct fdc_drive *d = fdc_unit;
+	unsigned distance;
+
+	if (d == NULL)
+		return;
+	if (cylinder >= d->geo->cylinders) {
+		fdc_error("seek past the last cylinder");
+		return;
+	}
+	distance = cylinder > d->cylinder ? cylinder - d->cylinder :
+		d->cylinder - cylinder;
+	if (distance)
+		fdc_time += distance * d->geo->step_ns + d->geo->settle_ns;
+	d->cylinder = cylinder;
+}
+
+/*
+ *	Read len bytes starting at a sector of the current cylinder and head
+ *	into the controller memory at fd_ptr. Reads longer than a sector run
+ *	on into the following ones.
+ */
+static void fdc_read(unsigned sector, unsigned len)
+{
+	struct fdc_drive *d = fdc_unit;
+	const struct fdc_geometry *g;
+	uint64_t pos, want;
+	off_t offset;
+
+	if (d == NULL)
+		return;
+	g = d->geo;
+	if (d->fd == -1) {
+		fdc_error("no disk");
+		return;
+	}
+	if (sector >= g->sectors || fdc_head >= g->heads) {
+		fdc_error("no such sector");
+		return;
+	}
+	if (fd_ptr + len > FDC_CMD_BASE) {
+		fprintf(stderr, "%04X: overlong fdc read of %u bytes\n",
+			cpu6_pc(), len);
+		len = FDC_CMD_BASE - fd_ptr;
+	}
+
+	/* Wait for the sector to come round, then clock it in */
+	pos = fdc_time % g->rotation_ns;
+	want = g->rotation_ns * sector / g->sectors;
+	fdc_time += (want + g->rotation_ns - pos) % g->rotation_ns;
+	fdc_time += len * g->byte_ns;
+
+	offset = ((off_t)(d->cylinder * g->heads + fdc_head) * g->sectors
+		+ sector) * FDC_SECTOR_BYTES;
+	host_syscalls++;
+	if (lseek(d->fd, offset, SEEK_SET) == -1
+	    || read(d->fd, fd_buf + fd_ptr, len) != len) {
+		memset(fd_buf + fd_ptr, 0, len);
+		fdc_error("read failed");
+	}
+	fd_ptr += len;
+}
+
+/* Returns the number of bytes of the command used, or 0 at the end */
+static unsigned fdc_command(uint8_t *p, unsigned len)
+{
+	unsigned n;
+
+	switch (*p) {
+	case 0x81:
+		/* We don't know what this does */
+		return 2;
+	case 0x82:
+		if (fdc_trace)
+			fprintf(stderr, "restore.\n");
+		fdc_seek(0);
+		return 1;
+	case 0x83:
+		if (finch) {
+			if (fdc_trace)
+				fprintf(stderr, "seek %d\n", p[1] << 8 | p[2]);
+			fdc_seek(p[1] << 8 | p[2]);
+			return 3;
+		}
+		if (fdc_trace)
+			fprintf(stderr, "seek %d\n", p[1]);
+		fdc_seek(p[1]);
+		return 2;
+	case 0x84:
+		if (fdc_trace)
+			fprintf(stderr, "set unit %d\n", p[1]);
+		fdc_select(p[1]);
+		return 2;
+	case 0x85:
+		if (fdc_trace)
+			fprintf(stderr, "set head %d\n", p[1]);
+		fdc_head = p[1];
+		return 2;
+	case 0x88:
+		if (finch)
+			break;
+		if (fdc_trace)
+			fprintf(stderr, "read %d,%d for %d bytes.\n",
+				p[1], p[2], p[3] << 8 | p[4]);
+		fdc_seek(p[2]);
+		fdc_read(p[1], p[3] << 8 | p[4]);
+		return 5;
+	case 0x8A:
+		if (!finch)
+			break;
+		/* Table driven read */
+		for (n = 1; n + 3 <= len && p[n] != 0xFF; n += 3) {
+			if (fdc_trace)
+				fprintf(stderr, "read %d for %d bytes.\n",
+					p[n], (p[n + 1] << 8) | p[n + 2]);
+			fdc_read(p[n], (p[n + 1] << 8) | p[n + 2]);
+		}
+		return n + 1;
+	case 0xFF:	/* Seems to act as an end marker */
+		return 0;
+	}
+	fprintf(stderr, "unknown command %02x\n", *p);
+	return 1;
+}
+
+static void fdc_run(uint8_t *p, unsigned len)
+{
+	unsigned n;
+
+	fdc_result = 0;
+	fd_ptr = 0;
+	while (len > 0) {
+		n = fdc_command(p, len);
+		if (n == 0 || n > len)
+			break;
+		p += n;
+		len -= n;
+	}
+}
+
+static void fdc_dma_in_done(void)
+{
+	unsigned i;
+	int64_t now = get_current_time();
+
+	if (fd_ptr <= FDC_CMD_BASE) {
+		fd_bits = ST_Fout;
+		fd_status = 0;
+		return;
+	}
+	if (fdc_trace) {
+		fprintf(stderr, "fdcmd: %d\n\t", fd_ptr);
+		for (i = FDC_CMD_BASE; i < fd_ptr; i++) {
+			fprintf(stderr, "%02X ", fd_buf[i]);
+			if (((i & 15) == 15) && i != fd_ptr - 1)
+				fprintf(stderr, "\n\t");
+		}
+		fprintf(stderr, "\n");
+	}
+	fdc_time = now;
+	fdc_run(fd_buf + FDC_CMD_BASE, fd_ptr - FDC_CMD_BASE);
+	fd_bits = ST_Busy;
+	fdc_running = 1;
+	fdc_evt.delta_ns = fdc_time - now;
+	schedule_event(&fdc_evt);
+}
+
+/* Command finished, start any data phase asked for while it ran */
+static void fdc_event_cb(struct event_t *event, int64_t late_ns)
+{
+	fdc_running = 0;
+	fd_status = fdc_result;
+	if (fdc_waiting) {
+		fdc_start_dma(fdc_waiting, fdc_waiting_dir);
+		return;
+	}
+	fd_bits = ST_Fout;
+}
+
+static void fdc_dma_done(void)
+{
+	switch (fdc_action) {
+	case FDC_CMD_IN:
+		fdc_dma_in_done();
+		break;
+	case FDC_DATA_IN:
+		fd_bits = ST_Fout;
+		fd_status = 0;
+		break;
+	case FDC_DATA_OUT:
+		fd_bits = ST_Fout;
+		break;
+	}
+	fdc_action = FDC_IDLE;
+}
+
+void fdc_write(uint8_t data, unsigned trace)
+{
+	fdc_trace = trace;
+	if (trace)
+		fprintf(stderr, "fdc write %02X\n", data);
+	switch (data) {
+	case 0x00:		/* Mystery - reset state perhaps ? */
+	case 0x01:		/* Used in the aux memory test */
+	case 0x0F:		/* Used in the aux memory test */
+		/* Status bits ?? */
+		break;
+	case 0x41:		/* used for reads */
+	case 0x43:		/* used for seek etc */
+		fd_bits = ST_Fin;	/* Fin not busy */
+		fd_ptr = FDC_CMD_BASE;
+		fd_status = 0x80;	/*?? */
+		fdc_start_dma(FDC_CMD_IN, DMA_TO_DEVICE);
+		break;
+	case 0x44:		/* seems to be reading the command buffer back */
+		fd_bits = ST_Busy | ST_Fout;	/* busy */
+		fd_ptr = FDC_CMD_BASE;
+		fd_status = 0x00;
+		fdc_start_dma(FDC_DATA_OUT, DMA_FROM_DEVICE);
+		break;
+	case 0x45:		/* data follow up */
+		/* Should probably have ST_Busy set at this point ? */
+		/* 1 or 2 ?? */
+		fd_bits = ST_Fin | ST_Busy;	/* Should this be Fout or command based ? */
+		fd_ptr = 0;
+		fd_status = fdc_result;	/* Top bit for error */
+		fdc_start_dma(FDC_DATA_OUT, DMA_FROM_DEVICE);
+		break;
+	case 0x46:		/* load data into aux memory */
+		fd_bits = ST_Fin;
+		fd_ptr = 0;
+		fdc_start_dma(FDC_DATA_IN, DMA_TO_DEVICE);
+		break;
+	case 0x47:		/* retrieve data from aux memory */
+		fd_bits = ST_Fout | ST_Busy;
+		fd_ptr = 0;
+		fdc_start_dma(FDC_DATA_OUT, DMA_FROM_DEVICE);
+		break;
+	default:
+		fprintf(stderr, "%04X: unknown fdc cmd %02X.\n", cpu6_pc(),
+			data);
+		break;
+	}
+}
+
+uint8_t fdc_read_status(unsigned trace)
+{
+	if (trace)
+		fprintf(stderr, "fd status %02X\n", fd_status);
+	return fd_status;
+}
+
+uint8_t fdc_read_bits(unsigned trace)
+{
+	if (trace)
+		fprintf(stderr, "fd bits %02X\n", fd_bits);
+	return fd_bits;
+}
+
+static void fdc_open(struct fdc_drive *d, const struct fdc_geometry *g,
+	unsigned unit)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), g->image, unit);
+	d->geo = g;
+	d->fd = open(name, O_RDONLY | O_BINARY);
+}
+
+void fdc_init(unsigned is_finch)
+{
+	unsigned i;
+
+	finch = is_finch;
+	for (i = 0; i < FDC_UNITS; i++) {
+		fdc_open(&fdc_drives[0][i], finch ? &finch_floppy : &fdc_8inch, i);
+		if (finch)
+			fdc_open(&fdc_drives[1][i], &finch_disk, i);
+	}
+	fdc_unit = &fdc_drives[finch][0];
+
+	CHECKPOINT(fdc_drives);
+	CHECKPOINT(fd_buf);
+	CHECKPOINT(fd_ptr);
+	CHECKPOINT(fd_status);
+	CHECKPOINT(fd_bits);
+	CHECKPOINT(fdc_unit);
+	CHECKPOINT(fdc_head);
+	CHECKPOINT(fdc_result);
+	CHECKPOINT(fdc_time);
+	CHECKPOINT(fdc_action);
+	CHECKPOINT(fdc_running);
+	CHECKPOINT(fdc_waiting);
+	CHECKPOINT(fdc_waiting_dir);
+	dma_checkpoint(&fdc_dma);
+}
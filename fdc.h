@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Controller ready bits, shared with the CMD controller */
+#define ST_Fout		1
+#define ST_Fin		2
+#define ST_Busy		8
+
+void fdc_init(unsigned finch);
+void fdc_write(uint8_t data, unsigned trace);
+uint8_t fdc_read_status(unsigned trace);
+uint8_t fdc_read_bits(unsigned trace);
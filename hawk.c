@@ -1,8 +1,13 @@
 
+#include "centurion.h"
+#include "checkpoint.h"
 #include "hawk.h"
+#include "hawk_image.h"
 #include "scheduler.h"
+#include "stats.h"
 
 #include <assert.h>
+#include <math.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,7 +20,7 @@
 #define HAWK_EVENT_ROTATE_SECTOR    3
 #define HAWK_EVENT_ROTATE_SYNC      4
 
-static void hawk_write_bits(struct hawk_drive* unit, int count, uint8_t* data);
+static void hawk_write_bits(struct hawk_drive* unit, int count, const uint8_t* data);
 static void hawk_set_bits(struct hawk_drive* unit, int count, uint8_t val);
 static void hawk_erase_bits(struct hawk_drive* unit, int count);
 
@@ -52,20 +57,20 @@ static void hawk_event_callback(struct event_t* event, int64_t late_ns)
 // Reads entire track of data into host memory.
 // Converts from 400 byte sectors, into raw bits with gaps, sync and format info
 static int hawk_buffer_track(struct hawk_drive* unit, unsigned fixed, unsigned cyl, unsigned head) {
-    off_t offset = ((cyl << 5) | (head << 4)) * HAWK_SECTOR_BYTES;
-    uint8_t buffer[HAWK_SECTOR_BYTES];
+    struct hawk_image *img = fixed ? unit->fixed : unit->removable;
+    const uint8_t *track;
 
-    int fd = fixed ? unit->fd_fixed : unit->fd_removable;
     memset(unit->datacells, 0, sizeof(unit->datacells));
 
     // If we don't have a platter installed, the seek is going to complete anyway
     // There just won't be any data to read
-    if (fd == -1)
+    if (img == NULL)
         return 0;
 
-    if (lseek(fd, offset, SEEK_SET) == -1) {
-        fprintf(stderr, "hawk position failed (%d,%d,0) = %lx.\n",
-            cyl, head, (long) offset);
+    stats.hawk_track_loads++;
+    track = hawk_image_track(img, cyl * HAWK_NUM_HEADS + head);
+    if (track == NULL) {
+        fprintf(stderr, "hawk read failed (%d,%d).\n", cyl, head);
         return 0;
     }
 
@@ -97,11 +102,7 @@ static int hawk_buffer_track(struct hawk_drive* unit, unsigned fixed, unsigned c
         hawk_set_bits(unit, 1, 1);
 
         // sector data
-        if (read(fd, buffer, HAWK_SECTOR_BYTES) != HAWK_SECTOR_BYTES) {
-            fprintf(stderr, "hawk read failed (%d,%d,%d).\n", cyl, head, sector);
-            return 0;
-        }
-        hawk_write_bits(unit, HAWK_SECTOR_BYTES * 8, buffer);
+        hawk_write_bits(unit, HAWK_SECTOR_BYTES * 8, track + sector * HAWK_SECTOR_BYTES);
 
         // CRC
         // TODO: proper CRC function
@@ -114,6 +115,24 @@ static int hawk_buffer_track(struct hawk_drive* unit, unsigned fixed, unsigned c
     return 1;
 }
 
+// Note the track under the heads, for hawk_load_track to fill in later
+static void hawk_want_track(struct hawk_drive* unit, unsigned fixed, unsigned cyl, unsigned head) {
+    unit->track_fixed = fixed;
+    unit->track_cyl = cyl;
+    unit->track_head = head;
+    unit->track_loaded = 0;
+}
+
+static void hawk_load_track(struct hawk_drive* unit) {
+    int32_t data_ptr = unit->data_ptr;
+
+    if (unit->track_loaded)
+        return;
+    hawk_buffer_track(unit, unit->track_fixed, unit->track_cyl, unit->track_head);
+    unit->data_ptr = data_ptr;
+    unit->track_loaded = 1;
+}
+
 
 void hawk_seek(struct hawk_drive* unit, unsigned fixed, unsigned cyl, unsigned head)
 {
@@ -121,6 +140,7 @@ void hawk_seek(struct hawk_drive* unit, unsigned fixed, unsigned cyl, unsigned h
         return;
 
     unit->seeking = 1;
+    stats.hawk_seeks++;
     unit->addr_ack = 0;
     unit->addr_int = 0;
 
@@ -136,25 +156,36 @@ void hawk_seek(struct hawk_drive* unit, unsigned fixed, unsigned cyl, unsigned h
         return;
     }
 
-    off_t offset = (cyl << 5) | (head << 4) * HAWK_SECTOR_BYTES;
-    offset *= HAWK_SECTOR_BYTES;
-
-    // According to specs, the average track-to-track seek time is 7.5ms.
-    // TODO: Accurate seek times
-    unit->event.delta_ns = 7.5 * ONE_MILISECOND_NS;
+    unit->event.delta_ns = hawk_seek_time(unit, cyl);
     unit->event_type = HAWK_EVENT_SEEK_SUCCESS;
+    unit->cylinder = cyl;
 
     if (unit->instant_read)
         unit->event.delta_ns = 0;
 
-    // To simplify emulation, slurp the whole track into host memory
-    hawk_buffer_track(unit, fixed, cyl, head);
+    // To simplify emulation, the whole track is slurped into host memory
+    // the first time it is read
+    hawk_want_track(unit, fixed, cyl, head);
 
     unit->addr_ack = 1;
     schedule_event(&unit->event);
 }
 
 
+// Time for this drive to move its heads to a cylinder. The carriage
+// accelerates for the first half of a seek and brakes for the rest, so the
+// time grows with the square root of the distance. Changing heads on the
+// same cylinder doesn't move the carriage at all.
+int64_t hawk_seek_time(struct hawk_drive* unit, unsigned cyl)
+{
+    unsigned distance = cyl > unit->cylinder ? cyl - unit->cylinder : unit->cylinder - cyl;
+
+    if (distance == 0)
+        return 0;
+    return HAWK_SEEK_MIN_NS + (HAWK_SEEK_MAX_NS - HAWK_SEEK_MIN_NS) *
+        sqrt((double)(distance - 1) / (HAWK_NUM_CYLINDERS - 2));
+}
+
 void hawk_rtz(struct hawk_drive* unit, unsigned fixed)
 {
     // According to manual, The Hawk drive unit will clear any seek
@@ -179,7 +210,16 @@ void hawk_update(struct hawk_drive* unit, int64_t now) {
     unit->sector_pulse = (rotation % (int64_t)HAWK_SECTOR_NS) < HAWK_SECTOR_PULSE_NS;
 }
 
-void hawk_init(struct hawk_drive *unit, unsigned drive_num, int fd1, int fd2) {
+// The datacells are only ever built from the image, so rather than keep
+// copies of them a checkpoint just has the track built again
+static void hawk_restored(void *arg) {
+    struct hawk_drive *unit = arg;
+
+    unit->track_loaded = 0;
+}
+
+void hawk_init(struct hawk_drive *unit, unsigned drive_num,
+    struct hawk_image *removable, struct hawk_image *fixed) {
     memset(unit, 0, sizeof(struct hawk_drive));
 
     unit->event.callback = hawk_event_callback;
@@ -189,24 +229,30 @@ void hawk_init(struct hawk_drive *unit, unsigned drive_num, int fd1, int fd2) {
     unit->drive_num = drive_num;
     unit->wprotect = 1;
 
-    hawk_setfd(unit, 0, fd1);
-    hawk_setfd(unit, 1, fd2);
+    hawk_set_image(unit, 0, removable);
+    hawk_set_image(unit, 1, fixed);
 
     // It's not actually possible to spin up a drive without a cartridge installed,
     // So if we have either image, it's ready.
-    unit->ready = (fd1 != -1) || (fd2 != -1);
+    unit->ready = removable || fixed;
 
-    if (unit->ready) {
-        hawk_buffer_track(unit, 0, 0, 0);
+    hawk_want_track(unit, 0, 0, 0);
+    if (unit->ready)
         hawk_update(unit, 0);
-    }
+
+    // Everything but the event, which the scheduler keeps, and the datacells
+    checkpoint_register(&unit->event_type, offsetof(struct hawk_drive, datacells)
+        - offsetof(struct hawk_drive, event_type));
+    checkpoint_register(&unit->track_fixed, sizeof(*unit)
+        - offsetof(struct hawk_drive, track_fixed));
+    checkpoint_hook(hawk_restored, unit);
 }
 
-void hawk_setfd(struct hawk_drive* unit, unsigned fixed, int fd) {
+void hawk_set_image(struct hawk_drive* unit, unsigned fixed, struct hawk_image *img) {
     if (fixed)
-        unit->fd_fixed = fd;
+        unit->fixed = img;
     else
-        unit->fd_removable = fd;
+        unit->removable = img;
 }
 
 
@@ -242,6 +288,7 @@ void hawk_wait_sector(struct hawk_drive* unit, unsigned sector) {
 int hawk_wait_sync(struct hawk_drive* unit) {
     if (unit->event_type != HAWK_EVENT_NONE)
         return 1;
+    hawk_load_track(unit);
 
     // Find the next one bit
     int32_t ptr = unit->data_ptr - 1;
@@ -289,6 +336,7 @@ int hawk_wait_sync(struct hawk_drive* unit) {
 }
 
 void hawk_read_bits(struct hawk_drive* unit, int count, uint8_t *dest) {
+    hawk_load_track(unit);
     while (1) {
         uint8_t byte = 0;
         uint8_t bit;
@@ -335,7 +383,7 @@ void hawk_rewind(struct hawk_drive* unit, int count) {
         unit->data_ptr += HAWK_RAW_TRACK_BITS;
 }
 
-static void hawk_write_bits(struct hawk_drive* unit, int count, uint8_t* data) {
+static void hawk_write_bits(struct hawk_drive* unit, int count, const uint8_t* data) {
     while (count > 0) {
         uint8_t byte = *(data++);
         for (int shift = 7; shift >= 0; shift--) {
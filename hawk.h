@@ -18,6 +18,12 @@
 #define HAWK_SECTOR_NS (HAWK_ROTATION_NS / HAWK_SECTS_PER_TRK)
 #define HAWK_SECTOR_PULSE_NS (2000) // Complete guess
 
+// Seek time from one cylinder to a full stroke. The specs give 7.5ms
+// track-to-track; the full stroke is a guess in line with the average
+// seek time of drives of the period.
+#define HAWK_SEEK_MIN_NS (7.5 * ONE_MILISECOND_NS)
+#define HAWK_SEEK_MAX_NS (65.0 * ONE_MILISECOND_NS)
+
 #define HAWK_DATACELL_DATA_BIT  0x01
 #define HAWK_DATACELL_CLOCK_BIT 0x10
 
@@ -93,9 +99,12 @@ struct hawk_drive {
 
 	uint8_t seeking;
 
-	// File handle of image file
-	int fd_removable;
-	int fd_fixed;
+	// Cylinder the heads are on, or heading for while seeking
+	unsigned cylinder;
+
+	// Platter images, NULL if none is loaded
+	struct hawk_image *removable;
+	struct hawk_image *fixed;
 
 	// assigned drive number
 	unsigned drive_num;
@@ -109,6 +118,13 @@ struct hawk_drive {
 	// haven't been written.
 	uint8_t datacells[HAWK_RAW_TRACK_BITS];
 
+	// The track the datacells are for. Building them is put off until
+	// something looks, as many seeks and most drives never get read
+	unsigned track_fixed;
+	unsigned track_cyl;
+	unsigned track_head;
+	uint8_t track_loaded;
+
 	int32_t data_ptr;
 	int32_t head_pos;
 	uint64_t rotation_offset;
@@ -117,10 +133,14 @@ struct hawk_drive {
 	unsigned instant_read;
 };
 
-void hawk_init(struct hawk_drive* unit, unsigned drive_num, int fd1, int fd2);
-void hawk_setfd(struct hawk_drive* unit, unsigned fixed, int fd);
+struct hawk_image;
+
+void hawk_init(struct hawk_drive* unit, unsigned drive_num,
+    struct hawk_image *removable, struct hawk_image *fixed);
+void hawk_set_image(struct hawk_drive* unit, unsigned fixed, struct hawk_image *img);
 void hawk_seek(struct hawk_drive* unit, unsigned fixed, unsigned cyl, unsigned head);
 void hawk_rtz(struct hawk_drive* unit, unsigned fixed);
+int64_t hawk_seek_time(struct hawk_drive* unit, unsigned cyl);
 int hawk_remaining_bits(struct hawk_drive* unit, uint64_t time);
 void hawk_read_bits(struct hawk_drive* unit, int count, uint8_t *dest);
 uint8_t hawk_read_byte(struct hawk_drive* unit);
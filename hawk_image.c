@@ -0,0 +1,405 @@
+/*
+ *	Hawk disk images
+ *
+ *	A raw image is a flat dump of the platter, 6400 bytes a track, cylinder
+ *	by cylinder and head by head. That is what the archive dumps are, but
+ *	mostly it is blank, so there are two smaller formats. Both start with
+ *
+ *	0	"CENTHAWK"
+ *	8	format, HAWK_IMAGE_SPARSE or HAWK_IMAGE_RLE
+ *	9	3 bytes reserved, zero
+ *	12	number of tracks, 32bit little endian
+ *	16	bytes per track, 32bit little endian, must be 6400
+ *
+ *	A sparse image follows that with a bitmap of the tracks holding any
+ *	data, track 0 in the low bit of the first byte, then those tracks in
+ *	order. Missing tracks read as zero.
+ *
+ *	A compressed image follows it with an index of an offset and a length
+ *	for each track, both 32bit little endian, then the tracks each packed
+ *	on its own with PackBits. A length of zero is an all zero track. Any
+ *	track can be unpacked by itself without looking at the others.
+ *
+ *	Images are mapped rather than read, so a track costs no system calls
+ *	and only the pages of the tracks used are ever brought in. They are
+ *	read only: the controller doesn't write yet.
+ */
+
+#include "hawk_image.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define HAWK_IMAGE_MAGIC "CENTHAWK"
+#define HAWK_IMAGE_HEADER 20
+
+struct hawk_image {
+    unsigned format;
+    const uint8_t *map;
+    size_t size;
+    unsigned tracks;
+
+    // Where each track is in the map, a length of zero is a blank track.
+    // Not used for raw images.
+    uint32_t *offset;
+    uint32_t *length;
+
+    uint8_t buffer[HAWK_TRACK_BYTES]; // Unpacked track
+};
+
+static const uint8_t zero_track[HAWK_TRACK_BYTES];
+
+static uint32_t get32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put32(FILE *fp, uint32_t v)
+{
+    fputc(v, fp);
+    fputc(v >> 8, fp);
+    fputc(v >> 16, fp);
+    fputc(v >> 24, fp);
+}
+
+// PackBits: a control byte n below 128 is followed by n + 1 bytes to copy,
+// one above 128 by a byte to repeat 257 - n times.
+static unsigned rle_pack(const uint8_t *in, unsigned len, uint8_t *out)
+{
+    unsigned i = 0, o = 0;
+
+    while (i < len) {
+        unsigned n = 1;
+
+        while (i + n < len && n < 128 && in[i + n] == in[i])
+            n++;
+        if (n >= 3) {
+            out[o++] = 257 - n;
+            out[o++] = in[i];
+            i += n;
+            continue;
+        }
+        // Copy up to the next run of three or more
+        n = 0;
+        while (i + n < len && n < 128) {
+            if (i + n + 2 < len && in[i + n] == in[i + n + 1]
+                && in[i + n] == in[i + n + 2])
+                break;
+            n++;
+        }
+        out[o++] = n - 1;
+        memcpy(out + o, in + i, n);
+        o += n;
+        i += n;
+    }
+    return o;
+}
+
+static int rle_unpack(const uint8_t *in, unsigned len, uint8_t *out, unsigned out_len)
+{
+    unsigned i = 0, o = 0, n;
+
+    while (i < len) {
+        uint8_t c = in[i++];
+
+        if (c < 128) {
+            n = c + 1;
+            if (i + n > len || o + n > out_len)
+                return -1;
+            memcpy(out + o, in + i, n);
+            i += n;
+        } else if (c > 128) {
+            n = 257 - c;
+            if (i == len || o + n > out_len)
+                return -1;
+            memset(out + o, in[i++], n);
+        } else
+            continue;
+        o += n;
+    }
+    return o == out_len ? 0 : -1;
+}
+
+static const uint8_t *map_file(int fd, size_t size)
+{
+#ifdef _WIN32
+    uint8_t *p = malloc(size);
+
+    if (p == NULL || read(fd, p, size) != size) {
+        free(p);
+        return NULL;
+    }
+    return p;
+#else
+    void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    return p == MAP_FAILED ? NULL : p;
+#endif
+}
+
+static void unmap_file(const uint8_t *map, size_t size)
+{
+#ifdef _WIN32
+    free((void *)map);
+#else
+    munmap((void *)map, size);
+#endif
+}
+
+static void bad_image(const char *path, const char *why)
+{
+    fprintf(stderr, "%s: %s.\n", path, why);
+    exit(1);
+}
+
+// Work out where the tracks of a sparse or compressed image are
+static void index_image(struct hawk_image *img, const char *path)
+{
+    const uint8_t *p = img->map + HAWK_IMAGE_HEADER;
+    uint64_t data;
+    unsigned t;
+
+    img->offset = calloc(img->tracks, sizeof(uint32_t));
+    img->length = calloc(img->tracks, sizeof(uint32_t));
+    if (img->offset == NULL || img->length == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    if (img->format == HAWK_IMAGE_SPARSE) {
+        data = HAWK_IMAGE_HEADER + (img->tracks + 7) / 8;
+        if (data > img->size)
+            bad_image(path, "truncated track bitmap");
+        for (t = 0; t < img->tracks; t++) {
+            if (!(p[t / 8] & (1 << (t % 8))))
+                continue;
+            if (data + HAWK_TRACK_BYTES > img->size)
+                bad_image(path, "truncated track data");
+            img->offset[t] = data;
+            img->length[t] = HAWK_TRACK_BYTES;
+            data += HAWK_TRACK_BYTES;
+        }
+        return;
+    }
+
+    if (HAWK_IMAGE_HEADER + (uint64_t)img->tracks * 8 > img->size)
+        bad_image(path, "truncated track index");
+    for (t = 0; t < img->tracks; t++, p += 8) {
+        img->offset[t] = get32(p);
+        img->length[t] = get32(p + 4);
+        if ((uint64_t)img->offset[t] + img->length[t] > img->size)
+            bad_image(path, "track index points past the end");
+    }
+}
+
+// Returns NULL if there is no such file
+struct hawk_image *hawk_image_open(const char *path)
+{
+    struct hawk_image *img;
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_BINARY);
+    if (fd == -1)
+        return NULL;
+
+    img = calloc(1, sizeof(*img));
+    if (img == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    if (fstat(fd, &st) == -1) {
+        perror(path);
+        exit(1);
+    }
+    img->size = st.st_size;
+    if (img->size) {
+        img->map = map_file(fd, img->size);
+        if (img->map == NULL) {
+            perror(path);
+            exit(1);
+        }
+    }
+    close(fd);
+
+    if (img->size < HAWK_IMAGE_HEADER
+        || memcmp(img->map, HAWK_IMAGE_MAGIC, 8)) {
+        img->format = HAWK_IMAGE_RAW;
+        img->tracks = img->size / HAWK_TRACK_BYTES;
+        return img;
+    }
+
+    img->format = img->map[8];
+    img->tracks = get32(img->map + 12);
+    if (img->format != HAWK_IMAGE_SPARSE && img->format != HAWK_IMAGE_RLE)
+        bad_image(path, "unknown image format");
+    if (get32(img->map + 16) != HAWK_TRACK_BYTES)
+        bad_image(path, "wrong track size");
+    index_image(img, path);
+    return img;
+}
+
+void hawk_image_close(struct hawk_image *img)
+{
+    if (img->map)
+        unmap_file(img->map, img->size);
+    free(img->offset);
+    free(img->length);
+    free(img);
+}
+
+unsigned hawk_image_format(const struct hawk_image *img)
+{
+    return img->format;
+}
+
+const uint8_t *hawk_image_track(struct hawk_image *img, unsigned track)
+{
+    if (track >= img->tracks)
+        return NULL;
+
+    switch (img->format) {
+    case HAWK_IMAGE_RAW:
+        return img->map + (size_t)track * HAWK_TRACK_BYTES;
+    case HAWK_IMAGE_SPARSE:
+        if (img->length[track] == 0)
+            return zero_track;
+        return img->map + img->offset[track];
+    default:
+        if (img->length[track] == 0)
+            return zero_track;
+        if (rle_unpack(img->map + img->offset[track], img->length[track],
+                img->buffer, HAWK_TRACK_BYTES))
+            return NULL;
+        return img->buffer;
+    }
+}
+
+static void save_header(FILE *fp, unsigned format, unsigned tracks)
+{
+    fwrite(HAWK_IMAGE_MAGIC, 8, 1, fp);
+    put32(fp, format);
+    put32(fp, tracks);
+    put32(fp, HAWK_TRACK_BYTES);
+}
+
+// The image goes to a file alongside and is renamed over the path at the
+// end. The source may be the same file, mapped, and must not be cut short
+// under us, and a failed save leaves whatever was there before.
+int hawk_image_save(struct hawk_image *img, const char *path, unsigned format)
+{
+    static uint8_t packed[HAWK_TRACK_BYTES * 2];
+    const uint8_t *data;
+    uint8_t bits;
+    uint32_t offset, len;
+    unsigned t;
+    char *tmp;
+    FILE *fp;
+
+    tmp = malloc(strlen(path) + 5);
+    if (tmp == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    sprintf(tmp, "%s.tmp", path);
+    fp = fopen(tmp, "wb");
+    if (fp == NULL) {
+        perror(tmp);
+        free(tmp);
+        return -1;
+    }
+
+    // Blank tracks are left out of both the sparse and compressed images
+    switch (format) {
+    case HAWK_IMAGE_RAW:
+        for (t = 0; t < img->tracks; t++) {
+            if ((data = hawk_image_track(img, t)) == NULL)
+                goto bad;
+            fwrite(data, HAWK_TRACK_BYTES, 1, fp);
+        }
+        break;
+    case HAWK_IMAGE_SPARSE:
+        save_header(fp, format, img->tracks);
+        for (t = 0, bits = 0; t < img->tracks; t++) {
+            if ((data = hawk_image_track(img, t)) == NULL)
+                goto bad;
+            if (memcmp(data, zero_track, HAWK_TRACK_BYTES))
+                bits |= 1 << (t % 8);
+            if (t % 8 == 7 || t == img->tracks - 1) {
+                fputc(bits, fp);
+                bits = 0;
+            }
+        }
+        for (t = 0; t < img->tracks; t++) {
+            data = hawk_image_track(img, t);
+            if (memcmp(data, zero_track, HAWK_TRACK_BYTES))
+                fwrite(data, HAWK_TRACK_BYTES, 1, fp);
+        }
+        break;
+    case HAWK_IMAGE_RLE:
+        // Index first, so pack everything twice rather than keep it
+        save_header(fp, format, img->tracks);
+        offset = HAWK_IMAGE_HEADER + img->tracks * 8;
+        for (t = 0; t < img->tracks; t++) {
+            if ((data = hawk_image_track(img, t)) == NULL)
+                goto bad;
+            len = 0;
+            if (memcmp(data, zero_track, HAWK_TRACK_BYTES))
+                len = rle_pack(data, HAWK_TRACK_BYTES, packed);
+            put32(fp, offset);
+            put32(fp, len);
+            offset += len;
+        }
+        for (t = 0; t < img->tracks; t++) {
+            data = hawk_image_track(img, t);
+            if (memcmp(data, zero_track, HAWK_TRACK_BYTES)) {
+                len = rle_pack(data, HAWK_TRACK_BYTES, packed);
+                fwrite(packed, len, 1, fp);
+            }
+        }
+        break;
+    default:
+        fprintf(stderr, "%s: unknown image format %u.\n", path, format);
+        goto fail;
+    }
+    if (ferror(fp)) {
+        perror(tmp);
+        goto fail;
+    }
+    if (fclose(fp)) {
+        perror(tmp);
+        remove(tmp);
+        free(tmp);
+        return -1;
+    }
+#ifdef _WIN32
+    // Windows won't rename over a file. The source was read in whole.
+    remove(path);
+#endif
+    if (rename(tmp, path)) {
+        perror(path);
+        remove(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+    return 0;
+bad:
+    fprintf(stderr, "%s: track %u of the source is unreadable.\n", path, t);
+fail:
+    fclose(fp);
+    remove(tmp);
+    free(tmp);
+    return -1;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+#include "hawk.h"
+
+#define HAWK_TRACK_BYTES (HAWK_SECTS_PER_TRK * HAWK_SECTOR_BYTES)
+#define HAWK_NUM_TRACKS (HAWK_NUM_CYLINDERS * HAWK_NUM_HEADS)
+
+// Image formats. Raw is a flat dump, track after track. The others start
+// with a header, see hawk_image.c.
+#define HAWK_IMAGE_RAW      0
+#define HAWK_IMAGE_SPARSE   1 // Only tracks with data, plus a bitmap
+#define HAWK_IMAGE_RLE      2 // Each track compressed on its own, plus an index
+
+struct hawk_image;
+
+struct hawk_image *hawk_image_open(const char *path);
+void hawk_image_close(struct hawk_image *img);
+unsigned hawk_image_format(const struct hawk_image *img);
+
+// The data of a track (cyl * 2 + head), or NULL if the image doesn't have
+// it. The pointer is good until the next call.
+const uint8_t *hawk_image_track(struct hawk_image *img, unsigned track);
+
+// Write all of an image out again in the given format
+int hawk_image_save(struct hawk_image *img, const char *path, unsigned format);
@@ -0,0 +1,69 @@
+/*
+ *	Convert Hawk disk images between the raw, sparse and compressed
+ *	formats. The input format is recognised from the file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hawk_image.h"
+
+static const char *format_name[] = { "raw", "sparse", "compressed" };
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: hawkimg [-c|-r|-s] <input> <output>\n"
+		" -c  compressed, each track packed on its own (default)\n"
+		" -r  raw, a flat dump of the platter\n"
+		" -s  sparse, blank tracks left out\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct hawk_image *img;
+	unsigned format = HAWK_IMAGE_RLE;
+	struct stat in, out;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "crs")) != -1) {
+		switch (opt) {
+		case 'c':
+			format = HAWK_IMAGE_RLE;
+			break;
+		case 'r':
+			format = HAWK_IMAGE_RAW;
+			break;
+		case 's':
+			format = HAWK_IMAGE_SPARSE;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind + 2 != argc)
+		usage();
+
+	img = hawk_image_open(argv[optind]);
+	if (img == NULL) {
+		perror(argv[optind]);
+		exit(1);
+	}
+	/* The output may replace the input, so size that up first */
+	if (stat(argv[optind], &in) == -1) {
+		perror(argv[optind]);
+		exit(1);
+	}
+	if (hawk_image_save(img, argv[optind + 1], format))
+		exit(1);
+	if (stat(argv[optind + 1], &out) == 0)
+		printf("%s: %s, %lld bytes -> %s: %s, %lld bytes\n",
+			argv[optind], format_name[hawk_image_format(img)],
+			(long long)in.st_size, argv[optind + 1],
+			format_name[format], (long long)out.st_size);
+	hawk_image_close(img);
+	return 0;
+}
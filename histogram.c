@@ -0,0 +1,67 @@
+/*
+ *	Log-linear histograms
+ *
+ *	Values below HIST_SUB_BUCKETS get a bucket each. Above that a value
+ *	with its top bit at position e keeps its top HIST_SUB_BITS + 1 bits:
+ *	the leading one picks the power of two and the rest the step in it.
+ */
+
+#include "histogram.h"
+
+static unsigned histogram_bucket(uint64_t value)
+{
+	unsigned shift;
+	unsigned b;
+
+	if (value < HIST_SUB_BUCKETS)
+		return value;
+	shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+	b = (shift + 1) * HIST_SUB_BUCKETS +
+		(value >> shift) - HIST_SUB_BUCKETS;
+	if (b >= HIST_BUCKETS)
+		b = HIST_BUCKETS - 1;
+	return b;
+}
+
+void histogram_record(struct histogram *h, uint64_t value)
+{
+	h->bucket[histogram_bucket(value)]++;
+	h->count++;
+	h->sum += value;
+	if (value > h->max)
+		h->max = value;
+}
+
+/* The largest value that lands in a bucket */
+uint64_t histogram_bucket_limit(unsigned bucket)
+{
+	unsigned shift;
+	uint64_t step;
+
+	if (bucket < HIST_SUB_BUCKETS)
+		return bucket;
+	shift = bucket / HIST_SUB_BUCKETS - 1;
+	step = bucket % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS;
+	return ((step + 1) << shift) - 1;
+}
+
+/* Upper bound of the bucket holding the given percentile, 0 if empty */
+uint64_t histogram_percentile(const struct histogram *h, double percent)
+{
+	uint64_t want = h->count * percent / 100.0;
+	uint64_t seen = 0;
+	unsigned i;
+
+	if (h->count == 0)
+		return 0;
+	if (want == 0)
+		want = 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= want)
+			break;
+	}
+	if (i == HIST_BUCKETS || histogram_bucket_limit(i) > h->max)
+		return h->max;
+	return histogram_bucket_limit(i);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ *	Log-linear histograms in the style of HdrHistogram. Each power of two
+ *	is cut into HIST_SUB_BUCKETS equal steps, so a value is kept to within
+ *	1/HIST_SUB_BUCKETS of itself whatever its size, and recording one is
+ *	a count leading zeros and an increment. Values past 2^HIST_MAX_BITS
+ *	land in the last bucket.
+ */
+#define HIST_SUB_BITS		4
+#define HIST_SUB_BUCKETS	(1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS		40
+#define HIST_BUCKETS		((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t bucket[HIST_BUCKETS];
+};
+
+void histogram_record(struct histogram *h, uint64_t value);
+uint64_t histogram_bucket_limit(unsigned bucket);
+uint64_t histogram_percentile(const struct histogram *h, double percent);
@@ -0,0 +1,167 @@
+/*
+ *	Machine profiles
+ *
+ *	A profile sets a machine up in one go: the boards fitted, the ROMs
+ *	and where they go, the Hawk platters and the switches. A few common
+ *	ones are built in and anything else is read from a file, one setting
+ *	to a line:
+ *
+ *	diag			fit the diagnostic board
+ *	finch			the Finch floppy controller
+ *	ram <n>			<n>K of RAM
+ *	rom <file>@<addr>	a ROM image at a physical address (hex)
+ *	hawk <unit> <file>	the image for Hawk platter <unit>, 0-7
+ *	switches <n>		CPU switches
+ *	diag-switches <n>	diag board switches
+ *
+ *	Blank lines and lines starting with # are ignored. Once a profile
+ *	names any Hawk platter only the ones it names are opened, so a
+ *	machine with one drive doesn't go looking for the rest. A missing
+ *	image leaves the platter out, as it always has. Command line options
+ *	after --machine override the profile.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "machine.h"
+
+static const struct {
+	const char *name;
+	const char *text;
+} builtin[] = {
+	{ "diag", "diag\n" },
+	{ "hawk", "hawk 0 hawk0.disk\nhawk 1 hawk1.disk\n" },
+	{ "finch", "finch\n" },
+	{ NULL, NULL }
+};
+
+static const char *machine_name;
+static struct machine machine;
+
+static void machine_syntax(unsigned line, const char *why)
+{
+	fprintf(stderr, "%s:%u: %s\n", machine_name, line, why);
+	exit(1);
+}
+
+static char *machine_strdup(const char *p, unsigned len)
+{
+	char *s = malloc(len + 1);
+
+	if (s == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	memcpy(s, p, len);
+	s[len] = 0;
+	return s;
+}
+
+/* The rest of the line as one word, trailing space dropped */
+static char *machine_arg(const char *p, unsigned line)
+{
+	unsigned len;
+
+	p += strspn(p, " \t");
+	len = strcspn(p, "\r\n");
+	while (len && (p[len - 1] == ' ' || p[len - 1] == '\t'))
+		len--;
+	if (len == 0)
+		machine_syntax(line, "missing argument");
+	return machine_strdup(p, len);
+}
+
+static void machine_line(const char *buf, unsigned line)
+{
+	char cmd[16];
+	unsigned unit;
+	int n, m;
+
+	if (sscanf(buf, " %15s%n", cmd, &n) != 1 || *cmd == '#')
+		return;
+	buf += n;
+	if (strcmp(cmd, "diag") == 0)
+		machine.diag = 1;
+	else if (strcmp(cmd, "finch") == 0)
+		machine.finch = 1;
+	else if (strcmp(cmd, "ram") == 0)
+		machine.ram = machine_arg(buf, line);
+	else if (strcmp(cmd, "rom") == 0) {
+		if (machine.num_roms == MACHINE_MAX_ROMS)
+			machine_syntax(line, "too many ROMs");
+		machine.rom[machine.num_roms++] = machine_arg(buf, line);
+	} else if (strcmp(cmd, "hawk") == 0) {
+		if (sscanf(buf, " %u%n", &unit, &m) != 1
+		    || unit >= MACHINE_HAWK_UNITS)
+			machine_syntax(line, "bad Hawk unit");
+		machine.hawk[unit] = machine_arg(buf + m, line);
+		machine.hawk_given = 1;
+	} else if (strcmp(cmd, "switches") == 0) {
+		if (sscanf(buf, " %i", &machine.switches) != 1)
+			machine_syntax(line, "bad switches");
+	} else if (strcmp(cmd, "diag-switches") == 0) {
+		if (sscanf(buf, " %i", &machine.diag_switches) != 1)
+			machine_syntax(line, "bad switches");
+	} else
+		machine_syntax(line, "unknown setting");
+}
+
+static void machine_parse(const char *text)
+{
+	unsigned line = 0;
+
+	while (*text) {
+		machine_line(text, ++line);
+		text += strcspn(text, "\n");
+		if (*text)
+			text++;
+	}
+}
+
+/* A built in profile by name, or else a profile file */
+const struct machine *machine_load(const char *name)
+{
+	FILE *fp;
+	char *text;
+	long len;
+	unsigned i;
+
+	memset(&machine, 0, sizeof(machine));
+	machine.switches = -1;
+	machine.diag_switches = -1;
+	machine_name = name;
+
+	for (i = 0; builtin[i].name; i++) {
+		if (strcmp(builtin[i].name, name) == 0) {
+			machine_parse(builtin[i].text);
+			return &machine;
+		}
+	}
+
+	fp = fopen(name, "r");
+	if (fp == NULL) {
+		perror(name);
+		exit(1);
+	}
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	rewind(fp);
+	text = malloc(len + 1);
+	if (text == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	if (len && fread(text, len, 1, fp) != 1) {
+		fprintf(stderr, "%s: read error.\n", name);
+		exit(1);
+	}
+	fclose(fp);
+	text[len] = 0;
+	if ((long)strlen(text) != len)
+		machine_syntax(1, "not a text file");
+	machine_parse(text);
+	free(text);
+	return &machine;
+}
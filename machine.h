@@ -0,0 +1,19 @@
+#pragma once
+
+#define MACHINE_MAX_ROMS	8
+#define MACHINE_HAWK_UNITS	8
+
+/* Settings left as NULL or -1 keep what they were */
+struct machine {
+	unsigned diag;
+	unsigned finch;
+	char *ram;
+	char *rom[MACHINE_MAX_ROMS];	/* file@addr as for --rom */
+	unsigned num_roms;
+	char *hawk[MACHINE_HAWK_UNITS];	/* Platter images */
+	unsigned hawk_given;
+	int switches;
+	int diag_switches;
+};
+
+const struct machine *machine_load(const char *name);
@@ -4,11 +4,15 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "batch.h"
 #include "centurion.h"
+#include "checkpoint.h"
 #include "console.h"
 #include "cpu6.h"
 #include "mux.h"
+#include "replay.h"
 #include "scheduler.h"
+#include "stats.h"
 #include "trace.h"
 
 #define TRACE_WITH_CHAR(val, ...)					\
@@ -38,6 +42,7 @@ static void mux_reset(void)
 		mux[i].tx_done       = 0;
 		mux[i].rx_ready_time = 0;
 	        mux[i].tx_done_time  = 0;
+		mux[i].inject        = MUX_INJECT_NONE;
 	}
 
 	irq_level   = 0;
@@ -57,15 +62,44 @@ void mux_init(void)
 	}
 
 	mux_reset();
+
+	CHECKPOINT(mux);
+	CHECKPOINT(irq_level);
+	CHECKPOINT(irq_enabled);
+	CHECKPOINT(irq_cause);
+	CHECKPOINT(poll_count);
 }
 
 void mux_attach(unsigned unit, int in_fd, int out_fd)
 {
+	/* The host I/O thread took its copy of the descriptors at start */
+	assert(!hostio_enabled);
 	mux[unit].in_fd = in_fd;
 	mux[unit].out_fd = out_fd;
 }
 
 /* Utility functions for the mux */
+
+/* One byte from the host, with the return conventions of read() */
+static int mux_host_read(uint8_t unit, unsigned char *c)
+{
+	int r;
+
+	if (hostio_enabled) {
+		r = hostio_read(unit);
+		if (r == -1) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if (r == HOSTIO_EOF)
+			return 0;
+		*c = r;
+		return 1;
+	}
+	host_syscalls++;
+	return read(mux[unit].in_fd, c, 1);
+}
+
 static unsigned int next_char(uint8_t unit)
 {
 	int r;
@@ -81,19 +115,32 @@ static unsigned int next_char(uint8_t unit)
 		return mux[unit].lastc;
 	}
 
-	r = read(mux[unit].in_fd, &c, 1);
-
-	if (r == 0) {
-		emulator_done = 1;
-		return mux[unit].lastc;
-	}
+	/* Characters injected by replay or scripting bypass the host fd */
+	if (mux[unit].inject != MUX_INJECT_NONE) {
+		r = mux[unit].inject;
+		mux[unit].inject = MUX_INJECT_NONE;
+		if (r == MUX_INJECT_EOF) {
+			emulator_done = 1;
+			return mux[unit].lastc;
+		}
+		c = r;
+	} else {
+		r = mux_host_read(unit, &c);
 
-	if (r < 0) {
-		/* Someone read the port when nothing there */
-		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		if (r == 0) {
+			replay_record(unit, mux[unit].rx_arrival_time, REPLAY_EOF);
+			emulator_done = 1;
 			return mux[unit].lastc;
 		}
-		exit(1);
+
+		if (r < 0) {
+			/* Someone read the port when nothing there */
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return mux[unit].lastc;
+			}
+			exit(1);
+		}
+		replay_record(unit, mux[unit].rx_arrival_time, c);
 	}
 
 	if (c == 0x7F) {
@@ -103,6 +150,7 @@ static unsigned int next_char(uint8_t unit)
 
 
 	mux[unit].lastc = c;
+	stats.mux_rx[unit]++;
 
 	return c;
 }
@@ -139,16 +187,33 @@ static void mux_unit_send(unsigned unit, uint8_t val) {
 	// it takes time for the send to complete
 	mux[unit].tx_done_time = get_current_time() + (symbol_time * 10);
 
+	/* Sent already the first time through */
+	if (checkpoint_rerun)
+		return;
+
+	batch_output(unit, val);
+	stats.mux_tx[unit]++;
+
 	if (mux[unit].out_fd == -1) {
 		/* This MUX unit isn't connected to anything */
 		return;
 	}
 
-	if (mux[unit].out_fd > 1) {
-		val &= 0x7F;
-		write(mux[unit].out_fd, &val, 1);
+	if (hostio_enabled) {
+		hostio_write(unit, val);
+		return;
+	}
+	host_syscalls++;
+	mux_host_write(mux[unit].out_fd, val);
+}
+
+/* Pass a transmitted byte to the host side of a unit writing to out_fd */
+void mux_host_write(int out_fd, uint8_t val)
+{
+	val &= 0x7F;
+	if (out_fd > 1) {
+		write(out_fd, &val, 1);
 	} else {
-		val &= 0x7F;
 		if (val == 0x06) /* Cursor one position right */
 			printf("\x1b[1C");
 		else if (val != 0x08 && val != 0x0A && val != 0x0D
@@ -236,6 +301,8 @@ void mux_write(uint16_t addr, uint8_t val, uint32_t trace)
 	/* Register 9 isn't used */
 	case 0xA: // Set interrupt request level
 		TRACE_PC("MUX%i: IRQ level = %i", unit, val);
+		/* An interrupt already raised moves on the next poll */
+		cpu_deassert_irq(irq_level);
 		irq_level = val;
 		break;
 	case 0xB:
@@ -344,14 +411,46 @@ void mux_set_read_ready(unsigned unit, unsigned trace)
 
 	// We need a delay here, otherwise interrupts would fire too fast.
 	uint64_t symbol_time = (ONE_SECOND_NS / mux[unit].baud);
-	mux[unit].rx_ready_time = get_current_time() + symbol_time * 10;
+	mux[unit].rx_arrival_time = get_current_time();
+	mux[unit].rx_ready_time = mux[unit].rx_arrival_time + symbol_time * 10;
+}
+
+/* Feed a character to a unit as if it had just arrived on its input fd */
+void mux_inject(unsigned unit, int c, unsigned trace)
+{
+	mux[unit].inject = c;
+	mux_set_read_ready(unit, trace);
+}
+
+/* When the character waiting on the unit arrived, if it is still to be
+   read from the host fd, else -1 */
+int64_t mux_host_pending(unsigned unit)
+{
+	if (!(mux[unit].status & MUX_RX_READY) && !mux[unit].rx_ready_time)
+		return -1;
+	if (mux[unit].inject != MUX_INJECT_NONE)
+		return -1;
+	return mux[unit].rx_arrival_time;
+}
+
+/* Have the character waiting on the unit be c rather than from the fd */
+void mux_set_inject(unsigned unit, int c)
+{
+	mux[unit].inject = c;
+}
+
+/* True if the unit cannot take another input character yet */
+int mux_rx_busy(unsigned unit)
+{
+	return (mux[unit].status & MUX_RX_READY) || mux[unit].rx_ready_time
+		|| mux[unit].inject != MUX_INJECT_NONE;
 }
 
 void mux_process_events(unsigned unit, unsigned trace) {
 	int64_t time = get_current_time();
 
 	if (mux[unit].rx_ready_time && mux[unit].rx_ready_time <= time) {
-		assert(mux[unit].in_fd != -1);
+		assert(mux[unit].in_fd != -1 || mux[unit].inject != MUX_INJECT_NONE);
 		mux[unit].rx_ready_time = 0;
 		mux[unit].status |= MUX_RX_READY;
 		poll_count = 0;
@@ -384,12 +483,11 @@ void mux_poll(unsigned trace)
 	for (unit = 0; unit < NUM_MUX_UNITS; unit++)
 		mux_process_events(unit, trace);
 
-	// Cheap speedhack, only check FDs sometimes
-	if ((poll_count++ & 0xF) == 0)
+	// Cheap speedhack, only check FDs sometimes. Going over old ground
+	// after a checkpoint the input comes from the log instead
+	if ((poll_count++ & 0xF) == 0 && !checkpoint_rerun)
 		mux_poll_fds(trace);
 
-	cpu_deassert_irq(irq_level);
-
 	/*
 	 * Updates current IRQ state and chooses current irq_cause register value according to
 	 * unit interrupt priorities. Each unit has two interrupts: RX and TX, and we enumerate
@@ -407,9 +505,55 @@ void mux_poll(unsigned trace)
 	if (irq_cause >= 0)
 		TRACE("MUX: Last mux interrupt acknowledged");
 
+	/* Only drop the line when nothing wants it, so that the CPU sees one
+	   assert per interrupt and not one per poll */
+	cpu_deassert_irq(irq_level);
 	irq_cause = -1;
 }
 
+/*
+ *	For the CPU running a poll loop without going back to the main loop.
+ *	mux_quiet_until() gives the time mux_poll next has something to do,
+ *	or 0 if it would raise an interrupt now. Until then mux_poll_skip()
+ *	does all that mux_poll would, and says when it looked at the host.
+ */
+int64_t mux_quiet_until(void)
+{
+	int64_t until = INT64_MAX;
+	int unit;
+
+	if (irq_cause >= 0)
+		return 0;
+	for (unit = 0; unit < NUM_MUX_UNITS; unit++) {
+		if ((mux[unit].status & MUX_RX_READY) || mux[unit].tx_done)
+			return 0;
+		if (mux[unit].rx_ready_time && mux[unit].rx_ready_time < until)
+			until = mux[unit].rx_ready_time;
+		if (mux[unit].tx_done_time && mux[unit].tx_done_time < until)
+			until = mux[unit].tx_done_time;
+	}
+	return until;
+}
+
+int mux_poll_skip(unsigned trace)
+{
+	if ((poll_count++ & 0xF) == 0 && !checkpoint_rerun) {
+		mux_poll_fds(trace);
+		return 1;
+	}
+	return 0;
+}
+
+/* A status register, which reads without changing anything */
+int mux_read_pure(uint16_t addr)
+{
+	unsigned mode = addr & 0xF;
+
+	if (mode > 7 || (mode & 1))
+		return 0;
+	return ((addr >> 4) & 0xF) * 4 + (mode >> 1) < NUM_MUX_UNITS;
+}
+
 int mux_get_in_poll_fd(unsigned unit)
 {
         /* Do not poll if already has a pending character or of the
@@ -423,3 +567,8 @@ int mux_get_in_fd(unsigned unit)
 {
 	return mux[unit].in_fd;
 }
+
+int mux_get_out_fd(unsigned unit)
+{
+	return mux[unit].out_fd;
+}
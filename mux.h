@@ -1,3 +1,5 @@
+#pragma once
+
 #include <inttypes.h>
 
 #define MUX0_BASE 0xf200
@@ -13,8 +15,14 @@ struct MuxUnit
         unsigned char tx_done;
         int64_t rx_ready_time;
         int64_t tx_done_time;
+        int64_t rx_arrival_time;
+        int inject;
 };
 
+/* Values for inject when no host fd is involved */
+#define MUX_INJECT_NONE -1
+#define MUX_INJECT_EOF  -2
+
 /* Status register bits */
 #define MUX_RX_READY   (1 << 0)
 #define MUX_TX_READY   (1 << 1)
@@ -31,12 +39,21 @@ struct MuxUnit
 void mux_init(void);
 void mux_attach(unsigned unit, int in_fd, int out_fd);
 void mux_poll(unsigned trace);
+int64_t mux_quiet_until(void);
+int mux_poll_skip(unsigned trace);
+int mux_read_pure(uint16_t addr);
 
 void mux_write(uint16_t addr, uint8_t val, uint32_t trace);
+void mux_host_write(int out_fd, uint8_t val);
 uint8_t mux_read(uint16_t addr, uint32_t trace);
 
 void mux_set_read_ready(unsigned unit, unsigned trace);
+void mux_inject(unsigned unit, int c, unsigned trace);
+int mux_rx_busy(unsigned unit);
+int64_t mux_host_pending(unsigned unit);
+void mux_set_inject(unsigned unit, int c);
 int mux_get_in_poll_fd(unsigned unit);
 int mux_get_in_fd(unsigned unit);
+int mux_get_out_fd(unsigned unit);
 
 void mux_poll_fds(unsigned trace);
@@ -0,0 +1,167 @@
+/*
+ *	Hot block profile for --profile
+ *
+ *	The CPU bumps a count for the address of each instruction it runs,
+ *	which is all it costs while the machine is going. The report groups
+ *	the counts into the basic blocks cpu6dis found (its -B output, given
+ *	with --blocks) and lists them by instructions run. Without a block
+ *	file each address stands on its own. Addresses are the logical ones,
+ *	so code run under different maps adds up together.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu6.h"
+#include "disassemble.h"
+#include "profile.h"
+
+#define PROFILE_NAME	DIS_TEXT
+#define PROFILE_TOP	100	/* Addresses listed without blocks */
+
+struct block {
+	uint16_t start;
+	uint16_t end;		/* Last byte */
+	uint64_t entries;
+	uint64_t insns;
+	char name[PROFILE_NAME];
+};
+
+uint32_t *profile_hits;
+
+static struct block *blocks;
+static unsigned num_blocks;
+
+static void *profile_alloc(size_t len)
+{
+	void *p = calloc(1, len);
+
+	if (p == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	return p;
+}
+
+/* Lines of <start> <end> [<instructions>] [<name>], the end exclusive */
+static void profile_load(const char *name)
+{
+	FILE *fp = fopen(name, "r");
+	char buf[256];
+	char *p;
+	unsigned start, end, max = 0;
+	int n;
+
+	if (fp == NULL) {
+		perror(name);
+		exit(1);
+	}
+	while (fgets(buf, sizeof(buf), fp)) {
+		if (*buf == '#' || *buf == '\n')
+			continue;
+		if (sscanf(buf, "%x %x%n", &start, &end, &n) < 2
+		    || start >= end || end > 0x10000) {
+			fprintf(stderr, "%s: bad block '%s'\n", name,
+				strtok(buf, "\n"));
+			exit(1);
+		}
+		if (num_blocks == max) {
+			max = max ? max * 2 : 256;
+			blocks = realloc(blocks, max * sizeof(*blocks));
+			if (blocks == NULL) {
+				fprintf(stderr, "Out of memory.\n");
+				exit(1);
+			}
+		}
+		memset(&blocks[num_blocks], 0, sizeof(*blocks));
+		blocks[num_blocks].start = start;
+		blocks[num_blocks].end = end - 1;
+		/* Past the instruction count to the name */
+		strtoul(buf + n, &p, 10);
+		if (sscanf(p, "%79s", blocks[num_blocks].name) != 1)
+			snprintf(blocks[num_blocks].name, PROFILE_NAME, "L%04X",
+				start);
+		num_blocks++;
+	}
+	fclose(fp);
+}
+
+void profile_init(const char *block_file)
+{
+	profile_hits = profile_alloc(65536 * sizeof(*profile_hits));
+	if (block_file)
+		profile_load(block_file);
+}
+
+static int block_cmp(const void *a, const void *b)
+{
+	const struct block *ba = a, *bb = b;
+
+	if (ba->insns != bb->insns)
+		return ba->insns < bb->insns ? 1 : -1;
+	return ba->start - bb->start;
+}
+
+/* One block per address that ran, its text from memory as it is now */
+static void profile_addresses(void)
+{
+	struct dis_insn insn;
+	unsigned addr, n = 0;
+
+	for (addr = 0; addr < 65536; addr++)
+		if (profile_hits[addr])
+			n++;
+	blocks = profile_alloc((n ? n : 1) * sizeof(*blocks));
+	for (addr = 0; addr < 65536; addr++) {
+		if (profile_hits[addr] == 0)
+			continue;
+		blocks[num_blocks].start = addr;
+		blocks[num_blocks].end = addr;
+		dis_decode(&insn, addr, mmu_mem_read8_debug);
+		snprintf(blocks[num_blocks].name, PROFILE_NAME, "%s",
+			insn.text);
+		num_blocks++;
+	}
+}
+
+void profile_report(const char *name)
+{
+	FILE *fp;
+	uint64_t total = 0, covered = 0;
+	unsigned i, addr, shown;
+
+	fp = fopen(name, "w");
+	if (fp == NULL) {
+		perror(name);
+		return;
+	}
+	for (addr = 0; addr < 65536; addr++)
+		total += profile_hits[addr];
+	shown = num_blocks;
+	if (num_blocks == 0) {
+		profile_addresses();
+		shown = num_blocks < PROFILE_TOP ? num_blocks : PROFILE_TOP;
+	}
+	for (i = 0; i < num_blocks; i++) {
+		struct block *b = &blocks[i];
+
+		b->entries = profile_hits[b->start];
+		for (addr = b->start; addr <= b->end; addr++)
+			b->insns += profile_hits[addr];
+		covered += b->insns;
+	}
+	qsort(blocks, num_blocks, sizeof(*blocks), block_cmp);
+
+	fprintf(fp, "# %llu instructions, %.1f%% in the blocks listed\n",
+		(unsigned long long)total,
+		total ? 100.0 * covered / total : 0.0);
+	fprintf(fp, "# start last  entries      instructions     %%  name\n");
+	for (i = 0; i < shown && blocks[i].insns; i++)
+		fprintf(fp, "%04X  %04X  %12llu %12llu %5.1f  %s\n",
+			blocks[i].start, blocks[i].end,
+			(unsigned long long)blocks[i].entries,
+			(unsigned long long)blocks[i].insns,
+			100.0 * blocks[i].insns / total, blocks[i].name);
+	fclose(fp);
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Times each address has been run, NULL unless profiling */
+extern uint32_t *profile_hits;
+
+void profile_init(const char *block_file);
+void profile_report(const char *name);
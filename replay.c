@@ -0,0 +1,201 @@
+/*
+ *	Deterministic record and replay of MUX input
+ *
+ *	The only thing that makes two runs of the same image differ is when
+ *	host input shows up in emulated time. In record mode every byte the
+ *	guest takes from a MUX port is logged along with the emulated time it
+ *	was seen arriving. In replay mode the host fds are never touched and
+ *	the same bytes are injected from a scheduler event at those exact
+ *	times, so the guest executes the same instruction stream again.
+ *
+ *	The log is plain text, one byte per line:
+ *
+ *	<arrival ns> <mux unit> <byte in hex | EOF>
+ *
+ *	With checkpoints the log is kept in memory as well, whether or not it
+ *	goes to a file, and used in just the same way to go over the input
+ *	again after one is put back.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "checkpoint.h"
+#include "mux.h"
+#include "replay.h"
+#include "scheduler.h"
+
+struct replay_entry {
+	int64_t time;
+	unsigned unit;
+	int c;
+};
+
+static FILE *record_fp;
+
+static struct replay_entry *replay_log;
+static unsigned replay_len;
+static unsigned replay_next;
+static unsigned replay_keeping;
+
+static void replay_event_cb(struct event_t *event, int64_t late_ns);
+static struct event_t replay_evt = {
+	.name = "replay",
+	.callback = replay_event_cb
+};
+
+void replay_record_open(const char *path)
+{
+	record_fp = fopen(path, "w");
+	if (record_fp == NULL) {
+		perror(path);
+		exit(1);
+	}
+	fprintf(record_fp, "# centurion input log\n");
+}
+
+static void replay_add(struct replay_entry *e)
+{
+	unsigned i;
+
+	replay_log = realloc(replay_log, (replay_len + 1) * sizeof(*replay_log));
+	if (replay_log == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	/* Bytes are logged when the guest reads them, so units can interleave
+	   out of arrival order. Keep it sorted by time, in the order logged
+	   for ties, which nearly always means adding to the end */
+	for (i = replay_len; i && replay_log[i - 1].time > e->time; i--)
+		replay_log[i] = replay_log[i - 1];
+	replay_log[i] = *e;
+	replay_len++;
+}
+
+void replay_record(unsigned unit, int64_t time, int c)
+{
+	struct replay_entry e;
+
+	/* Bytes read going over old ground came from the log to start with */
+	if (checkpoint_rerun)
+		return;
+	if (replay_keeping) {
+		e.time = time;
+		e.unit = unit;
+		e.c = c;
+		replay_add(&e);
+		replay_next = replay_len;
+	}
+	if (record_fp == NULL)
+		return;
+	if (c == REPLAY_EOF)
+		fprintf(record_fp, "%" PRId64 " %u EOF\n", time, unit);
+	else
+		fprintf(record_fp, "%" PRId64 " %u %02X\n", time, unit, c);
+	fflush(record_fp);
+}
+
+static void replay_schedule(void)
+{
+	if (replay_next == replay_len)
+		return;
+	replay_evt.delta_ns = replay_log[replay_next].time - get_current_time();
+	schedule_event(&replay_evt);
+}
+
+static void replay_event_cb(struct event_t *event, int64_t late_ns)
+{
+	int64_t now = get_current_time();
+
+	while (replay_next < replay_len && replay_log[replay_next].time <= now) {
+		struct replay_entry *e = &replay_log[replay_next];
+
+		if (mux_rx_busy(e->unit)) {
+			/* Only happens if the run has diverged from the recording */
+			fprintf(stderr, "replay: MUX%u busy at %" PRId64 ", input delayed\n",
+				e->unit, now);
+			replay_evt.delta_ns = ONE_MILISECOND_NS;
+			schedule_event(&replay_evt);
+			return;
+		}
+		mux_inject(e->unit, e->c == REPLAY_EOF ? MUX_INJECT_EOF : e->c, 0);
+		replay_next++;
+	}
+	replay_schedule();
+}
+
+void replay_open(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	char line[128];
+	unsigned lineno = 0;
+
+	if (fp == NULL) {
+		perror(path);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		struct replay_entry e;
+		char byte[8];
+
+		lineno++;
+		if (*line == '#' || *line == '\n')
+			continue;
+		if (sscanf(line, "%" SCNd64 " %u %7s", &e.time, &e.unit, byte) != 3
+		    || e.unit >= NUM_MUX_UNITS) {
+			fprintf(stderr, "%s:%u: bad replay entry\n", path, lineno);
+			exit(1);
+		}
+		if (strcmp(byte, "EOF") == 0)
+			e.c = REPLAY_EOF;
+		else
+			e.c = strtoul(byte, NULL, 16) & 0xFF;
+
+		replay_add(&e);
+	}
+	fclose(fp);
+
+	replay_schedule();
+	/* Checkpoints just need to know how far along it is */
+	CHECKPOINT(replay_next);
+}
+
+/*
+ *	A checkpoint has been put back. Everything that had arrived by then
+ *	has been handed to the MUX already, apart from what was still waiting
+ *	to be read from the host fd. The log has that too.
+ */
+static void replay_rewind(void *arg)
+{
+	int64_t now = get_current_time();
+	int64_t arrived;
+	unsigned unit, i;
+
+	for (replay_next = 0; replay_next < replay_len; replay_next++)
+		if (replay_log[replay_next].time > now)
+			break;
+	for (unit = 0; unit < NUM_MUX_UNITS; unit++) {
+		arrived = mux_host_pending(unit);
+		if (arrived == -1)
+			continue;
+		for (i = replay_next; i-- > 0; ) {
+			if (replay_log[i].unit == unit
+			    && replay_log[i].time == arrived) {
+				mux_set_inject(unit, replay_log[i].c == REPLAY_EOF
+					? MUX_INJECT_EOF : replay_log[i].c);
+				break;
+			}
+		}
+	}
+	cancel_event(&replay_evt);
+	replay_schedule();
+}
+
+/* Keep the input as it is read, for going over it again */
+void replay_keep(void)
+{
+	replay_keeping = 1;
+	checkpoint_hook(replay_rewind, NULL);
+}
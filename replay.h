@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Marker logged in place of a byte when the input fd hits end of file */
+#define REPLAY_EOF	-1
+
+void replay_record_open(const char *path);
+void replay_record(unsigned unit, int64_t time, int c);
+
+void replay_open(const char *path);
+void replay_keep(void);
@@ -8,6 +8,7 @@
 static struct event_t* event_list = NULL;
 static uint64_t next_event = UINT64_MAX;
 static unsigned trace_schedule = 0;
+static struct event_t* known_events = NULL;
 
 static void update_next_event()
 {
@@ -35,7 +36,13 @@ void schedule_event(struct event_t *event)
         }
     }
 
-    if (event->next != NULL) {
+    if (!event->known) {
+        event->known = 1;
+        event->known_next = known_events;
+        known_events = event;
+    }
+
+    if (event->queued) {
         if (trace_schedule) {
             fprintf(stderr, "%s was already scheduled.\n", event->name);
         }
@@ -52,6 +59,7 @@ void schedule_event(struct event_t *event)
     }
     event->next = *next_ptr;
     *next_ptr = event;
+    event->queued = 1;
 
     update_next_event();
 }
@@ -69,6 +77,7 @@ void run_scheduler(uint64_t current_time, unsigned trace)
         struct event_t* event = event_list;
         event_list = event->next;
         event->next = NULL;
+        event->queued = 0;
         update_next_event();
 
         int64_t late_ns = current_time - event->scheduled_ns;
@@ -80,6 +89,9 @@ void run_scheduler(uint64_t current_time, unsigned trace)
                 seconds, us, event->name, (double)late_ns / ONE_MICROSECOND_NS);
         }
 
+        event->dispatched++;
+        event->late_ns += late_ns;
+
         // Run callback
         event->callback(event, late_ns);
     }
@@ -104,6 +116,7 @@ void cancel_event(struct event_t *event)
         if (next == event) {
             *next_ptr = next->next;
             event->next = NULL;
+            event->queued = 0;
             update_next_event();
             return;
         }
@@ -111,6 +124,63 @@ void cancel_event(struct event_t *event)
     }
 }
 
+// Every event that has been scheduled, most recent first
+const struct event_t *scheduler_events(void)
+{
+    return known_events;
+}
+
+// Copy the queue in order, returns how many events are on it. The copy is
+// the caller's to free.
+unsigned scheduler_save(struct saved_event **saved)
+{
+    struct event_t *event;
+    unsigned count = 0;
+
+    for (event = event_list; event; event = event->next)
+        count++;
+    *saved = malloc((count ? count : 1) * sizeof(**saved));
+    if (*saved == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    count = 0;
+    for (event = event_list; event; event = event->next) {
+        struct saved_event *s = &(*saved)[count++];
+
+        s->event = event;
+        s->delta_ns = event->delta_ns;
+        s->callback = event->callback;
+        s->name = event->name;
+        s->scheduled_ns = event->scheduled_ns;
+    }
+    return count;
+}
+
+// Put the queue back as it was saved. Anything scheduled since is dropped.
+void scheduler_restore(const struct saved_event *saved, unsigned count)
+{
+    struct event_t **next_ptr = &event_list;
+    struct event_t *event;
+
+    for (event = known_events; event; event = event->known_next) {
+        event->next = NULL;
+        event->queued = 0;
+    }
+    for (; count; count--, saved++) {
+        event = saved->event;
+        event->delta_ns = saved->delta_ns;
+        event->callback = saved->callback;
+        event->name = saved->name;
+        event->scheduled_ns = saved->scheduled_ns;
+        event->queued = 1;
+        *next_ptr = event;
+        next_ptr = &event->next;
+    }
+    *next_ptr = NULL;
+    update_next_event();
+}
+
 int64_t scheduler_next()
 {
     if (event_list == NULL)
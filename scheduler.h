@@ -23,6 +23,13 @@ struct event_t {
     // internal state
     struct event_t *next;
     int64_t scheduled_ns;
+    unsigned queued; // The last on the queue has no next, so kept apart
+
+    // statistics, kept for every event that has ever been scheduled
+    struct event_t *known_next;
+    unsigned known;
+    uint64_t dispatched;
+    uint64_t late_ns;
 };
 
 void schedule_event(struct event_t *event);
@@ -30,3 +37,16 @@ void cancel_event(struct event_t *event);
 void run_scheduler(uint64_t current_time, unsigned trace);
 int64_t scheduler_next();
 int64_t get_current_time();
+const struct event_t *scheduler_events(void);
+
+// The queue as it stands, for checkpoints
+struct saved_event {
+    struct event_t *event;
+    int64_t delta_ns;
+    callback_t callback;
+    const char *name;
+    int64_t scheduled_ns;
+};
+
+unsigned scheduler_save(struct saved_event **saved);
+void scheduler_restore(const struct saved_event *saved, unsigned count);
@@ -0,0 +1,199 @@
+/*
+ *	Emulator counters, written out in the Prometheus text format
+ *
+ *	The file is written at exit and whenever the emulator gets SIGUSR1.
+ *	It goes to a temporary name first and is renamed into place so that
+ *	a scraper (for example the node exporter textfile collector) never
+ *	sees half a report.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "centurion.h"
+#include "scheduler.h"
+#include "stats.h"
+
+struct stats stats;
+volatile sig_atomic_t stats_requested;
+
+static const char *stats_path;
+
+#ifdef SIGUSR1
+static void stats_signal(int sig)
+{
+	stats_requested = 1;
+}
+#endif
+
+void stats_init(const char *path)
+{
+	stats_path = path;
+#ifdef SIGUSR1
+	signal(SIGUSR1, stats_signal);
+#endif
+}
+
+static void metric(FILE *fp, const char *name, const char *type,
+	const char *help)
+{
+	fprintf(fp, "# HELP centurion_%s %s\n", name, help);
+	fprintf(fp, "# TYPE centurion_%s %s\n", name, type);
+}
+
+static void counter(FILE *fp, const char *name, const char *help,
+	uint64_t value)
+{
+	metric(fp, name, "counter", help);
+	fprintf(fp, "centurion_%s %llu\n", name, (unsigned long long)value);
+}
+
+static void seconds(FILE *fp, const char *name, const char *help,
+	uint64_t ns)
+{
+	metric(fp, name, "counter", help);
+	fprintf(fp, "centurion_%s %.9f\n", name, ns / ONE_SECOND_NS);
+}
+
+/* True if an event earlier in the list has the same name */
+static int event_seen(const struct event_t *event)
+{
+	const struct event_t *e;
+
+	for (e = scheduler_events(); e != event; e = e->known_next)
+		if (strcmp(e->name, event->name) == 0)
+			return 1;
+	return 0;
+}
+
+/* Scheduler events, summed by name */
+static void event_counters(FILE *fp, unsigned late)
+{
+	const struct event_t *event, *e;
+	uint64_t n;
+
+	if (late)
+		metric(fp, "scheduler_late_seconds_total", "counter",
+			"Time events were dispatched after they were due.");
+	else
+		metric(fp, "scheduler_events_total", "counter",
+			"Scheduler events dispatched.");
+	for (event = scheduler_events(); event; event = event->known_next) {
+		if (event_seen(event))
+			continue;
+		n = 0;
+		for (e = event; e; e = e->known_next)
+			if (strcmp(e->name, event->name) == 0)
+				n += late ? e->late_ns : e->dispatched;
+		if (late)
+			fprintf(fp, "centurion_scheduler_late_seconds_total"
+				"{event=\"%s\"} %.9f\n", event->name,
+				n / ONE_SECOND_NS);
+		else
+			fprintf(fp, "centurion_scheduler_events_total"
+				"{event=\"%s\"} %llu\n", event->name,
+				(unsigned long long)n);
+	}
+}
+
+static void per_unit(FILE *fp, const char *name, const char *label,
+	const char *help, const uint64_t *values, unsigned n)
+{
+	unsigned i;
+
+	metric(fp, name, "counter", help);
+	for (i = 0; i < n; i++)
+		fprintf(fp, "centurion_%s{%s=\"%u\"} %llu\n", name, label, i,
+			(unsigned long long)values[i]);
+}
+
+/* One histogram per IPL that has seen anything, cumulative as Prometheus
+   wants it, with a bound at each occupied bucket */
+static void irq_histogram(FILE *fp, const char *name, const char *help,
+	const struct histogram *h)
+{
+	uint64_t n;
+	unsigned ipl, i;
+
+	metric(fp, name, "histogram", help);
+	for (ipl = 0; ipl < 16; ipl++, h++) {
+		if (h->count == 0)
+			continue;
+		n = 0;
+		for (i = 0; i < HIST_BUCKETS; i++) {
+			if (h->bucket[i] == 0)
+				continue;
+			n += h->bucket[i];
+			fprintf(fp, "centurion_%s_bucket{ipl=\"%u\",le=\"%.9f\"} "
+				"%llu\n", name, ipl,
+				histogram_bucket_limit(i) / ONE_SECOND_NS,
+				(unsigned long long)n);
+		}
+		fprintf(fp, "centurion_%s_bucket{ipl=\"%u\",le=\"+Inf\"} %llu\n",
+			name, ipl, (unsigned long long)h->count);
+		fprintf(fp, "centurion_%s_sum{ipl=\"%u\"} %.9f\n", name, ipl,
+			h->sum / ONE_SECOND_NS);
+		fprintf(fp, "centurion_%s_count{ipl=\"%u\"} %llu\n", name, ipl,
+			(unsigned long long)h->count);
+	}
+}
+
+void stats_write(uint64_t instructions, uint64_t emulated_ns,
+	uint64_t wall_ns)
+{
+	char *tmp;
+	FILE *fp;
+
+	if (stats_path == NULL)
+		return;
+	tmp = malloc(strlen(stats_path) + 5);
+	if (tmp == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	sprintf(tmp, "%s.tmp", stats_path);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		perror(tmp);
+		free(tmp);
+		return;
+	}
+	counter(fp, "instructions_total", "Instructions executed.",
+		instructions);
+	seconds(fp, "emulated_seconds_total", "Emulated time.", emulated_ns);
+	seconds(fp, "wall_seconds_total", "Host time since start.", wall_ns);
+	seconds(fp, "throttle_sleep_seconds_total",
+		"Host time spent waiting for real time.",
+		stats.throttle_sleep_ns);
+	counter(fp, "host_syscalls_total", "Host system calls made.",
+		host_syscalls);
+	event_counters(fp, 0);
+	event_counters(fp, 1);
+	counter(fp, "hawk_seeks_total", "Hawk seeks started.",
+		stats.hawk_seeks);
+	counter(fp, "hawk_track_loads_total", "Hawk tracks read from images.",
+		stats.hawk_track_loads);
+	counter(fp, "dma_bytes_total", "Bytes moved by DMA.", stats.dma_bytes);
+	counter(fp, "parity_errors_total",
+		"Reads of memory with bad or no parity.", stats.parity_errors);
+	per_unit(fp, "mux_rx_bytes_total", "port", "MUX bytes received.",
+		stats.mux_rx, NUM_MUX_UNITS);
+	per_unit(fp, "mux_tx_bytes_total", "port", "MUX bytes sent.",
+		stats.mux_tx, NUM_MUX_UNITS);
+	per_unit(fp, "interrupts_total", "ipl", "Interrupts taken.",
+		stats.interrupts, 16);
+	irq_histogram(fp, "irq_latency_seconds",
+		"Emulated time from an interrupt being raised to being taken.",
+		stats.irq_latency);
+	irq_histogram(fp, "irq_service_seconds",
+		"Emulated time from an interrupt being taken to RI or RIM.",
+		stats.irq_service);
+	irq_histogram(fp, "irq_active_seconds",
+		"Emulated time an interrupt level stayed raised.",
+		stats.irq_active);
+	if (fclose(fp) || rename(tmp, stats_path))
+		perror(stats_path);
+	free(tmp);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <signal.h>
+#include <stdint.h>
+
+#include "histogram.h"
+#include "mux.h"
+
+/*
+ *	Counters for --stats. Each one is bumped where the work is done and
+ *	nothing is formatted until a report is asked for, so keeping them
+ *	costs an increment.
+ */
+struct stats {
+	uint64_t hawk_seeks;
+	uint64_t hawk_track_loads;
+	uint64_t dma_bytes;
+	uint64_t parity_errors;
+	uint64_t mux_rx[NUM_MUX_UNITS];
+	uint64_t mux_tx[NUM_MUX_UNITS];
+	uint64_t interrupts[16];	/* Taken, by IPL */
+	uint64_t throttle_sleep_ns;
+	/* Interrupt timing by IPL, in emulated ns */
+	struct histogram irq_latency[16];	/* Assert to taken */
+	struct histogram irq_service[16];	/* Taken to RI/RIM */
+	struct histogram irq_active[16];	/* Assert to deassert */
+};
+
+extern struct stats stats;
+
+/* Set by SIGUSR1, the main loop writes a report when it sees it */
+extern volatile sig_atomic_t stats_requested;
+
+void stats_init(const char *path);
+void stats_write(uint64_t instructions, uint64_t emulated_ns,
+	uint64_t wall_ns);